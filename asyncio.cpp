@@ -0,0 +1,494 @@
+#include "stdafx.h"
+#include "asyncio.h"
+#include "perfcount.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <deque>
+
+extern bool verbose;
+
+static pthread_mutex_t aioMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aioCond = PTHREAD_COND_INITIALIZER;
+static AsyncIoBackend aioBackend;
+static bool aioRunning;
+static pthread_t *aioThreads;
+static int aioThreadCount;
+
+//  thread pool backend
+static std::deque<AsyncRead *> aioQueue;
+
+//  io_uring backend
+static int ringFd = -1;
+static unsigned *sqHead;
+static unsigned *sqTail;
+static unsigned *sqMask;
+static unsigned *sqArray;
+static unsigned sqEntries;
+static struct io_uring_sqe *sqes;
+static unsigned *cqHead;
+static unsigned *cqTail;
+static unsigned *cqMask;
+static struct io_uring_cqe *cqes;
+static void *sqRing;
+static size_t sqRingSize;
+static void *cqRing;
+static size_t cqRingSize;
+static size_t sqesSize;
+static unsigned ringInflight;
+//  the reaper could not wait on the ring any more; new reads bypass it
+static bool ringBroken;
+
+
+AsyncBatch::AsyncBatch() : pending_(0), submitted_(false), failed_(false) {
+    pthread_mutex_init(&mtx_, nullptr);
+    pthread_cond_init(&cond_, nullptr);
+}
+
+AsyncBatch::~AsyncBatch() {
+    if (submitted_) {
+        wait();
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mtx_);
+}
+
+void AsyncBatch::add(int fd, uint64_t offset, size_t size, void *buf) {
+    AsyncRead rd;
+    memset(&rd, 0, sizeof(rd));
+    rd.fd = fd;
+    rd.offset = offset;
+    rd.size = size;
+    rd.buf = (unsigned char *)buf;
+    rd.batch = this;
+    reads_.push_back(rd);
+}
+
+static bool read_sync(AsyncRead *rd) {
+    while (rd->done < rd->size) {
+        ssize_t r = pread(rd->fd, rd->buf + rd->done, rd->size - rd->done, rd->offset + rd->done);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rd->error = errno;
+            return false;
+        }
+        if (r == 0) {
+            break;
+        }
+        rd->done += r;
+    }
+    return rd->done == rd->size;
+}
+
+//  aioMutex must be held, and there must be room in the submission ring
+static void uring_queue(AsyncRead *rd) {
+    unsigned tail = *sqTail;
+    unsigned ix = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[ix];
+    memset(sqe, 0, sizeof(*sqe));
+    rd->iov.iov_base = rd->buf + rd->done;
+    rd->iov.iov_len = rd->size - rd->done;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = rd->fd;
+    sqe->off = rd->offset + rd->done;
+    sqe->addr = (uint64_t)(uintptr_t)&rd->iov;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)rd;
+    sqArray[ix] = ix;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++ringInflight;
+}
+
+//  aioMutex must be held. If the kernel will not take everything queued,
+//  the rest is pulled back out of the submission ring (nothing else reads
+//  it outside io_uring_enter()) and added to refused, for the caller to
+//  read with read_refused() once it lets go of aioMutex; false then.
+//  EBUSY means the completion queue is full, and the reaper needs aioMutex
+//  to empty it, so that is not waited out here either.
+static bool uring_enter(unsigned tosubmit, std::vector<AsyncRead *> &refused) {
+    while (tosubmit) {
+        int r = syscall(__NR_io_uring_enter, ringFd, tosubmit, 0, 0, nullptr, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EBUSY) {
+                fprintf(stderr, "io_uring_enter(): %s\n", strerror(errno));
+            }
+            break;
+        }
+        tosubmit -= r;
+    }
+    if (!tosubmit) {
+        return true;
+    }
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    for (unsigned h = head; h != *sqTail; ++h) {
+        AsyncRead *rd = (AsyncRead *)(uintptr_t)sqes[sqArray[h & *sqMask]].user_data;
+        --ringInflight;
+        if (rd) {
+            refused.push_back(rd);
+        }
+    }
+    __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+    return false;
+}
+
+//  aioMutex must not be held
+static void read_refused(std::vector<AsyncRead *> const &refused) {
+    for (auto rd : refused) {
+        read_sync(rd);
+        rd->batch->read_done(rd);
+    }
+}
+
+void AsyncBatch::submit() {
+    submitted_ = true;
+    pending_ = reads_.size();
+    if (reads_.empty()) {
+        return;
+    }
+    if (aioBackend == AsyncIoNone) {
+        for (auto &rd : reads_) {
+            read_sync(&rd);
+            read_done(&rd);
+        }
+        return;
+    }
+    std::vector<AsyncRead *> refused;
+    pthread_mutex_lock(&aioMutex);
+    if (aioBackend == AsyncIoUring) {
+        size_t i = 0;
+        while (i != reads_.size() && !ringBroken) {
+            unsigned n = 0;
+            while (i != reads_.size() && ringInflight < sqEntries) {
+                uring_queue(&reads_[i]);
+                ++i;
+                ++n;
+            }
+            uring_enter(n, refused);
+            if (i != reads_.size() && ringInflight >= sqEntries && !ringBroken) {
+                //  ring is full; the reaper signals as completions come in
+                pthread_cond_wait(&aioCond, &aioMutex);
+            }
+        }
+        //  once the reaper has given up, reads are done right here
+        for (; i != reads_.size(); ++i) {
+            refused.push_back(&reads_[i]);
+        }
+    }
+    else {
+        for (auto &rd : reads_) {
+            aioQueue.push_back(&rd);
+        }
+        pthread_cond_broadcast(&aioCond);
+    }
+    pthread_mutex_unlock(&aioMutex);
+    read_refused(refused);
+}
+
+bool AsyncBatch::wait() {
+    PerfTimer pt(PerfIoWaitNs);
+    pthread_mutex_lock(&mtx_);
+    while (pending_ > 0) {
+        pthread_cond_wait(&cond_, &mtx_);
+    }
+    bool ok = !failed_;
+    pthread_mutex_unlock(&mtx_);
+    return ok;
+}
+
+void AsyncBatch::read_done(AsyncRead *rd) {
+    perf_add(PerfBytesRead, rd->done);
+    pthread_mutex_lock(&mtx_);
+    if (rd->error || rd->done != rd->size) {
+        if (!failed_ && verbose) {
+            fprintf(stderr, "async read of %ld bytes at %lld failed: %s\n",
+                (long)rd->size, (long long)rd->offset, rd->error ? strerror(rd->error) : "short read");
+        }
+        failed_ = true;
+    }
+    if (--pending_ == 0) {
+        pthread_cond_broadcast(&cond_);
+    }
+    pthread_mutex_unlock(&mtx_);
+}
+
+
+static void *aio_pool_worker(void *) {
+    pthread_mutex_lock(&aioMutex);
+    while (aioRunning) {
+        if (aioQueue.empty()) {
+            pthread_cond_wait(&aioCond, &aioMutex);
+            continue;
+        }
+        AsyncRead *rd = aioQueue.front();
+        aioQueue.pop_front();
+        pthread_mutex_unlock(&aioMutex);
+        read_sync(rd);
+        rd->batch->read_done(rd);
+        pthread_mutex_lock(&aioMutex);
+    }
+    pthread_mutex_unlock(&aioMutex);
+    return 0;
+}
+
+static void *aio_uring_reaper(void *) {
+    bool polling = false;
+    while (true) {
+        if (polling) {
+            //  completions still land in the ring's memory without a wait
+            usleep(1000);
+        }
+        else {
+            int r = syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r < 0 && errno != EINTR) {
+                fprintf(stderr, "io_uring_enter(): %s\n", strerror(errno));
+                //  the kernel still owns the buffers of the reads it took, so
+                //  they stay pending until their completions turn up; new
+                //  reads go around the ring
+                polling = true;
+                pthread_mutex_lock(&aioMutex);
+                ringBroken = true;
+                pthread_cond_broadcast(&aioCond);
+                pthread_mutex_unlock(&aioMutex);
+            }
+        }
+        bool stop = false;
+        std::vector<AsyncRead *> refused;
+        pthread_mutex_lock(&aioMutex);
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned resubmit = 0;
+        while (head != tail) {
+            struct io_uring_cqe const *cqe = &cqes[head & *cqMask];
+            AsyncRead *rd = (AsyncRead *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            ++head;
+            --ringInflight;
+            if (!rd) {
+                stop = true;
+                continue;
+            }
+            if (res == -EINTR || res == -EAGAIN) {
+                if (ringBroken) {
+                    refused.push_back(rd);
+                }
+                else {
+                    uring_queue(rd);
+                    ++resubmit;
+                }
+                continue;
+            }
+            if (res < 0) {
+                rd->error = -res;
+            }
+            else {
+                rd->done += res;
+                if (res > 0 && rd->done < rd->size) {
+                    //  short read, as network file systems like to do
+                    if (ringBroken) {
+                        refused.push_back(rd);
+                    }
+                    else {
+                        uring_queue(rd);
+                        ++resubmit;
+                    }
+                    continue;
+                }
+            }
+            pthread_mutex_unlock(&aioMutex);
+            rd->batch->read_done(rd);
+            pthread_mutex_lock(&aioMutex);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        uring_enter(resubmit, refused);
+        //  once broken, nothing more goes into the ring, so it is done
+        //  when everything in it has come back
+        bool drained = ringBroken && !ringInflight;
+        pthread_cond_broadcast(&aioCond);
+        pthread_mutex_unlock(&aioMutex);
+        read_refused(refused);
+        if (stop || drained) {
+            return 0;
+        }
+    }
+}
+
+static void uring_close() {
+    if (sqes) {
+        munmap(sqes, sqesSize);
+        sqes = nullptr;
+    }
+    if (cqRing && cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    cqRing = nullptr;
+    if (sqRing) {
+        munmap(sqRing, sqRingSize);
+        sqRing = nullptr;
+    }
+    if (ringFd >= 0) {
+        close(ringFd);
+        ringFd = -1;
+    }
+}
+
+static bool uring_open(unsigned depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ringFd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ringFd < 0) {
+        if (verbose) {
+            fprintf(stderr, "io_uring_setup(): %s\n", strerror(errno));
+        }
+        return false;
+    }
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqRingSize > sqRingSize) {
+            sqRingSize = cqRingSize;
+        }
+        cqRingSize = sqRingSize;
+    }
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        sqRing = nullptr;
+        uring_close();
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing = sqRing;
+    }
+    else {
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            cqRing = nullptr;
+            uring_close();
+            return false;
+        }
+    }
+    sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = nullptr;
+        uring_close();
+        return false;
+    }
+    char *sq = (char *)sqRing;
+    sqHead = (unsigned *)(sq + p.sq_off.head);
+    sqTail = (unsigned *)(sq + p.sq_off.tail);
+    sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + p.sq_off.array);
+    sqEntries = p.sq_entries;
+    char *cq = (char *)cqRing;
+    cqHead = (unsigned *)(cq + p.cq_off.head);
+    cqTail = (unsigned *)(cq + p.cq_off.tail);
+    cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ringInflight = 0;
+    return true;
+}
+
+bool start_async_io(int depth, int nthreads, bool allowUring) {
+    if (aioBackend != AsyncIoNone) {
+        return false;
+    }
+    aioRunning = true;
+    if (allowUring && uring_open(depth > 0 ? depth : 64)) {
+        aioBackend = AsyncIoUring;
+        aioThreadCount = 1;
+        aioThreads = new pthread_t[1];
+        if (pthread_create(&aioThreads[0], NULL, aio_uring_reaper, nullptr)) {
+            fprintf(stderr, "async io reaper create failed\n");
+            exit(1);
+        }
+    }
+    else {
+        aioBackend = AsyncIoThreads;
+        aioThreadCount = nthreads > 0 ? nthreads : 4;
+        aioThreads = new pthread_t[aioThreadCount];
+        for (int i = 0; i != aioThreadCount; ++i) {
+            if (pthread_create(&aioThreads[i], NULL, aio_pool_worker, nullptr)) {
+                fprintf(stderr, "async io thread create failed\n");
+                exit(1);
+            }
+        }
+    }
+    if (verbose) {
+        fprintf(stderr, "async io backend: %s\n", async_io_backend_name());
+    }
+    return true;
+}
+
+void stop_async_io() {
+    if (aioBackend == AsyncIoNone) {
+        return;
+    }
+    bool reaperStuck = false;
+    pthread_mutex_lock(&aioMutex);
+    aioRunning = false;
+    if (aioBackend == AsyncIoUring) {
+        //  a NOP with no request wakes the reaper up and tells it to exit;
+        //  with a broken ring, it exits by itself once the ring is empty
+        while (ringInflight >= sqEntries && !ringBroken) {
+            pthread_cond_wait(&aioCond, &aioMutex);
+        }
+    }
+    if (aioBackend == AsyncIoUring && !ringBroken) {
+        unsigned tail = *sqTail;
+        unsigned ix = tail & *sqMask;
+        memset(&sqes[ix], 0, sizeof(sqes[ix]));
+        sqes[ix].opcode = IORING_OP_NOP;
+        sqArray[ix] = ix;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++ringInflight;
+        std::vector<AsyncRead *> refused;
+        reaperStuck = !uring_enter(1, refused);
+    }
+    pthread_cond_broadcast(&aioCond);
+    pthread_mutex_unlock(&aioMutex);
+    if (reaperStuck) {
+        //  nothing can wake the reaper now; leave it, and the ring it is
+        //  waiting in, alone
+        pthread_detach(aioThreads[0]);
+    }
+    else {
+        for (int i = 0; i != aioThreadCount; ++i) {
+            void *j = nullptr;
+            pthread_join(aioThreads[i], &j);
+        }
+    }
+    delete[] aioThreads;
+    aioThreads = nullptr;
+    aioThreadCount = 0;
+    if (aioBackend == AsyncIoUring && !reaperStuck) {
+        uring_close();
+    }
+    ringBroken = false;
+    aioBackend = AsyncIoNone;
+}
+
+AsyncIoBackend async_io_backend() {
+    return aioBackend;
+}
+
+char const *async_io_backend_name() {
+    switch (aioBackend) {
+    case AsyncIoUring:
+        return "io_uring";
+    case AsyncIoThreads:
+        return "threads";
+    default:
+        return "sync";
+    }
+}
@@ -0,0 +1,65 @@
+#if !defined(asyncio_h)
+#define asyncio_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <vector>
+
+/*  Batched asynchronous reads. A batch collects any number of reads, hands
+ *  them to the backend in one go, and lets the caller wait for all of them
+ *  at once. The backend is io_uring when the kernel supports it, and a
+ *  small pool of pread() threads otherwise.
+ */
+
+enum AsyncIoBackend {
+    AsyncIoNone = 0,
+    AsyncIoUring = 1,
+    AsyncIoThreads = 2
+};
+
+struct AsyncRead {
+    int fd;
+    uint64_t offset;
+    size_t size;
+    unsigned char *buf;
+    size_t done;
+    int error;
+    class AsyncBatch *batch;
+    struct iovec iov;   //  backend use
+};
+
+class AsyncBatch {
+    public:
+        AsyncBatch();
+        ~AsyncBatch();
+        void add(int fd, uint64_t offset, size_t size, void *buf);
+        void submit();
+        //  returns true if every read completed in full
+        bool wait();
+        bool submitted() const { return submitted_; }
+
+        //  called by the backend
+        void read_done(AsyncRead *rd);
+
+    private:
+        AsyncBatch(AsyncBatch const &) = delete;
+        AsyncBatch &operator=(AsyncBatch const &) = delete;
+
+        std::vector<AsyncRead> reads_;
+        pthread_mutex_t mtx_;
+        pthread_cond_t cond_;
+        size_t pending_;
+        bool submitted_;
+        bool failed_;
+};
+
+/* depth is the io_uring queue size; nthreads is the size of the fallback pool */
+bool start_async_io(int depth, int nthreads, bool allowUring = true);
+void stop_async_io();
+AsyncIoBackend async_io_backend();
+char const *async_io_backend_name();
+
+#endif  //  asyncio_h
@@ -0,0 +1,306 @@
+#include "stdafx.h"
+#include "framecache.h"
+#include "video.h"
+#include "riffs.h"
+#include <algorithm>
+
+#define DEFAULT_FRAME_CACHE_BYTES ((size_t)512 * 1024 * 1024)
+
+extern bool verbose;
+
+FrameCache gFrameCache;
+
+FrameCache::FrameCache()
+    : shown_(nullptr)
+    , budget_(DEFAULT_FRAME_CACHE_BYTES)
+    , bytes_(0)
+    , frames_(0)
+    , playhead_(0)
+    , tick_(0)
+    , hits_(0)
+    , misses_(0)
+    , inserts_(0)
+    , evictions_(0)
+{
+}
+
+FrameCache::~FrameCache() {
+    while (!gops_.empty()) {
+        erase_gop(gops_.end() - 1);
+    }
+    if (shown_) {
+        free_.push_back(shown_);
+    }
+    for (auto df : free_) {
+        delete df;
+    }
+}
+
+void FrameCache::set_budget(size_t bytes) {
+    budget_ = bytes;
+    evict();
+}
+
+void FrameCache::set_playhead(size_t pos) {
+    playhead_ = pos;
+}
+
+std::vector<FrameCache::Gop>::iterator FrameCache::find_gop(size_t pos) {
+    auto ptr(std::upper_bound(gops_.begin(), gops_.end(), pos,
+        [](size_t p, Gop const &g) { return p < g.kfpos; }));
+    if (ptr == gops_.begin()) {
+        return gops_.end();
+    }
+    --ptr;
+    if (pos >= ptr->endpos) {
+        return gops_.end();
+    }
+    return ptr;
+}
+
+std::vector<FrameCache::Gop>::const_iterator FrameCache::find_gop(size_t pos) const {
+    return const_cast<FrameCache *>(this)->find_gop(pos);
+}
+
+DecodedFrame *FrameCache::peek(size_t pos) const {
+    auto ptr(find_gop(pos));
+    if (ptr == gops_.end()) {
+        return nullptr;
+    }
+    for (size_t i = pos - ptr->kfpos, n = ptr->frames.size(); i < n; ++i) {
+        if (ptr->frames[i]) {
+            return ptr->frames[i];
+        }
+    }
+    return nullptr;
+}
+
+DecodedFrame *FrameCache::lookup(size_t pos) {
+    DecodedFrame *df = peek(pos);
+    if (!df) {
+        ++misses_;
+        return nullptr;
+    }
+    ++hits_;
+    find_gop(pos)->lastUse = ++tick_;
+    return df;
+}
+
+DecodedFrame *FrameCache::nearest(size_t pos) const {
+    DecodedFrame *best = nullptr;
+    size_t bestDist = ~(size_t)0;
+    auto ptr(std::upper_bound(gops_.begin(), gops_.end(), pos,
+        [](size_t p, Gop const &g) { return p < g.kfpos; }));
+    //  only the GOPs on either side of pos can hold the closest picture
+    for (int side = 0; side != 2; ++side) {
+        if (side == 0 && ptr == gops_.begin()) {
+            continue;
+        }
+        if (side == 1 && ptr == gops_.end()) {
+            continue;
+        }
+        Gop const &g = side ? *ptr : *(ptr - 1);
+        for (size_t i = 0, n = g.frames.size(); i != n; ++i) {
+            if (g.frames[i]) {
+                size_t p = g.kfpos + i;
+                size_t d = (p > pos) ? p - pos : pos - p;
+                if (d < bestDist) {
+                    bestDist = d;
+                    best = g.frames[i];
+                }
+            }
+        }
+    }
+    return best;
+}
+
+bool FrameCache::has_gop(size_t kfpos) const {
+    auto ptr(find_gop(kfpos));
+    return ptr != gops_.end() && ptr->kfpos == kfpos;
+}
+
+void FrameCache::insert_gop(size_t kfpos, std::vector<DecodedFrame *> const &frames) {
+    auto ptr(std::lower_bound(gops_.begin(), gops_.end(), kfpos,
+        [](Gop const &g, size_t p) { return g.kfpos < p; }));
+    if (ptr != gops_.end() && ptr->kfpos == kfpos) {
+        //  decoded again; the new pictures replace the old
+        erase_gop(ptr);
+        ptr = std::lower_bound(gops_.begin(), gops_.end(), kfpos,
+            [](Gop const &g, size_t p) { return g.kfpos < p; });
+    }
+    Gop g;
+    g.kfpos = (uint32_t)kfpos;
+    g.endpos = (uint32_t)(kfpos + frames.size());
+    g.bytes = 0;
+    g.lastUse = ++tick_;
+    g.frames = frames;
+    for (auto df : frames) {
+        if (df) {
+            g.bytes += df->bytes();
+            ++frames_;
+        }
+    }
+    bytes_ += g.bytes;
+    ++inserts_;
+    gops_.insert(ptr, g);
+    evict();
+}
+
+void FrameCache::erase_gop(std::vector<Gop>::iterator ptr) {
+    for (auto df : ptr->frames) {
+        if (df) {
+            release(df);
+            --frames_;
+        }
+    }
+    bytes_ -= ptr->bytes;
+    gops_.erase(ptr);
+}
+
+void FrameCache::evict() {
+    while (bytes_ > budget_ && gops_.size() > 1) {
+        //  distance from the playhead, in frames, plus age, in cache uses
+        auto victim(gops_.end());
+        uint64_t worst = 0;
+        for (auto ptr = gops_.begin(), end = gops_.end(); ptr != end; ++ptr) {
+            if (playhead_ >= ptr->kfpos && playhead_ < ptr->endpos) {
+                continue;
+            }
+            uint64_t dist = (playhead_ < ptr->kfpos) ? ptr->kfpos - playhead_ : playhead_ - ptr->endpos + 1;
+            uint64_t score = dist + (tick_ - ptr->lastUse);
+            if (victim == gops_.end() || score > worst) {
+                victim = ptr;
+                worst = score;
+            }
+        }
+        if (victim == gops_.end()) {
+            break;
+        }
+        if (verbose) {
+            fprintf(stderr, "evicting gop %ld (%ld bytes)\n", (long)victim->kfpos, (long)victim->bytes);
+        }
+        ++evictions_;
+        erase_gop(victim);
+    }
+}
+
+DecodedFrame *FrameCache::take() {
+    if (free_.empty()) {
+        return new DecodedFrame();
+    }
+    DecodedFrame *df = free_.front();
+    free_.pop_front();
+    return df;
+}
+
+void FrameCache::release(DecodedFrame *df) {
+    if (df != shown_) {
+        //  give the picture back to the codec's buffer pool now
+        df->clear();
+        free_.push_back(df);
+    }
+}
+
+void FrameCache::show(DecodedFrame *df) {
+    DecodedFrame *old = shown_;
+    shown_ = df;
+    if (df) {
+        //  showing it may have added an RGB copy; charge its GOP for that
+        for (auto &g : gops_) {
+            if (std::find(g.frames.begin(), g.frames.end(), df) != g.frames.end()) {
+                size_t n = 0;
+                for (auto f : g.frames) {
+                    if (f) {
+                        n += f->bytes();
+                    }
+                }
+                bytes_ += n - g.bytes;
+                g.bytes = n;
+                break;
+            }
+        }
+    }
+    if (old && old != df) {
+        //  if it is still cached, the cache owns it; else, it was evicted
+        //  while on screen, and is ours to recycle
+        bool cached = false;
+        for (auto const &g : gops_) {
+            if (std::find(g.frames.begin(), g.frames.end(), old) != g.frames.end()) {
+                cached = true;
+                break;
+            }
+        }
+        if (!cached) {
+            old->clear();
+            free_.push_back(old);
+        }
+    }
+}
+
+FrameCache::Stats FrameCache::stats() const {
+    Stats s;
+    s.hits = hits_;
+    s.misses = misses_;
+    s.inserts = inserts_;
+    s.evictions = evictions_;
+    s.bytes = bytes_;
+    s.frames = frames_;
+    s.gops = gops_.size();
+    return s;
+}
+
+void FrameCache::print_stats(FILE *f) const {
+    uint64_t lookups = hits_ + misses_;
+    fprintf(f, "frame cache: %lld hits, %lld misses (%.1f%% hit rate), %lld gops inserted, %lld evicted, %ld frames in %ld gops, %.1f of %.1f MB\n",
+        (long long)hits_, (long long)misses_, lookups ? 100.0 * hits_ / lookups : 0.0,
+        (long long)inserts_, (long long)evictions_, (long)frames_, (long)gops_.size(),
+        bytes_ / (1024.0 * 1024.0), budget_ / (1024.0 * 1024.0));
+}
+
+
+DecodedFrame *get_frame_at(uint64_t t, GetFrameMode mode) {
+    uint64_t frameTime = determine_frame_time(t, mode);
+    size_t pos = gFrameIndex.lower_bound(frameTime);
+    gFrameCache.set_playhead(pos);
+    DecodedFrame *ret = gFrameCache.lookup(pos);
+    if (ret) {
+        return ret;
+    }
+    VideoFrame *keyframe = get_keyframe_for_time(frameTime);
+    if (!keyframe) {
+        return nullptr;
+    }
+    size_t kfpos = keyframe->index;
+    size_t endpos = gFrameIndex.keyframe_after(kfpos);
+    std::vector<DecodedFrame *> decoded(endpos - kfpos);
+    begin_decode(keyframe);
+    VideoFrame *curFrame = keyframe;
+    while (curFrame) {
+        DecodedFrame *df = gFrameCache.take();
+        size_t previx = curFrame->index;
+        uint64_t prevoff = curFrame->offset;
+        size_t prevsz = curFrame->size;
+        uint64_t prevtime = curFrame->time;
+        //  the last GOP's last picture comes with curFrame going to nullptr
+        if (!decode_frame_and_advance(curFrame, df)) {
+            gFrameCache.release(df);
+            if (verbose) {
+                fprintf(stderr, "no picture from frame %ld on\n", (long)previx);
+            }
+            break;
+        }
+        if (verbose) {
+            fprintf(stderr, "decoded frame %ld at offset %lld size %ld with time %lld for time %lld\n",
+                    (long)previx, (long long)prevoff, (long)prevsz, (long long)df->time, (long long)prevtime);
+        }
+        decoded[previx - kfpos] = df;
+        if (df->time >= frameTime && !ret) {
+            ret = df;
+        }
+        if (curFrame && curFrame->keyframe) {
+            break;
+        }
+    }
+    gFrameCache.insert_gop(kfpos, decoded);
+    return ret;
+}
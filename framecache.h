@@ -0,0 +1,97 @@
+#if !defined(framecache_h)
+#define framecache_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+#include <list>
+
+#include "frameindex.h"
+
+struct DecodedFrame;
+
+/*  Decoded frames, cached a whole GOP at a time and keyed by frame position
+ *  in gFrames. GOPs live in a vector sorted by keyframe position. When the
+ *  cache goes over its byte budget, the GOP that is furthest from the
+ *  playhead and least recently used goes first; the GOP under the playhead
+ *  and the frame on screen are never evicted.
+ *
+ *  The cache is not thread safe; viewtune only touches it on the FLTK thread.
+ */
+class FrameCache {
+    public:
+        struct Stats {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t inserts;
+            uint64_t evictions;
+            size_t bytes;
+            size_t frames;
+            size_t gops;
+        };
+
+        FrameCache();
+        ~FrameCache();
+
+        void set_budget(size_t bytes);
+        size_t budget() const { return budget_; }
+        void set_playhead(size_t pos);
+
+        /* The first picture at or after pos in the GOP that holds pos, or
+         * nullptr. Counts as a hit or a miss. */
+        DecodedFrame *lookup(size_t pos);
+        /* Same, without touching statistics or recency. */
+        DecodedFrame *peek(size_t pos) const;
+        /* The cached picture closest to pos, to show while pos decodes. */
+        DecodedFrame *nearest(size_t pos) const;
+        bool has_gop(size_t kfpos) const;
+        /* frames[i] is the picture for position kfpos + i, or nullptr. The
+         * cache takes ownership of the pictures. */
+        void insert_gop(size_t kfpos, std::vector<DecodedFrame *> const &frames);
+
+        /* A recycled frame to decode into, and returning one. */
+        DecodedFrame *take();
+        void release(DecodedFrame *df);
+        /* The frame on screen; it is held until something replaces it.
+         * Call after converting it for display, so the conversion counts
+         * against the budget. */
+        void show(DecodedFrame *df);
+
+        Stats stats() const;
+        void print_stats(FILE *f) const;
+
+    private:
+        struct Gop {
+            uint32_t kfpos;
+            uint32_t endpos;
+            size_t bytes;
+            uint64_t lastUse;
+            std::vector<DecodedFrame *> frames;
+        };
+
+        std::vector<Gop>::iterator find_gop(size_t pos);
+        std::vector<Gop>::const_iterator find_gop(size_t pos) const;
+        void erase_gop(std::vector<Gop>::iterator ptr);
+        void evict();
+
+        std::vector<Gop> gops_;
+        std::list<DecodedFrame *> free_;
+        DecodedFrame *shown_;
+        size_t budget_;
+        size_t bytes_;
+        size_t frames_;
+        size_t playhead_;
+        uint64_t tick_;
+        uint64_t hits_;
+        uint64_t misses_;
+        uint64_t inserts_;
+        uint64_t evictions_;
+};
+
+extern FrameCache gFrameCache;
+
+/* Decode synchronously, through the cache. */
+DecodedFrame *get_frame_at(uint64_t t, GetFrameMode mode = GetFrameModeClosest);
+
+#endif  //  framecache_h
@@ -0,0 +1,168 @@
+#include "stdafx.h"
+#include "frameindex.h"
+#include "video.h"
+#include "riffs.h"
+#include <assert.h>
+#include <algorithm>
+
+FrameIndex gFrameIndex;
+
+void FrameIndex::clear() {
+    time_.clear();
+    top_.clear();
+    topBlock_.clear();
+    keyframes_.clear();
+    fileStart_.clear();
+    lastFile_ = nullptr;
+}
+
+void FrameIndex::append(std::vector<VideoFrame> const &frames) {
+    size_t from = time_.size();
+    if (from >= frames.size()) {
+        return;
+    }
+    for (size_t i = from, n = frames.size(); i != n; ++i) {
+        VideoFrame const &vf = frames[i];
+        time_.push_back(vf.time);
+        if (vf.keyframe) {
+            keyframes_.push_back((uint32_t)i);
+        }
+        if (vf.file != lastFile_) {
+            //  frames are in segment order, so a new pointer is a new segment
+            while (fileStart_.size() < gRiffFiles.size() && gRiffFiles[fileStart_.size()] != vf.file) {
+                fileStart_.push_back((uint32_t)i);
+            }
+            fileStart_.push_back((uint32_t)i);
+            lastFile_ = vf.file;
+        }
+    }
+    //  the block level is 1/kBlockSize of the frames; just rebuild it
+    size_t nblocks = (time_.size() + kBlockSize - 1) / kBlockSize;
+    top_.resize(nblocks + 1);
+    topBlock_.resize(nblocks + 1);
+    size_t src = 0;
+    build_top(src, 1);
+}
+
+//  in-order walk of the implicit tree fills it with ascending block starts
+void FrameIndex::build_top(size_t &src, size_t k) {
+    if (k < top_.size()) {
+        build_top(src, 2 * k);
+        top_[k] = time_[src * kBlockSize];
+        topBlock_[k] = (uint32_t)src;
+        ++src;
+        build_top(src, 2 * k + 1);
+    }
+}
+
+size_t FrameIndex::upper_bound(uint64_t t) const {
+    size_t n = top_.size();
+    if (n < 2) {
+        return 0;
+    }
+    //  find the first block that starts after t
+    size_t k = 1;
+    while (k < n) {
+        __builtin_prefetch(&top_[0] + std::min(k * kBlockSize, n - 1));
+        k = 2 * k + (top_[k] <= t);
+    }
+    k >>= __builtin_ffsll(~(long long)k);
+    size_t block = k ? topBlock_[k] : (n - 1);
+    if (block == 0) {
+        //  even the first frame is after t
+        return 0;
+    }
+    //  t is in the block before it; count the times in there that are <= t
+    size_t begin = (block - 1) * kBlockSize;
+    size_t end = std::min(begin + (size_t)kBlockSize, time_.size());
+    size_t count = 0;
+    for (size_t i = begin; i != end; ++i) {
+        count += (time_[i] <= t);
+    }
+    return begin + count;
+}
+
+size_t FrameIndex::lower_bound(uint64_t t) const {
+    return t ? upper_bound(t - 1) : 0;
+}
+
+size_t FrameIndex::keyframe_at_or_before(size_t pos) const {
+    auto ptr(std::upper_bound(keyframes_.begin(), keyframes_.end(), (uint32_t)pos));
+    if (ptr == keyframes_.begin()) {
+        return 0;
+    }
+    return *(ptr - 1);
+}
+
+size_t FrameIndex::keyframe_after(size_t pos) const {
+    auto ptr(std::upper_bound(keyframes_.begin(), keyframes_.end(), (uint32_t)pos));
+    if (ptr == keyframes_.end()) {
+        return time_.size();
+    }
+    return *ptr;
+}
+
+size_t FrameIndex::keyframes_through(size_t pos) const {
+    return std::upper_bound(keyframes_.begin(), keyframes_.end(), (uint32_t)pos) - keyframes_.begin();
+}
+
+uint32_t FrameIndex::file_id(size_t pos) const {
+    auto ptr(std::upper_bound(fileStart_.begin(), fileStart_.end(), (uint32_t)pos));
+    if (ptr == fileStart_.begin()) {
+        return 0;
+    }
+    return (uint32_t)(ptr - fileStart_.begin() - 1);
+}
+
+
+uint64_t determine_frame_time(uint64_t time, GetFrameMode mode) {
+    FrameIndex const &fi = gFrameIndex;
+    size_t size = fi.size();
+    if (size == 0) {
+        return 0;
+    }
+    //  top is strictly greater, bottom is less-or-equal
+    size_t top = fi.upper_bound(time);
+    if (top == 0) {
+        return fi.time(0);
+    }
+    size_t bottom = top - 1;
+    uint64_t bottomTime = fi.time(bottom);
+    if (top == size) {
+        return fi.time(top - 1);
+    }
+    uint64_t topTime = fi.time(top);
+    switch (mode) {
+    case GetFrameModeClosest:
+        if (time - bottomTime <= topTime - time) {
+            return bottomTime;
+        }
+        return topTime;
+    case GetFrameModeEarlier:
+        return bottomTime;
+    case GetFrameModeLater:
+        return (bottomTime == time) ? bottomTime : topTime;
+    case GetFrameModeFollowing:
+        return topTime;
+    case GetFrameModePreceeding:
+        if (bottomTime == time) {
+            //  first frame with this time; the one before it is earlier
+            bottom = fi.lower_bound(bottomTime);
+            if (bottom > 0) {
+                return fi.time(bottom - 1);
+            }
+        }
+        return bottomTime;
+    }
+    assert(!"unknown get frame mode");
+    return 0;
+}
+
+VideoFrame *get_keyframe_for_time(uint64_t frametime) {
+    size_t top = gFrameIndex.upper_bound(frametime);
+    if (!gFrameIndex.size()) {
+        return nullptr;
+    }
+    size_t bottom = top ? top - 1 : 0;
+    return &gFrames[gFrameIndex.keyframe_at_or_before(bottom)];
+}
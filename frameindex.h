@@ -0,0 +1,73 @@
+#if !defined(frameindex_h)
+#define frameindex_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+struct VideoFrame;
+class RiffFile;
+
+/*  Columnar search index over gFrames. Seeking only touches these columns:
+ *
+ *  - time_ is the dense, sorted frame time column.
+ *  - top_ holds the first time of each block of kBlockSize frames, in
+ *    Eytzinger (breadth-first) order, so the search over blocks walks a
+ *    small, cache-resident array. Only the final block's two cache lines
+ *    of time_ get touched.
+ *  - keyframes_ holds the position of each keyframe, so finding the GOP
+ *    start for a frame is a binary search, not a walk back through it.
+ *  - fileStart_ holds the position of the first frame of each segment;
+ *    a frame's file ID is its segment's index in gRiffFiles.
+ */
+class FrameIndex {
+    public:
+        enum { kBlockSize = 16 };
+
+        void clear();
+        /* Index frames [size(), frames.size()). Times must already be normalized. */
+        void append(std::vector<VideoFrame> const &frames);
+
+        size_t size() const { return time_.size(); }
+        uint64_t time(size_t i) const { return time_[i]; }
+        /* first position with time > t, or size() */
+        size_t upper_bound(uint64_t t) const;
+        /* first position with time >= t, or size() */
+        size_t lower_bound(uint64_t t) const;
+        /* position of the last keyframe at or before pos, or 0 */
+        size_t keyframe_at_or_before(size_t pos) const;
+        /* position of the first keyframe after pos, or size(); this is
+         * where the GOP containing pos ends */
+        size_t keyframe_after(size_t pos) const;
+        size_t num_keyframes() const { return keyframes_.size(); }
+        uint32_t keyframe(size_t i) const { return keyframes_[i]; }
+        /* number of keyframes at or before pos, so the GOP containing pos
+         * starts at keyframe(n - 1) */
+        size_t keyframes_through(size_t pos) const;
+        uint32_t file_id(size_t pos) const;
+
+    private:
+        void build_top(size_t &src, size_t k);
+
+        std::vector<uint64_t> time_;
+        std::vector<uint64_t> top_;
+        std::vector<uint32_t> topBlock_;
+        std::vector<uint32_t> keyframes_;
+        std::vector<uint32_t> fileStart_;
+        RiffFile *lastFile_ = nullptr;
+};
+
+extern FrameIndex gFrameIndex;
+
+enum GetFrameMode {
+    GetFrameModeClosest = 0,
+    GetFrameModeEarlier = 1,
+    GetFrameModeLater = 2,
+    GetFrameModeFollowing = 3,
+    GetFrameModePreceeding = 4
+};
+
+uint64_t determine_frame_time(uint64_t time, GetFrameMode mode);
+VideoFrame *get_keyframe_for_time(uint64_t frametime);
+
+#endif  //  frameindex_h
@@ -0,0 +1,317 @@
+#include "stdafx.h"
+#include "framesink.h"
+#include "perfcount.h"
+#include <pthread.h>
+#include <string.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <stdexcept>
+
+extern bool verbose;
+
+/*  One sink thread pops batches off a bounded queue. Decode workers block in
+ *  submit_frame_batch() while the queue is full. Pictures and batches are
+ *  recycled through free lists, so after the first few GOPs nothing is
+ *  allocated, and codec buffers go back to the codec as soon as the sink is
+ *  done with them.
+ */
+
+struct SinkEntry {
+    std::string name;
+    std::string help;
+    FrameSinkFactory factory;
+};
+
+static std::vector<SinkEntry> &sink_registry();
+
+static pthread_mutex_t sinkMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sinkNotEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sinkNotFull = PTHREAD_COND_INITIALIZER;
+static std::deque<FrameBatch *> sinkQueue;
+static FrameSink *sinkSink;
+static pthread_t sinkThread;
+static bool sinkRunning;
+static bool sinkStopping;
+static bool sinkFailed;
+static size_t sinkDepth;
+static size_t sinkBatchFrames;
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<DecodedFrame *> framePool;
+static std::vector<FrameBatch *> batchPool;
+
+
+class NullSink : public FrameSink {
+    public:
+        NullSink() : count_(0) {}
+        char const *name() { return "null"; }
+        void consume(SinkFrame const *, size_t count) {
+            count_ += count;
+        }
+        void finish() {
+            fprintf(stderr, "null sink: %llu pictures\n", (unsigned long long)count_);
+        }
+        uint64_t count_;
+};
+
+class TelemetrySink : public FrameSink {
+    public:
+        TelemetrySink(char const *path) : file_(stdout), close_(false) {
+            if (path && *path) {
+                if (!(file_ = fopen(path, "wb"))) {
+                    throw std::runtime_error(std::string("could not create ") + path);
+                }
+                close_ = true;
+            }
+            fprintf(file_, "file,index,pts,time,keyframe,width,height,steer,throttle\n");
+        }
+        ~TelemetrySink() {
+            if (close_) {
+                fclose(file_);
+            }
+        }
+        char const *name() { return "telemetry"; }
+        void consume(SinkFrame const *frames, size_t count) {
+            for (size_t i = 0; i != count; ++i) {
+                VideoFrame const &vf = frames[i].telemetry;
+                DecodedFrame const *df = frames[i].picture;
+                fprintf(file_, "%s,%u,%llu,%llu,%d,%d,%d,%.4f,%.4f\n",
+                    vf.file ? vf.file->path_.filename().string().c_str() : "",
+                    vf.index, (unsigned long long)vf.pts, (unsigned long long)vf.time,
+                    df->keyframe ? 1 : 0, df->width, df->height, vf.steer, vf.throttle);
+            }
+        }
+        void finish() {
+            if (fflush(file_) != 0) {
+                throw std::runtime_error("telemetry sink: write failed");
+            }
+        }
+        FILE *file_;
+        bool close_;
+};
+
+static FrameSink *make_null_sink(char const *) {
+    return new NullSink();
+}
+
+static FrameSink *make_telemetry_sink(char const *arg) {
+    return new TelemetrySink(arg);
+}
+
+static std::vector<SinkEntry> &sink_registry() {
+    //  built once, on first use, so other modules can register from static
+    //  constructors
+    static std::vector<SinkEntry> registry;
+    if (registry.empty()) {
+        SinkEntry n = { "null", "count pictures and throw them away", make_null_sink };
+        SinkEntry t = { "telemetry", "[:file.csv] one line of telemetry per picture (default stdout)", make_telemetry_sink };
+        registry.push_back(n);
+        registry.push_back(t);
+    }
+    return registry;
+}
+
+void register_frame_sink(char const *name, char const *help, FrameSinkFactory factory) {
+    SinkEntry e = { name, help ? help : "", factory };
+    for (auto &s : sink_registry()) {
+        if (s.name == e.name) {
+            s = e;
+            return;
+        }
+    }
+    sink_registry().push_back(e);
+}
+
+FrameSink *create_frame_sink(char const *spec) {
+    char const *colon = strchr(spec, ':');
+    std::string name(spec, colon ? colon - spec : strlen(spec));
+    for (auto const &s : sink_registry()) {
+        if (s.name == name) {
+            try {
+                return s.factory(colon ? colon + 1 : nullptr);
+            }
+            catch (std::exception const &x) {
+                fprintf(stderr, "sink %s: %s\n", name.c_str(), x.what());
+                return nullptr;
+            }
+        }
+    }
+    fprintf(stderr, "%s: no such sink\n", name.c_str());
+    return nullptr;
+}
+
+void list_frame_sinks(FILE *f) {
+    for (auto const &s : sink_registry()) {
+        fprintf(f, "  %-12s %s\n", s.name.c_str(), s.help.c_str());
+    }
+}
+
+
+size_t frame_sink_batch_frames() {
+    return sinkBatchFrames;
+}
+
+FrameBatch *new_frame_batch() {
+    FrameBatch *fb = nullptr;
+    pthread_mutex_lock(&poolMutex);
+    if (!batchPool.empty()) {
+        fb = batchPool.back();
+        batchPool.pop_back();
+    }
+    pthread_mutex_unlock(&poolMutex);
+    if (!fb) {
+        fb = new FrameBatch();
+        fb->frames.reserve(sinkBatchFrames);
+    }
+    return fb;
+}
+
+DecodedFrame *new_sink_frame() {
+    DecodedFrame *df = nullptr;
+    pthread_mutex_lock(&poolMutex);
+    if (!framePool.empty()) {
+        df = framePool.back();
+        framePool.pop_back();
+    }
+    pthread_mutex_unlock(&poolMutex);
+    if (!df) {
+        df = new DecodedFrame();
+    }
+    return df;
+}
+
+void recycle_sink_frame(DecodedFrame *df) {
+    //  hands the codec its buffers back before parking the frame
+    df->clear();
+    pthread_mutex_lock(&poolMutex);
+    framePool.push_back(df);
+    pthread_mutex_unlock(&poolMutex);
+}
+
+static void recycle_batch(FrameBatch *fb) {
+    for (auto const &sf : fb->frames) {
+        recycle_sink_frame(sf.picture);
+    }
+    fb->frames.clear();
+    pthread_mutex_lock(&poolMutex);
+    batchPool.push_back(fb);
+    pthread_mutex_unlock(&poolMutex);
+}
+
+void submit_frame_batch(FrameBatch *batch) {
+    if (batch->frames.empty()) {
+        recycle_batch(batch);
+        return;
+    }
+    pthread_mutex_lock(&sinkMutex);
+    if (sinkRunning && sinkQueue.size() >= sinkDepth) {
+        PerfTimer pt(PerfSinkWaitNs);
+        while (sinkRunning && sinkQueue.size() >= sinkDepth) {
+            pthread_cond_wait(&sinkNotFull, &sinkMutex);
+        }
+    }
+    if (!sinkRunning) {
+        pthread_mutex_unlock(&sinkMutex);
+        recycle_batch(batch);
+        return;
+    }
+    sinkQueue.push_back(batch);
+    pthread_cond_signal(&sinkNotEmpty);
+    pthread_mutex_unlock(&sinkMutex);
+}
+
+static void *sink_thread(void *) {
+    pthread_mutex_lock(&sinkMutex);
+    while (true) {
+        while (sinkQueue.empty() && !sinkStopping) {
+            pthread_cond_wait(&sinkNotEmpty, &sinkMutex);
+        }
+        if (sinkQueue.empty()) {
+            break;
+        }
+        FrameBatch *fb = sinkQueue.front();
+        sinkQueue.pop_front();
+        pthread_cond_signal(&sinkNotFull);
+        bool failed = sinkFailed;
+        pthread_mutex_unlock(&sinkMutex);
+        //  once the sink has failed, batches are dropped, so the decoders
+        //  do not block forever
+        if (!failed) {
+            try {
+                sinkSink->consume(&fb->frames[0], fb->frames.size());
+            }
+            catch (std::exception const &x) {
+                fprintf(stderr, "sink %s: %s\n", sinkSink->name(), x.what());
+                failed = true;
+            }
+        }
+        recycle_batch(fb);
+        pthread_mutex_lock(&sinkMutex);
+        sinkFailed = sinkFailed || failed;
+    }
+    bool failed = sinkFailed;
+    pthread_mutex_unlock(&sinkMutex);
+    if (!failed) {
+        try {
+            sinkSink->finish();
+        }
+        catch (std::exception const &x) {
+            fprintf(stderr, "sink %s: %s\n", sinkSink->name(), x.what());
+            pthread_mutex_lock(&sinkMutex);
+            sinkFailed = true;
+            pthread_mutex_unlock(&sinkMutex);
+        }
+    }
+    return nullptr;
+}
+
+bool start_frame_sink(FrameSink *sink, size_t depth, size_t batchFrames) {
+    if (sinkRunning || !sink) {
+        return false;
+    }
+    sinkSink = sink;
+    sinkDepth = depth ? depth : 1;
+    sinkBatchFrames = batchFrames ? batchFrames : 1;
+    sinkStopping = false;
+    sinkFailed = false;
+    sinkRunning = true;
+    if (pthread_create(&sinkThread, NULL, sink_thread, nullptr)) {
+        fprintf(stderr, "frame sink thread create failed\n");
+        exit(1);
+    }
+    if (verbose) {
+        fprintf(stderr, "frame sink %s: %ld batches of %ld pictures\n",
+            sink->name(), (long)sinkDepth, (long)sinkBatchFrames);
+    }
+    return true;
+}
+
+bool stop_frame_sink() {
+    if (!sinkRunning) {
+        return false;
+    }
+    pthread_mutex_lock(&sinkMutex);
+    sinkStopping = true;
+    pthread_cond_signal(&sinkNotEmpty);
+    pthread_mutex_unlock(&sinkMutex);
+    void *j = nullptr;
+    pthread_join(sinkThread, &j);
+    pthread_mutex_lock(&sinkMutex);
+    sinkRunning = false;
+    pthread_cond_broadcast(&sinkNotFull);
+    pthread_mutex_unlock(&sinkMutex);
+    delete sinkSink;
+    sinkSink = nullptr;
+    pthread_mutex_lock(&poolMutex);
+    for (auto df : framePool) {
+        delete df;
+    }
+    framePool.clear();
+    for (auto fb : batchPool) {
+        delete fb;
+    }
+    batchPool.clear();
+    pthread_mutex_unlock(&poolMutex);
+    return !sinkFailed;
+}
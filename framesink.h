@@ -0,0 +1,65 @@
+#if !defined(framesink_h)
+#define framesink_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+#include "video.h"
+
+/*  Where gobble's decoded pictures go. Decode workers fill batches of
+ *  pictures, each with the VideoFrame it came from (file, index, pts, steer
+ *  and throttle), and hand them to a single sink thread through a bounded
+ *  queue. When the sink falls behind, the queue fills up and the decoders
+ *  wait, so memory stays bounded by the queue depth times the batch size.
+ *
+ *  Batches never span GOPs, and arrive in the order GOPs finish decoding,
+ *  not file order; within a batch, pictures are in presentation order.
+ */
+
+struct SinkFrame {
+    DecodedFrame *picture;
+    VideoFrame telemetry;
+};
+
+class FrameSink {
+    public:
+        virtual ~FrameSink() {}
+        virtual char const *name() = 0;
+        //  always called on the sink thread, one batch at a time; the
+        //  pictures are recycled when it returns. Throw to fail the run.
+        virtual void consume(SinkFrame const *frames, size_t count) = 0;
+        //  after the last batch, also on the sink thread
+        virtual void finish() {}
+};
+
+/*  Sinks are made by name, from "name" or "name:argument" on the command
+ *  line. Built in: "null" counts pictures, "telemetry[:file.csv]" writes one
+ *  line per picture. Other modules register their own at startup. */
+typedef FrameSink *(*FrameSinkFactory)(char const *arg);
+void register_frame_sink(char const *name, char const *help, FrameSinkFactory factory);
+/* nullptr (after saying why on stderr) if there is no such sink, or it
+ * could not be made */
+FrameSink *create_frame_sink(char const *spec);
+void list_frame_sinks(FILE *f);
+
+struct FrameBatch {
+    std::vector<SinkFrame> frames;
+};
+
+/* depth batches of at most batchFrames pictures can wait for the sink */
+bool start_frame_sink(FrameSink *sink, size_t depth, size_t batchFrames);
+size_t frame_sink_batch_frames();
+/* from any thread */
+FrameBatch *new_frame_batch();
+DecodedFrame *new_sink_frame();
+/* an empty picture goes back unused */
+void recycle_sink_frame(DecodedFrame *df);
+/* blocks while the queue is full; the batch belongs to the sink after */
+void submit_frame_batch(FrameBatch *batch);
+/* delivers what is queued, calls finish(), and deletes the sink; false if
+ * the sink failed at any point */
+bool stop_frame_sink();
+
+#endif  //  framesink_h
@@ -1,7 +1,12 @@
 #include "stdafx.h"
 #include "video.h"
 #include "riffs.h"
+#include "riffindex.h"
+#include "asyncio.h"
 #include "workqueue.h"
+#include "framesink.h"
+#include "shardsink.h"
+#include "perfcount.h"
 #include <string>
 #include <vector>
 #include <list>
@@ -26,129 +31,126 @@
 int numChunksToDecode;
 int numChunksDecoded;
 
+//  GOP reads that are submitted ahead of decoding hold at most this much
+#define MAX_PREFETCH_BYTES (256 * 1024 * 1024)
+static int64_t prefetchBytes;
+
 extern bool verbose;
 
+//  crop on the decode workers, while the picture is hot in cache, rather
+//  than on the sink thread
+static bool cropPictures;
+
 
 class KeyframeWork : public Work {
     public:
-        KeyframeWork(RiffFile *rf, uint64_t offset, uint64_t end)
+        KeyframeWork(RiffFile *rf, VideoFrame const *begin, VideoFrame const *end)
             : file_(rf)
-            , offset_(offset)
-            , end_(end)
+            , frames_(begin, end)
+            , firstIndex_(begin->index)
         {
         }
         ~KeyframeWork()
         {
+            release_buffer();
             __sync_fetch_and_add(&numChunksDecoded, 1);
         }
         char const *name() {
-            sprintf(buf, "offset %lld", (long long)offset_);
+            sprintf(buf, "offset %lld", frames_.empty() ? 0LL : (long long)frames_[0].offset);
             return buf;
         }
         char buf[100];
         RiffFile *file_;
-        uint64_t offset_;
-        uint64_t end_;
         std::vector<VideoFrame> frames_;
+        uint32_t firstIndex_;
+        AsyncBatch batch_;
+        std::vector<unsigned char> data_;
+        uint64_t dataPos_ = 0;
+        size_t dataSize_ = 0;
 
-        void work() {
-            uint64_t pts = 0;
-            uint64_t pos = offset_;
-            std::vector<char> v;
-            float steer = 0;
-            float throttle = 0;
-            while (pos < end_) {
-                v.clear();
-                ChunkHeader ch;
-                if (!file_->data_header_at(pos, ch, v, 256)) {
-                    break;
-                }
-                if (!strncmp(ch.type, "time", 4)) {
-                    size_t offset = 8;
-                    while (offset <= v.size() - 6) {
-                        steer_packet sp;
-                        memcpy(&sp, &v[offset], 6);
-                        switch (sp.code) {
-                        case 'S':
-                            //  steer
-                            steer = (sp.steer == -32768) ? 0 : sp.steer / 16383.0f;
-                            throttle = (sp.throttle == -32768) ? 0 : sp.throttle / 16383.0f;
-                            offset += 6;
-                            break;
-                        case 'i':
-                            //  ibus
-                            offset += 22;
-                            break;
-                        case 'T':
-                            //  trim
-                            offset += 10;
-                            break;
-                        default:
-                            //  unknown
-                            offset = v.size();
-                            break;
-                        }
-                    }
-                 }
-                else if (!strncmp(ch.type, "pdts", 4)) {
-                    if (v.size() >= 8) {
-                        uint64_t p;
-                        memcpy(&p, &v[0], 8);
-                        if (p != 0 && p != 0x8000000000000000ULL) {
-                            pts = p;
-                        }
-                    }
-                }
-                else if (!strncmp(ch.type, "h264", 4)) {
-                    VideoFrame vf = { 0 };
-                    vf.pts = pts;
-                    vf.time = pts;
-                    vf.offset = pos;
-                    vf.file = file_;
-                    vf.steer = steer;
-                    vf.throttle = throttle;
-                    vf.size = ch.size;
-                    vf.index = frames_.size();
-                    vf.keyframe = (vf.index == 0);
-                    frames_.push_back(vf);
-                }
-                else if (!strncmp(ch.type, "info", 4)) {
-                    //  skip the info chunk
-                }
-                else {
-                    fprintf(stderr, "unknown chunk type: %.4s at offset %lld\n", 
-                            ch.type, (long long)pos);
-                }
-                if (ch.size > 8 * 1024 * 1024) {
-                    fprintf(stderr, "too large (%ld) chunk type: %.4s at offset %lld\n",
-                            (long)ch.size, ch.type, (long long)pos);
+        //  Read the GOP's chunks as one batch: a single read covering the
+        //  byte range when the h264 chunks are most of it, else one per chunk.
+        void prefetch() {
+            if (batch_.submitted() || frames_.empty() || file_->fd() < 0) {
+                return;
+            }
+            uint64_t begin = frames_.front().offset;
+            uint64_t end = frames_.back().offset + 8 + frames_.back().size;
+            uint64_t payload = 0;
+            for (auto const &f : frames_) {
+                payload += 8 + f.size;
+            }
+            dataPos_ = begin;
+            dataSize_ = end - begin;
+            data_.resize(dataSize_ + DECODER_BUFFER_PADDING);
+            memset(&data_[dataSize_], 0, DECODER_BUFFER_PADDING);
+            __sync_fetch_and_add(&prefetchBytes, (int64_t)data_.size());
+            if (dataSize_ <= 2 * payload) {
+                batch_.add(file_->fd(), 12 + begin, dataSize_, &data_[0]);
+            }
+            else {
+                for (auto const &f : frames_) {
+                    batch_.add(file_->fd(), 12 + f.offset, 8 + f.size, &data_[f.offset - begin]);
                 }
-                pos = pos + 8 + ((ch.size + 3) & -4);
             }
+            batch_.submit();
+        }
+
+        void release_buffer() {
+            if (batch_.submitted()) {
+                batch_.wait();
+            }
+            if (!data_.empty()) {
+                __sync_fetch_and_sub(&prefetchBytes, (int64_t)data_.size());
+                std::vector<unsigned char>().swap(data_);
+            }
+        }
+
+        //  the picture goes to the sink with the telemetry of the chunk it
+        //  came from; a full batch is handed over (which may block, while
+        //  the sink catches up)
+        void deliver(DecodedFrame *df, FrameBatch *&fb) {
+            if (cropPictures) {
+                df->crop();
+            }
+            SinkFrame sf;
+            sf.picture = df;
+            sf.telemetry = frames_[df->index < frames_.size() ? df->index : 0];
+            sf.telemetry.index = firstIndex_ + df->index;
+            fb->frames.push_back(sf);
+            if (fb->frames.size() >= frame_sink_batch_frames()) {
+                submit_frame_batch(fb);
+                fb = new_frame_batch();
+            }
+        }
+
+        void work() {
             //  decode each frame
             if (frames_.size()) {
-                DecodedFrame result;
                 decoder_t *d = new_decoder();
-                VideoFrame *vf = &frames_[0];
-                uint64_t vftime = vf->pts;
-                while ((vf = decode_frame_and_advance(d, vf, &result, &KeyframeWork::next_frame, this)) != nullptr) {
-                    //  TODO:
-                    //  do a thing
-                    //
-                    vftime = vf->pts;
+                if (!d) {
+                    release_buffer();
+                    throw std::runtime_error("could not open a decoder");
+                }
+                prefetch();
+                if (batch_.submitted() && batch_.wait()) {
+                    decoder_set_buffer(d, file_, dataPos_, &data_[0], dataSize_);
                 }
-                (void)vftime;
+                FrameBatch *fb = new_frame_batch();
+                DecodedFrame *result = new_sink_frame();
+                //  renumbers frames_ from 0, which deliver() relies on
+                FrameRunDecoder run(d, frames_);
+                while (run.next(result)) {
+                    deliver(result, fb);
+                    result = new_sink_frame();
+                }
+                recycle_sink_frame(result);
+                submit_frame_batch(fb);
+                decoder_set_buffer(d, file_, 0, nullptr, 0);
+                release_decoder(d);
+                release_buffer();
             }
         }
-        static VideoFrame *next_frame(VideoFrame *, void *);
-};
-
-VideoFrame *KeyframeWork::next_frame(VideoFrame *fr, void *co) {
-    KeyframeWork *k = (KeyframeWork *)co;
-    if (fr->index + 1 < k->frames_.size()) {
-        return &k->frames_[fr->index+1];
-    }
-    return nullptr;
 };
 
 class RiffFileWork : public Work {
@@ -157,71 +159,154 @@ class RiffFileWork : public Work {
             n = file_->path_.string();
             (void)n.c_str();
         }
+        //  counted with the GOPs, so the run is not done while a segment
+        //  is still being scanned
+        ~RiffFileWork() {
+            __sync_fetch_and_add(&numChunksDecoded, 1);
+        }
         RiffFile *file_;
         char const *name() {
             return n.c_str();
         }
         std::string n;
         void work() {
-            uint64_t startPos = 0;
-            uint64_t lastTimePos = 0;
-            uint64_t pos = 0;
-            uint64_t opos = 0;
-            std::vector<char> v;
-            while (true) {
-                v.clear();
-                ChunkHeader ch;
-                bool b = file_->header_at(pos, ch, opos);
-                if (!b) {
-                    break;
-                }
-                if (!strncmp(ch.type, "time", 4)) {
-                    lastTimePos = pos;
+            //  the sidecar index makes this instant after the first run;
+            //  either way, each GOP goes to the decoders as soon as the
+            //  scan has passed it
+            GopSplitter gs(file_);
+            index_riff_file(file_, gs);
+        }
+
+        class GopSplitter : public RiffScanSink {
+            public:
+                GopSplitter(RiffFile *rf) : file_(rf) {}
+                void frame(VideoFrame const &vf) {
+                    frames_.push_back(vf);
                 }
-                if (!strncmp(ch.type, "h264", 4)) {
-                    if (!file_->data_at(pos, v, 16)) {
-                        fprintf(stderr, "Error reading data at %lld\n", (long long)pos);
-                        break;
-                    }
-                    static const char kf[5] = { 0x00, 0x00, 0x00, 0x01, 0x27 };
-                    if (!memcmp(&v[0], kf, 5)) {
-                        __sync_fetch_and_add(&numChunksToDecode, 1);
-                        add_work(new KeyframeWork(file_, startPos, pos));
-                        startPos = lastTimePos;
+                void gop(uint32_t begin, uint32_t end) {
+                    __sync_fetch_and_add(&numChunksToDecode, 1);
+                    KeyframeWork *kw = new KeyframeWork(file_, &frames_[0] + begin, &frames_[0] + end);
+                    //  get the read going now, so it has landed by the time
+                    //  a worker picks up the decode
+                    if (__sync_fetch_and_add(&prefetchBytes, 0) < MAX_PREFETCH_BYTES) {
+                        kw->prefetch();
                     }
+                    add_work(kw);
                 }
-                pos = opos;
-            }
-            if (startPos < file_->size_) {
-                add_work(new KeyframeWork(file_, startPos, file_->size_));
-            }
-        }
+                RiffFile *file_;
+                std::vector<VideoFrame> frames_;
+        };
 };
 
 void split_riff_files() {
     for (auto const &rf : gRiffFiles) {
+        __sync_fetch_and_add(&numChunksToDecode, 1);
         add_work(new RiffFileWork(rf));
     }
 }
 
 
+void usage() {
+    fprintf(stderr, "usage: gobble [--aio=uring|threads|sync] [--codec-threads=n] [--codec-thread-type=frame|slice|both]\n"
+        "    [--sink=name[:arg]] [--sink-depth=batches] [--sink-batch=pictures] [--crop=x,y,w,h[:WxH][:box|bilinear]]\n"
+        "    [--report=seconds] [nthreads] some-file.riff\n"
+        "sinks:\n");
+    list_frame_sinks(stderr);
+    exit(1);
+}
+
 int main(int argc, char const *argv[]) {
     int nt = 0;
+    char const *aio = "uring";
+    //  the work queue already keeps every core busy with its own GOP
+    int codecThreads = 1;
+    int codecThreadType = DecoderThreadSlice;
+    char const *sinkSpec = "null";
+    int sinkDepth = 8;
+    int sinkBatch = 32;
+    //  0 turns the periodic report off; the final one is always printed
+    double reportSecs = 10;
+    register_shard_sink();
+    while (argv[1] && argv[1][0] == '-') {
+        if (!strncmp(argv[1], "--aio=", 6)) {
+            aio = argv[1] + 6;
+        }
+        else if (!strncmp(argv[1], "--codec-threads=", 16)) {
+            codecThreads = atoi(argv[1] + 16);
+        }
+        else if (!strncmp(argv[1], "--codec-thread-type=", 20)) {
+            if (!(codecThreadType = parse_decoder_thread_type(argv[1] + 20))) {
+                usage();
+            }
+        }
+        else if (!strncmp(argv[1], "--sink=", 7)) {
+            sinkSpec = argv[1] + 7;
+        }
+        else if (!strncmp(argv[1], "--sink-depth=", 13)) {
+            if ((sinkDepth = atoi(argv[1] + 13)) < 1) {
+                usage();
+            }
+        }
+        else if (!strncmp(argv[1], "--sink-batch=", 13)) {
+            if ((sinkBatch = atoi(argv[1] + 13)) < 1) {
+                usage();
+            }
+        }
+        else if (!strncmp(argv[1], "--crop=", 7)) {
+            CropSpec cs;
+            if (!parse_crop_spec(argv[1] + 7, cs)) {
+                usage();
+            }
+            set_crop_spec(cs);
+            cropPictures = true;
+        }
+        else if (!strncmp(argv[1], "--report=", 9)) {
+            if ((reportSecs = atof(argv[1] + 9)) < 0) {
+                usage();
+            }
+        }
+        else if (!strcmp(argv[1], "-v")) {
+            verbose = true;
+        }
+        else {
+            usage();
+        }
+        ++argv;
+        --argc;
+    }
     if (argv[1] && argv[2] && ((nt = atoi(argv[1])) > 0)) {
         ++argv;
         --argc;
     }
     if (!argv[1] || !strstr(argv[1], ".riff")) {
-        fprintf(stderr, "usage: gobble some-file.riff\n");
-        exit(1);
+        usage();
     }
+    FrameSink *sink = create_frame_sink(sinkSpec);
+    if (!sink) {
+        usage();
+    }
+    set_decoder_threads(codecThreads, codecThreadType);
     load_all_riffs(argv[1]);
     fprintf(stderr, "loaded %ld riffs\n", (long)gRiffFiles.size());
+    if (strcmp(aio, "sync")) {
+        start_async_io(256, 8, !strcmp(aio, "uring"));
+    }
+    start_frame_sink(sink, sinkDepth, sinkBatch);
     start_work_queue(nt ? nt : 16);
     split_riff_files();
+    PerfSnapshot lastReport;
+    perf_snapshot(lastReport);
     usleep(100000);
     while (!numChunksToDecode || (numChunksToDecode > numChunksDecoded)) {
         usleep(100000);
+        if (reportSecs > 0) {
+            PerfSnapshot now;
+            perf_snapshot(now);
+            if ((now.timeNs - lastReport.timeNs) * 1e-9 >= reportSecs) {
+                perf_report(stderr, now, &lastReport);
+                lastReport = now;
+            }
+        }
         if (!verbose) {
             fprintf(stderr, "%7d / %7d\r", numChunksDecoded, numChunksToDecode);
         }
@@ -230,7 +315,13 @@ int main(int argc, char const *argv[]) {
         fprintf(stderr, "waiting for work to complete\n");
     }
     wait_for_all_work_to_complete();
+    bool ok = stop_frame_sink();
     stop_work_queue();
-    return 0;
+    stop_async_io();
+    free_decoders();
+    PerfSnapshot total;
+    perf_snapshot(total);
+    perf_report(stderr, total, nullptr);
+    return ok ? 0 : 1;
 }
 
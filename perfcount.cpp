@@ -0,0 +1,77 @@
+#include "stdafx.h"
+#include "perfcount.h"
+#include <string.h>
+#include <stdlib.h>
+
+__thread PerfThreadCounters *tPerfCounters;
+
+//  a lock-free stack of every thread's block; blocks are never removed
+static PerfThreadCounters *gPerfThreads;
+static uint64_t gPerfStartNs = perf_now_ns();
+
+PerfThreadCounters *perf_register_thread() {
+    //  new only aligns to 16 bytes before C++17
+    void *mem = nullptr;
+    if (posix_memalign(&mem, __alignof__(PerfThreadCounters), sizeof(PerfThreadCounters))) {
+        fprintf(stderr, "out of memory for performance counters\n");
+        exit(1);
+    }
+    PerfThreadCounters *pc = (PerfThreadCounters *)mem;
+    memset(pc, 0, sizeof(*pc));
+    PerfThreadCounters *head = __atomic_load_n(&gPerfThreads, __ATOMIC_RELAXED);
+    do {
+        pc->next = head;
+    } while (!__atomic_compare_exchange_n(&gPerfThreads, &head, pc, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    tPerfCounters = pc;
+    return pc;
+}
+
+void perf_snapshot(PerfSnapshot &snap) {
+    memset(&snap, 0, sizeof(snap));
+    snap.timeNs = perf_now_ns();
+    for (PerfThreadCounters *pc = __atomic_load_n(&gPerfThreads, __ATOMIC_ACQUIRE); pc; pc = pc->next) {
+        for (int i = 0; i != PerfCounterCount; ++i) {
+            snap.value[i] += __atomic_load_n(&pc->value[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+char const *perf_counter_name(PerfCounterId id) {
+    switch (id) {
+        case PerfBytesRead: return "bytes_read";
+        case PerfIoWaitNs: return "io_wait_ns";
+        case PerfChunksScanned: return "chunks_scanned";
+        case PerfPacketsDirect: return "packets_direct";
+        case PerfPacketsParsed: return "packets_parsed";
+        case PerfParseNs: return "parse_ns";
+        case PerfDecodeNs: return "decode_ns";
+        case PerfFramesDecoded: return "frames_decoded";
+        case PerfCopyNs: return "copy_ns";
+        case PerfCopyBytes: return "copy_bytes";
+        case PerfSinkWaitNs: return "sink_wait_ns";
+        case PerfIdleNs: return "idle_ns";
+        default: return "unknown";
+    }
+}
+
+void perf_report(FILE *f, PerfSnapshot const &now, PerfSnapshot const *prev) {
+    uint64_t v[PerfCounterCount];
+    uint64_t since = prev ? prev->timeNs : gPerfStartNs;
+    for (int i = 0; i != PerfCounterCount; ++i) {
+        v[i] = now.value[i] - (prev ? prev->value[i] : 0);
+    }
+    double secs = (now.timeNs - since) * 1e-9;
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+    fprintf(f, "%s %.1fs: read %.1f MB (%.1f MB/s), io wait %.2fs | scanned %llu chunks"
+        " | packets %llu direct, %llu parsed (%.2fs) | decoded %llu frames (%.1f fps) in %.2fs"
+        " | copy %.1f MB in %.2fs | sink wait %.2fs | idle %.2fs\n",
+        prev ? "interval" : "total", secs,
+        v[PerfBytesRead] / (1024.0 * 1024.0), v[PerfBytesRead] / (1024.0 * 1024.0) / secs,
+        v[PerfIoWaitNs] * 1e-9, (unsigned long long)v[PerfChunksScanned],
+        (unsigned long long)v[PerfPacketsDirect], (unsigned long long)v[PerfPacketsParsed], v[PerfParseNs] * 1e-9,
+        (unsigned long long)v[PerfFramesDecoded], v[PerfFramesDecoded] / secs, v[PerfDecodeNs] * 1e-9,
+        v[PerfCopyBytes] / (1024.0 * 1024.0), v[PerfCopyNs] * 1e-9,
+        v[PerfSinkWaitNs] * 1e-9, v[PerfIdleNs] * 1e-9);
+}
@@ -0,0 +1,81 @@
+#if !defined(perfcount_h)
+#define perfcount_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+/*  Per-thread performance counters. Each thread bumps its own block with
+ *  plain (relaxed) stores, so counting costs no locks and no shared cache
+ *  lines. perf_snapshot() sums every thread's block, also without locking;
+ *  a snapshot taken while threads run is a moment's view, not exact.
+ *  Blocks outlive their threads, so totals include threads that are gone.
+ *
+ *  Counters ending in Ns are thread time: two threads waiting for a second
+ *  each count two seconds.
+ */
+
+enum PerfCounterId {
+    PerfBytesRead = 0,      //  by async reads and stream-mode chunk reads
+    PerfIoWaitNs,           //  waiting for async reads to land
+    PerfChunksScanned,      //  riff chunks walked by the index scan
+    PerfPacketsDirect,      //  chunks sent to the codec as they are
+    PerfPacketsParsed,      //  packets that came out of av_parser_parse2
+    PerfParseNs,
+    PerfDecodeNs,           //  in avcodec_send_packet and avcodec_receive_frame
+    PerfFramesDecoded,
+    PerfCopyNs,             //  packing, cropping and converting pictures
+    PerfCopyBytes,
+    PerfSinkWaitNs,         //  decoders blocked on a full frame sink queue
+    PerfIdleNs,             //  work queue threads waiting for work
+    PerfCounterCount
+};
+
+//  a block of its own cache lines, so threads never write the same line
+struct PerfThreadCounters {
+    uint64_t value[PerfCounterCount];
+    PerfThreadCounters *next;
+} __attribute__((aligned(64)));
+
+extern __thread PerfThreadCounters *tPerfCounters;
+PerfThreadCounters *perf_register_thread();
+
+inline void perf_add(PerfCounterId id, uint64_t n) {
+    PerfThreadCounters *pc = tPerfCounters;
+    if (!pc) {
+        pc = perf_register_thread();
+    }
+    //  only this thread writes the slot; the atomic store keeps readers
+    //  from seeing a torn value
+    __atomic_store_n(&pc->value[id], pc->value[id] + n, __ATOMIC_RELAXED);
+}
+
+inline uint64_t perf_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Adds the time from construction to destruction to a counter. */
+class PerfTimer {
+    public:
+        PerfTimer(PerfCounterId id) : id_(id), start_(perf_now_ns()) {}
+        ~PerfTimer() { perf_add(id_, perf_now_ns() - start_); }
+    private:
+        PerfCounterId id_;
+        uint64_t start_;
+};
+
+struct PerfSnapshot {
+    uint64_t value[PerfCounterCount];
+    uint64_t timeNs;
+};
+
+void perf_snapshot(PerfSnapshot &snap);
+char const *perf_counter_name(PerfCounterId id);
+/* With prev, reports what happened since prev, with rates; without, the
+ * totals since startup. */
+void perf_report(FILE *f, PerfSnapshot const &now, PerfSnapshot const *prev);
+
+#endif  //  perfcount_h
@@ -0,0 +1,325 @@
+#include "stdafx.h"
+#include "player.h"
+#include "perfcount.h"
+#include <string.h>
+#include <algorithm>
+
+extern bool verbose;
+
+
+Player::Player()
+    : fed_(0)
+    , windowKeys_(0)
+    , inputDone_(false)
+    , running_(false)
+    , stopping_(false)
+    , decodeDone_(false)
+    , start_(0)
+    , clockTime_(0)
+    , clockWallNs_(0)
+    , speed_(1.0)
+{
+    pthread_mutex_init(&mutex_, nullptr);
+    pthread_cond_init(&cond_, nullptr);
+    memset(&stats_, 0, sizeof(stats_));
+}
+
+Player::~Player() {
+    stop();
+    for (auto df : all_) {
+        delete df;
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+bool Player::start(size_t kfpos, uint64_t start, double speed) {
+    stop();
+    fed_ = kfpos;
+    window_.clear();
+    windowKeys_ = 0;
+    inputDone_ = false;
+    //  the pool is made once; a picture still on screen from the last run
+    //  comes back through recycle()
+    while (all_.size() < PLAY_RING_FRAMES) {
+        all_.push_back(new DecodedFrame());
+        free_.push_back(all_.back());
+    }
+    start_ = start;
+    clockTime_ = start;
+    clockWallNs_ = 0;
+    speed_ = std::max(PLAY_MIN_SPEED, std::min(PLAY_MAX_SPEED, speed));
+    memset(&stats_, 0, sizeof(stats_));
+    stopping_ = false;
+    decodeDone_ = false;
+    running_ = true;
+    if (pthread_create(&thread_, NULL, &Player::thread_main, this)) {
+        fprintf(stderr, "playback thread create failed\n");
+        running_ = false;
+        return false;
+    }
+    return true;
+}
+
+void Player::stop() {
+    if (!running_) {
+        return;
+    }
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    void *j = nullptr;
+    pthread_join(thread_, &j);
+    running_ = false;
+    for (auto df : ring_) {
+        df->clear();
+        free_.push_back(df);
+    }
+    ring_.clear();
+    window_.clear();
+    windowKeys_ = 0;
+    if (verbose) {
+        fprintf(stderr, "playback: %llu shown, %llu late, %llu superseded, %llu chunks skipped\n",
+            (unsigned long long)stats_.shown, (unsigned long long)stats_.late,
+            (unsigned long long)stats_.superseded, (unsigned long long)stats_.skipped);
+    }
+}
+
+void Player::feed(std::vector<VideoFrame> const &frames, bool growing) {
+    if (!running_) {
+        return;
+    }
+    pthread_mutex_lock(&mutex_);
+    size_t n0 = window_.size();
+    //  stop at the keyframe after the last whole GOP
+    while (fed_ < frames.size() && windowKeys_ <= PLAY_WINDOW_GOPS) {
+        VideoFrame const &vf = frames[fed_++];
+        window_.push_back(vf);
+        windowKeys_ += vf.keyframe;
+    }
+    bool done = fed_ >= frames.size() && !growing;
+    if (window_.size() != n0 || done != inputDone_) {
+        inputDone_ = done;
+        pthread_cond_broadcast(&cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+uint64_t Player::clock_locked(uint64_t nowNs) const {
+    if (!clockWallNs_) {
+        return clockTime_;
+    }
+    return clockTime_ + (uint64_t)((nowNs - clockWallNs_) * 1e-3 * speed_);
+}
+
+void Player::set_speed(double speed) {
+    speed = std::max(PLAY_MIN_SPEED, std::min(PLAY_MAX_SPEED, speed));
+    pthread_mutex_lock(&mutex_);
+    if (clockWallNs_) {
+        uint64_t now = perf_now_ns();
+        clockTime_ = clock_locked(now);
+        clockWallNs_ = now;
+    }
+    speed_ = speed;
+    pthread_mutex_unlock(&mutex_);
+}
+
+double Player::speed() const {
+    pthread_mutex_lock(&mutex_);
+    double s = speed_;
+    pthread_mutex_unlock(&mutex_);
+    return s;
+}
+
+DecodedFrame *Player::present() {
+    DecodedFrame *df = nullptr;
+    pthread_mutex_lock(&mutex_);
+    uint64_t now = perf_now_ns();
+    if (!clockWallNs_ && !ring_.empty()) {
+        //  the clock starts with the first picture, not with the decode
+        clockTime_ = ring_.front()->time;
+        clockWallNs_ = now;
+    }
+    uint64_t clock = clock_locked(now);
+    while (!ring_.empty() && ring_.front()->time <= clock) {
+        if (df) {
+            df->clear();
+            free_.push_back(df);
+            ++stats_.superseded;
+        }
+        df = ring_.front();
+        ring_.pop_front();
+    }
+    if (df) {
+        ++stats_.shown;
+        pthread_cond_broadcast(&cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+    return df;
+}
+
+void Player::recycle(DecodedFrame *df) {
+    //  hands the codec its buffers back before parking the picture
+    df->clear();
+    pthread_mutex_lock(&mutex_);
+    free_.push_back(df);
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+bool Player::finished() const {
+    pthread_mutex_lock(&mutex_);
+    bool done = decodeDone_ && ring_.empty();
+    pthread_mutex_unlock(&mutex_);
+    return done;
+}
+
+Player::Stats Player::stats() const {
+    pthread_mutex_lock(&mutex_);
+    Stats st = stats_;
+    pthread_mutex_unlock(&mutex_);
+    return st;
+}
+
+void *Player::thread_main(void *p) {
+    ((Player *)p)->run();
+    return nullptr;
+}
+
+//  Waits until a picture is free or the player stops; nullptr for the latter.
+DecodedFrame *Player::take_free() {
+    pthread_mutex_lock(&mutex_);
+    while (free_.empty() && !stopping_) {
+        pthread_cond_wait(&cond_, &mutex_);
+    }
+    DecodedFrame *df = nullptr;
+    if (!stopping_) {
+        df = free_.back();
+        free_.pop_back();
+    }
+    pthread_mutex_unlock(&mutex_);
+    return df;
+}
+
+//  A whole GOP is in the window when a keyframe follows its first chunk.
+bool Player::window_has_gop_locked() const {
+    return !window_.empty() && windowKeys_ > (size_t)window_.front().keyframe;
+}
+
+//  Moves the GOP at the front of the window into gop, or drops it if gop is
+//  nullptr; at the end of the input, that is whatever is left.
+void Player::pop_gop_locked(std::vector<VideoFrame> *gop) {
+    do {
+        windowKeys_ -= window_.front().keyframe;
+        if (gop) {
+            gop->push_back(window_.front());
+        }
+        window_.pop_front();
+    } while (!window_.empty() && !window_.front().keyframe);
+}
+
+//  Waits for a whole GOP; false if the player stops, or the input ends.
+bool Player::take_gop(std::vector<VideoFrame> &gop) {
+    gop.clear();
+    pthread_mutex_lock(&mutex_);
+    while (!stopping_ && !window_has_gop_locked() && !inputDone_) {
+        pthread_cond_wait(&cond_, &mutex_);
+    }
+    if (!stopping_ && !window_.empty()) {
+        pop_gop_locked(&gop);
+    }
+    pthread_mutex_unlock(&mutex_);
+    return !gop.empty();
+}
+
+//  Once the clock is past the keyframe that starts the next GOP, the rest
+//  of the one being decoded would come out late. Drops the whole GOPs in
+//  the window that the clock is past as well, and returns the number of
+//  chunks dropped, or 0 to go on with the current GOP.
+size_t Player::skip_late_locked(uint64_t clock) {
+    if (window_.empty() || !window_.front().keyframe || window_.front().time > clock) {
+        return 0;
+    }
+    size_t n0 = window_.size();
+    while (window_has_gop_locked()) {
+        //  the keyframe after the front GOP
+        size_t next = 1;
+        while (!window_[next].keyframe) {
+            ++next;
+        }
+        if (window_[next].time > clock) {
+            break;
+        }
+        pop_gop_locked(nullptr);
+    }
+    return n0 - window_.size() + 1;
+}
+
+void Player::run() {
+    std::vector<VideoFrame> gop;
+    uint64_t lastQueuedNs = 0;
+    bool stopped = false;
+    while (!stopped && take_gop(gop)) {
+        //  each GOP gets a fresh decoder, with no references to whatever
+        //  was skipped before it
+        decoder_t *d = new_decoder();
+        if (!d) {
+            fprintf(stderr, "playback: could not open a decoder\n");
+            break;
+        }
+        FrameRunDecoder run(d, gop);
+        while (true) {
+            DecodedFrame *df = take_free();
+            if (!df) {
+                stopped = true;
+                break;
+            }
+            uint64_t now = perf_now_ns();
+            pthread_mutex_lock(&mutex_);
+            uint64_t clock = clock_locked(now);
+            bool started = clockWallNs_ != 0;
+            double speed = speed_;
+            size_t skipped = started ? skip_late_locked(clock) : 0;
+            if (skipped) {
+                //  the chunks of this GOP not fed yet, and those dropped from
+                //  the window, less the keyframe that decoding goes on from
+                stats_.skipped += gop.size() - run.position() + skipped - 1;
+                free_.push_back(df);
+            }
+            pthread_mutex_unlock(&mutex_);
+            if (skipped) {
+                break;
+            }
+            bool got = run.next(df);
+            //  when behind, one late picture per tick is still worth showing;
+            //  the rest would be superseded before they got to the screen
+            bool late = got && (df->time < start_ ||
+                (started && df->time + (uint64_t)(PLAY_LATE_NS * 1e-3 * speed) < clock &&
+                    perf_now_ns() - lastQueuedNs < PLAY_LATE_NS));
+            if (!got || late) {
+                //  pictures before the start are only there to decode from
+                bool counted = late && df->time >= start_;
+                df->clear();
+                pthread_mutex_lock(&mutex_);
+                free_.push_back(df);
+                stats_.late += counted;
+                pthread_mutex_unlock(&mutex_);
+                if (!got) {
+                    break;
+                }
+                continue;
+            }
+            //  converting here keeps it off the display thread
+            df->decode_rgb();
+            lastQueuedNs = perf_now_ns();
+            pthread_mutex_lock(&mutex_);
+            ring_.push_back(df);
+            pthread_mutex_unlock(&mutex_);
+        }
+        release_decoder(d);
+    }
+    pthread_mutex_lock(&mutex_);
+    decodeDone_ = true;
+    pthread_mutex_unlock(&mutex_);
+}
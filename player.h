@@ -0,0 +1,111 @@
+#if !defined(player_h)
+#define player_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+
+#include "video.h"
+
+/*  Real-time playback. A decode thread of its own runs ahead of a clock on
+ *  the frame time line, and fills a bounded ring of pictures, converted to
+ *  RGB; the display side takes the newest picture that is due each time it
+ *  ticks. The ring holds PLAY_RING_FRAMES pictures, and the decode thread
+ *  waits while they are all ahead of the clock.
+ *
+ *  The decode thread never sees the frame list itself, which the display
+ *  side may grow (and move) at any time. It takes whole GOPs from a window
+ *  of about PLAY_WINDOW_GOPS of them, which feed() tops up from the frame
+ *  list on each tick; so playback costs the same however long the session
+ *  is, and goes on into frames appended while following one.
+ *
+ *  Falling behind never stalls the clock. Pictures that come out late are
+ *  dropped before they are converted, but for about one per display tick,
+ *  so the picture still moves; and once the clock has passed the start of
+ *  the next GOP, the rest of the current one is skipped, and decoding
+ *  starts again at the GOP the clock is in.
+ *
+ *  start(), stop() and everything else are for one thread (the FLTK one in
+ *  viewtune); the ring is shared with the decode thread under a mutex.
+ */
+#define PLAY_RING_FRAMES 8
+#define PLAY_WINDOW_GOPS 4
+#define PLAY_MIN_SPEED 0.25
+#define PLAY_MAX_SPEED 8.0
+//  a picture this far behind the clock, in wall time, is late; about one
+//  display tick
+#define PLAY_LATE_NS 17000000
+
+class Player {
+    public:
+        struct Stats {
+            uint64_t shown;
+            uint64_t late;          //  decoded after they were due
+            uint64_t skipped;       //  chunks not decoded, to catch up
+            uint64_t superseded;    //  due, but a newer one was too
+        };
+
+        Player();
+        ~Player();
+
+        /* Play frames from position kfpos, which should be a keyframe, and
+         * show pictures from time start on. Nothing is decoded until
+         * feed(). The clock starts when the first picture is presented. */
+        bool start(size_t kfpos, uint64_t start, double speed);
+        /* Top up the decode thread's window from frames, which must be the
+         * same list every time, though it may have grown. growing is false
+         * once nothing more will be appended. */
+        void feed(std::vector<VideoFrame> const &frames, bool growing);
+        void stop();
+        bool playing() const { return running_; }
+        /* Clamped to PLAY_MIN_SPEED .. PLAY_MAX_SPEED; the clock keeps its
+         * place. */
+        void set_speed(double speed);
+        double speed() const;
+        /* The newest picture that is due, or nullptr if there is none yet.
+         * Hand it back with recycle() once it is off the screen. */
+        DecodedFrame *present();
+        void recycle(DecodedFrame *df);
+        /* Decoding is done, and every picture has been presented. */
+        bool finished() const;
+        Stats stats() const;
+
+    private:
+        static void *thread_main(void *p);
+        void run();
+        DecodedFrame *take_free();
+        bool take_gop(std::vector<VideoFrame> &gop);
+        bool window_has_gop_locked() const;
+        void pop_gop_locked(std::vector<VideoFrame> *gop);
+        size_t skip_late_locked(uint64_t clock);
+        uint64_t clock_locked(uint64_t nowNs) const;
+
+        //  the next position in the frame list for feed() to hand over
+        size_t fed_;
+        //  chunks handed over and not yet taken, and the keyframes in them
+        std::deque<VideoFrame> window_;
+        size_t windowKeys_;
+        bool inputDone_;
+        std::vector<DecodedFrame *> all_;
+        std::vector<DecodedFrame *> free_;
+        std::deque<DecodedFrame *> ring_;
+
+        mutable pthread_mutex_t mutex_;
+        pthread_cond_t cond_;
+        pthread_t thread_;
+        bool running_;
+        bool stopping_;
+        bool decodeDone_;
+
+        uint64_t start_;
+        //  the clock reads clockTime_ at clockWallNs_, and moves at speed_;
+        //  clockWallNs_ is 0 until the first picture is presented
+        uint64_t clockTime_;
+        uint64_t clockWallNs_;
+        double speed_;
+        Stats stats_;
+};
+
+#endif  //  player_h
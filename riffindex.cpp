@@ -0,0 +1,401 @@
+#include "stdafx.h"
+#include "riffindex.h"
+#include "video.h"
+#include "telemetry.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RIFF_INDEX_VERSION 3
+
+extern bool verbose;
+
+static char const kIndexMagic[4] = { 'V', 'T', 'I', 'X' };
+
+static std::string index_path(RiffFile *rf) {
+    return rf->path_.string() + ".idx";
+}
+
+static bool stat_riff(RiffFile *rf, struct stat &st) {
+    if (stat(rf->path_.string().c_str(), &st) < 0) {
+        return false;
+    }
+    return true;
+}
+
+#define FOURCC(a, b, c, d) \
+    ((uint32_t)(uint8_t)(a) | ((uint32_t)(uint8_t)(b) << 8) | \
+    ((uint32_t)(uint8_t)(c) << 16) | ((uint32_t)(uint8_t)(d) << 24))
+
+/*  The scan reads each chunk header once, and then, through a table keyed
+ *  on the chunk type, only as much of the payload as its handler needs.
+ *  Chunk types without an entry ("info", and anything unknown) are skipped
+ *  without touching their payload.
+ */
+struct ScanContext {
+    RiffScanSink *sink;
+    RiffScanState *state;
+    TelemetryStore *telemetry;
+    VideoFrame vf;
+};
+
+typedef void (*ChunkHandler)(ScanContext &sc, uint64_t pos, ChunkView const &cv);
+
+struct ChunkHandlerEntry {
+    uint32_t fourcc;
+    //  payload bytes the handler looks at; 0 means all of it
+    size_t readSize;
+    ChunkHandler handler;
+};
+
+static void scan_pdts(ScanContext &sc, uint64_t, ChunkView const &cv) {
+    struct pdts {
+        uint64_t pts;
+        uint64_t dts;
+    };
+    if (cv.size >= sizeof(pdts)) {
+        pdts p;
+        memcpy(&p, cv.data, sizeof(p));
+        sc.vf.pts = p.pts;
+        sc.vf.time = p.pts;
+    }
+}
+
+static void scan_time(ScanContext &sc, uint64_t, ChunkView const &cv) {
+    //  the chunk starts with the time it was recorded; 0, or the top bit
+    //  set, means the recorder had no time, so go by the frame's
+    uint64_t stamp = sc.vf.pts;
+    if (cv.size >= 8) {
+        memcpy(&stamp, cv.data, 8);
+        if (!stamp || stamp >= 0x8000000000000000ULL) {
+            stamp = sc.vf.pts;
+        }
+    }
+    //  the telemetry columns are searched by time, so they must not go
+    //  backwards
+    RiffScanState &st = *sc.state;
+    if (stamp < st.stamp) {
+        stamp = st.stamp;
+    }
+    st.stamp = stamp;
+    size_t offset = 8;
+    while (offset + 6 <= cv.size) {
+        steer_packet sp;
+        memcpy(&sp, &cv.data[offset], 6);
+        switch (sp.code) {
+        case 'S':
+            //  steer
+            sc.vf.steer = (sp.steer == -32768) ? 0 : sp.steer / 16383.0f;
+            sc.vf.throttle = (sp.throttle == -32768) ? 0 : sp.throttle / 16383.0f;
+            if (sc.telemetry) {
+                sc.telemetry->add_steer(stamp, sc.vf.steer, sc.vf.throttle);
+            }
+            offset += 6;
+            break;
+        case 'i':
+            //  ibus
+            if (sc.telemetry && offset + sizeof(ibus_packet) <= cv.size) {
+                ibus_packet ip;
+                memcpy(&ip, &cv.data[offset], sizeof(ip));
+                sc.telemetry->add_ibus(stamp, ip.channel);
+            }
+            offset += 22;
+            break;
+        case 'T':
+            //  trim
+            if (sc.telemetry && offset + sizeof(trim_packet) <= cv.size) {
+                trim_packet tp;
+                memcpy(&tp, &cv.data[offset], sizeof(tp));
+                sc.telemetry->add_trim(stamp, tp.value);
+            }
+            offset += 10;
+            break;
+        default:
+            //  unknown
+            offset = cv.size;
+            break;
+        }
+    }
+}
+
+static void scan_h264(ScanContext &sc, uint64_t pos, ChunkView const &cv) {
+    //  data for keyframe frame info start with 0000 0001 27
+    //  data for pframes start with 0000 0001 21
+    //  the Pi encoder seems to write the keyframe headers in a
+    //  distinct packet from the payload data, so packet size is
+    //  also a seemingly reliable indicator.
+    uint32_t size = cv.header->size;
+    if (size <= 16 || cv.size < 5) {
+        return;
+    }
+    static unsigned char const kf[5] = { 0x00, 0x00, 0x00, 0x01, 0x27 };
+    RiffScanState &st = *sc.state;
+    sc.vf.keyframe = !memcmp(kf, cv.data, sizeof(kf));
+    sc.vf.offset = pos;
+    sc.vf.size = size;
+    sc.vf.index = st.count++;
+    if (sc.vf.keyframe && sc.vf.index > st.gopStart) {
+        sc.sink->gop(st.gopStart, sc.vf.index);
+        st.gopStart = sc.vf.index;
+    }
+    sc.sink->frame(sc.vf);
+}
+
+static ChunkHandlerEntry const kChunkHandlers[] = {
+    { FOURCC('h', '2', '6', '4'), 5, scan_h264 },
+    { FOURCC('p', 'd', 't', 's'), 16, scan_pdts },
+    { FOURCC('t', 'i', 'm', 'e'), 1024, scan_time },
+};
+
+void scan_riff_file(RiffFile *rf, RiffScanSink &sink, RiffScanState &state) {
+    ScanContext sc;
+    memset(&sc.vf, 0, sizeof(sc.vf));
+    sc.sink = &sink;
+    sc.state = &state;
+    sc.telemetry = sink.telemetry();
+    sc.vf.file = rf;
+    sc.vf.pts = state.pts;
+    sc.vf.time = state.pts;
+    sc.vf.steer = state.steer;
+    sc.vf.throttle = state.throttle;
+    ChunkHeader hdr;
+    ChunkView cv;
+    std::vector<char> scratch;
+    uint64_t pos = state.pos;
+    uint64_t nextpos = 0;
+    uint64_t nchunks = 0;
+    while (rf->header_at(pos, hdr, nextpos)) {
+        if (pos + 8 + hdr.size > rf->size_) {
+            //  not all there yet
+            break;
+        }
+        uint32_t type;
+        memcpy(&type, hdr.type, 4);
+        for (auto const &h : kChunkHandlers) {
+            if (h.fourcc == type) {
+                if (rf->view_at(pos, cv, scratch, h.readSize)) {
+                    h.handler(sc, pos, cv);
+                }
+                break;
+            }
+        }
+        pos = nextpos;
+        ++nchunks;
+    }
+    perf_add(PerfChunksScanned, nchunks);
+    if (!rf->growing() && state.count > state.gopStart) {
+        //  nothing more is coming, so the last GOP is complete
+        sink.gop(state.gopStart, state.count);
+        state.gopStart = state.count;
+    }
+    state.pos = pos;
+    state.pts = sc.vf.pts;
+    state.steer = sc.vf.steer;
+    state.throttle = sc.vf.throttle;
+}
+
+//  Collects frames, and passes everything on to next, if there is one.
+class FrameCollector : public RiffScanSink {
+    public:
+        FrameCollector(std::vector<VideoFrame> &frames, RiffScanSink *next = nullptr,
+                TelemetryStore *telemetry = nullptr)
+            : frames_(frames), next_(next), telemetry_(telemetry) {}
+        void frame(VideoFrame const &vf) {
+            frames_.push_back(vf);
+            if (next_) {
+                next_->frame(vf);
+            }
+        }
+        void gop(uint32_t begin, uint32_t end) {
+            if (next_) {
+                next_->gop(begin, end);
+            }
+        }
+        TelemetryStore *telemetry() {
+            return telemetry_;
+        }
+        std::vector<VideoFrame> &frames_;
+        RiffScanSink *next_;
+        TelemetryStore *telemetry_;
+};
+
+void scan_riff_file(RiffFile *rf, std::vector<VideoFrame> &frames) {
+    RiffScanState state = { 0 };
+    scan_riff_file(rf, frames, state);
+}
+
+void scan_riff_file(RiffFile *rf, std::vector<VideoFrame> &frames, RiffScanState &state,
+        TelemetryStore *telemetry) {
+    FrameCollector fc(frames, nullptr, telemetry);
+    scan_riff_file(rf, fc, state);
+}
+
+bool load_riff_index(RiffFile *rf, std::vector<VideoFrame> &frames, TelemetryStore *telemetry) {
+    struct stat st;
+    if (!stat_riff(rf, st)) {
+        return false;
+    }
+    std::string ipath(index_path(rf));
+    int fd = open(ipath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat ist;
+    if (fstat(fd, &ist) < 0 || (size_t)ist.st_size < sizeof(RiffIndexHeader)) {
+        close(fd);
+        return false;
+    }
+    void *m = mmap(nullptr, (size_t)ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        return false;
+    }
+    bool ok = false;
+    RiffIndexHeader const *hdr = (RiffIndexHeader const *)m;
+    if (memcmp(hdr->magic, kIndexMagic, 4) || hdr->version != RIFF_INDEX_VERSION) {
+        if (verbose) {
+            fprintf(stderr, "%s: unknown index format\n", ipath.c_str());
+        }
+    }
+    else if (hdr->fileSize != (uint64_t)st.st_size ||
+            hdr->mtimeSec != (int64_t)st.st_mtim.tv_sec ||
+            hdr->mtimeNsec != (int64_t)st.st_mtim.tv_nsec) {
+        if (verbose) {
+            fprintf(stderr, "%s: index is stale\n", ipath.c_str());
+        }
+    }
+    else if (sizeof(RiffIndexHeader) + hdr->count * sizeof(RiffIndexRecord) + hdr->telemetrySize !=
+            (uint64_t)ist.st_size) {
+        fprintf(stderr, "%s: index is truncated\n", ipath.c_str());
+    }
+    else if (telemetry && !telemetry->load((char const *)m + ist.st_size - hdr->telemetrySize,
+            (size_t)hdr->telemetrySize)) {
+        fprintf(stderr, "%s: bad telemetry in index\n", ipath.c_str());
+    }
+    else {
+        RiffIndexRecord const *rec = (RiffIndexRecord const *)(hdr + 1);
+        size_t base = frames.size();
+        frames.resize(base + hdr->count);
+        for (uint64_t i = 0; i != hdr->count; ++i) {
+            VideoFrame &vf = frames[base + i];
+            vf.pts = rec[i].pts;
+            vf.time = rec[i].pts;
+            vf.offset = rec[i].offset;
+            vf.file = rf;
+            vf.steer = rec[i].steer;
+            vf.throttle = rec[i].throttle;
+            vf.size = rec[i].size;
+            vf.index = (uint32_t)i;
+            vf.keyframe = (rec[i].flags & RiffIndexFlagKeyframe) != 0;
+        }
+        ok = true;
+    }
+    munmap(m, (size_t)ist.st_size);
+    return ok;
+}
+
+bool save_riff_index(RiffFile *rf, VideoFrame const *frames, size_t count, TelemetryStore const *telemetry) {
+    struct stat st;
+    if (!stat_riff(rf, st)) {
+        return false;
+    }
+    RiffIndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, kIndexMagic, 4);
+    hdr.version = RIFF_INDEX_VERSION;
+    hdr.fileSize = (uint64_t)st.st_size;
+    hdr.mtimeSec = (int64_t)st.st_mtim.tv_sec;
+    hdr.mtimeNsec = (int64_t)st.st_mtim.tv_nsec;
+    hdr.count = count;
+    hdr.telemetrySize = telemetry ? telemetry->serialized_size() : 0;
+    std::vector<RiffIndexRecord> recs;
+    recs.reserve(count);
+    for (size_t i = 0; i != count; ++i) {
+        VideoFrame const &vf = frames[i];
+        RiffIndexRecord r;
+        r.offset = vf.offset;
+        r.pts = vf.pts;
+        r.size = vf.size;
+        r.steer = vf.steer;
+        r.throttle = vf.throttle;
+        r.flags = vf.keyframe ? RiffIndexFlagKeyframe : 0;
+        recs.push_back(r);
+    }
+    //  write to a temp file and rename, so a crash never leaves a bad index
+    std::string ipath(index_path(rf));
+    std::string tpath(ipath + ".tmp");
+    FILE *f = fopen(tpath.c_str(), "wb");
+    if (!f) {
+        if (verbose) {
+            fprintf(stderr, "%s: could not write index: %s\n", tpath.c_str(), strerror(errno));
+        }
+        return false;
+    }
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if (ok && !recs.empty()) {
+        ok = fwrite(&recs[0], sizeof(RiffIndexRecord), recs.size(), f) == recs.size();
+    }
+    if (ok && telemetry) {
+        ok = telemetry->save(f);
+    }
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(tpath.c_str(), ipath.c_str()) < 0) {
+        fprintf(stderr, "%s: could not write index\n", ipath.c_str());
+        unlink(tpath.c_str());
+        return false;
+    }
+    return true;
+}
+
+//  Report frames loaded from a sidecar the way a scan would have.
+static void replay_frames(VideoFrame const *frames, size_t count, RiffScanSink &sink) {
+    uint32_t start = 0;
+    for (size_t i = 0; i != count; ++i) {
+        if (frames[i].keyframe && i > start) {
+            sink.gop(start, (uint32_t)i);
+            start = (uint32_t)i;
+        }
+        sink.frame(frames[i]);
+    }
+    if (count > start) {
+        sink.gop(start, (uint32_t)count);
+    }
+}
+
+void index_riff_file(RiffFile *rf, RiffScanSink &sink) {
+    RiffScanState state = { 0 };
+    if (rf->growing()) {
+        scan_riff_file(rf, sink, state);
+        return;
+    }
+    //  the sidecar holds only this segment's telemetry, and the sink's store
+    //  may already have earlier segments in it
+    std::vector<VideoFrame> frames;
+    TelemetryStore telemetry;
+    TelemetryStore *want = sink.telemetry();
+    if (load_riff_index(rf, frames, want ? &telemetry : nullptr)) {
+        replay_frames(frames.empty() ? nullptr : &frames[0], frames.size(), sink);
+        if (want) {
+            want->append(telemetry);
+        }
+        return;
+    }
+    frames.clear();
+    telemetry.clear();
+    FrameCollector fc(frames, &sink, &telemetry);
+    scan_riff_file(rf, fc, state);
+    save_riff_index(rf, frames.empty() ? nullptr : &frames[0], frames.size(), &telemetry);
+    if (want) {
+        want->append(telemetry);
+    }
+}
+
+void index_riff_file(RiffFile *rf, std::vector<VideoFrame> &frames, TelemetryStore *telemetry) {
+    FrameCollector fc(frames, nullptr, telemetry);
+    index_riff_file(rf, fc);
+}
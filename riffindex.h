@@ -0,0 +1,89 @@
+#if !defined(riffindex_h)
+#define riffindex_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class RiffFile;
+class TelemetryStore;
+struct VideoFrame;
+
+/*  The sidecar index lives next to each segment as "<segment>.idx". It is
+ *  a header followed by one fixed-size record per h264 chunk, then the
+ *  segment's telemetry columns (see TelemetryStore::save()), and is only
+ *  trusted when the size and mtime of the segment match what was recorded.
+ */
+struct RiffIndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t count;
+    uint64_t telemetrySize;
+};
+
+struct RiffIndexRecord {
+    uint64_t offset;
+    uint64_t pts;
+    uint32_t size;
+    float steer;
+    float throttle;
+    uint32_t flags;
+};
+
+enum {
+    RiffIndexFlagKeyframe = 1
+};
+
+/* Where a scan stopped, so a segment that is still being written can be
+ * picked up again without rescanning what has already been indexed. */
+struct RiffScanState {
+    uint64_t pos;
+    uint64_t pts;
+    float steer;
+    float throttle;
+    //  the last telemetry time stamp; later ones are kept at or after it
+    uint64_t stamp;
+    uint32_t count;
+    //  index of the keyframe that starts the GOP being scanned
+    uint32_t gopStart;
+};
+
+/* What a scan finds, in file order. frame() gets one VideoFrame per h264
+ * chunk. gop() gets each GOP as the frame index range [begin, end) as soon
+ * as it is known to be complete: just before the keyframe that starts the
+ * next one, or at the end of a segment that is not growing. Frames before
+ * the first keyframe make up a GOP of their own. */
+class RiffScanSink {
+    public:
+        virtual ~RiffScanSink() {}
+        virtual void frame(VideoFrame const &vf) = 0;
+        virtual void gop(uint32_t, uint32_t) {}
+        /* Where to append the "time" chunk telemetry; nullptr skips it. */
+        virtual TelemetryStore *telemetry() { return nullptr; }
+};
+
+/* Walk every chunk of the segment, once, and report each h264 chunk and
+ * each GOP. Frame indices are relative to the segment, starting at 0. Only
+ * complete chunks from state.pos on are scanned, and state is updated, so
+ * a growing segment can be scanned again later. */
+void scan_riff_file(RiffFile *rf, RiffScanSink &sink, RiffScanState &state);
+/* The same, appending one VideoFrame per h264 chunk to frames, and the
+ * telemetry to telemetry if it is not nullptr. */
+void scan_riff_file(RiffFile *rf, std::vector<VideoFrame> &frames);
+void scan_riff_file(RiffFile *rf, std::vector<VideoFrame> &frames, RiffScanState &state,
+    TelemetryStore *telemetry = nullptr);
+
+/* Load a valid sidecar index, or return false if there is none. */
+bool load_riff_index(RiffFile *rf, std::vector<VideoFrame> &frames, TelemetryStore *telemetry = nullptr);
+bool save_riff_index(RiffFile *rf, VideoFrame const *frames, size_t count, TelemetryStore const *telemetry = nullptr);
+
+/* Load the sidecar if it is valid; otherwise scan and write a new one.
+ * Segments that are still growing are scanned, but never get a sidecar.
+ * Either way, sink sees the same frames and GOPs a scan would report. */
+void index_riff_file(RiffFile *rf, RiffScanSink &sink);
+void index_riff_file(RiffFile *rf, std::vector<VideoFrame> &frames, TelemetryStore *telemetry = nullptr);
+
+#endif  //  riffindex_h
@@ -14,6 +14,8 @@
 std::vector<RiffFile *> gRiffFiles;
 std::vector<VideoFrame> gFrames;
 
+static std::string gRiffPattern;
+
 bool matches_except_for_digits(std::string const &a, std::string const &b) {
     size_t p;
     size_t la = a.length();
@@ -43,7 +45,7 @@ bool matches_except_for_digits(std::string const &a, std::string const &b) {
     return true;
 }
 
-void load_all_riffs(std::string const &pin) {
+void load_all_riffs(std::string const &pin, bool follow) {
     std::string path(pin);
     std::string prefix(path);
     size_t pos = prefix.find_last_of('/');
@@ -55,17 +57,64 @@ void load_all_riffs(std::string const &pin) {
         prefix = prefix.substr(0, pos);
     }
     fs::path root(prefix);
-    uint64_t offset = 0;
+    gRiffPattern = path;
+    std::vector<fs::path> segments;
     for (auto const &fn : fs::directory_iterator(prefix)) {
         fs::path fp(fn);
         std::string s(fp.string());
         //  the input string is in FLTK format, which is always forward slashes
         std::replace(s.begin(), s.end(), SEPARATOR, '/');
         if (matches_except_for_digits(s, path)) {
-            gRiffFiles.push_back(new RiffFile(fp, offset));
-            offset += gRiffFiles.back()->size_;
+            segments.push_back(fp);
+        }
+    }
+    //  directory order is arbitrary; the names differ only in digits, so
+    //  shorter-then-lexical is numeric order, which keeps offset_ increasing
+    std::sort(segments.begin(), segments.end(), [](fs::path const &a, fs::path const &b) {
+        std::string const &sa(a.string());
+        std::string const &sb(b.string());
+        if (sa.length() != sb.length()) {
+            return sa.length() < sb.length();
         }
+        return sa < sb;
+    });
+    uint64_t offset = 0;
+    for (auto const &fp : segments) {
+        //  when following a recording, the last segment is still growing
+        bool growing = follow && (&fp == &segments.back());
+        gRiffFiles.push_back(new RiffFile(fp, offset, true, growing));
+        offset += gRiffFiles.back()->size_;
+    }
+}
+
+bool matches_session(std::string const &pin) {
+    std::string s(pin);
+    std::replace(s.begin(), s.end(), SEPARATOR, '/');
+    return !gRiffPattern.empty() && matches_except_for_digits(s, gRiffPattern);
+}
+
+RiffFile *append_riff_file(std::string const &path, bool growing) {
+    uint64_t offset = 0;
+    if (!gRiffFiles.empty()) {
+        gRiffFiles.back()->refresh();
+        offset = gRiffFiles.back()->offset_ + gRiffFiles.back()->size_;
+    }
+    gRiffFiles.push_back(new RiffFile(fs::path(path), offset, true, growing));
+    return gRiffFiles.back();
+}
+
+RiffFile *find_riff_file(uint64_t concatOffset, uint64_t &pos) {
+    auto ptr(std::upper_bound(gRiffFiles.begin(), gRiffFiles.end(), concatOffset,
+        [](uint64_t off, RiffFile const *rf) { return off < rf->offset_; }));
+    if (ptr == gRiffFiles.begin()) {
+        return nullptr;
+    }
+    --ptr;
+    if (concatOffset - (*ptr)->offset_ >= (*ptr)->size_) {
+        return nullptr;
     }
+    pos = concatOffset - (*ptr)->offset_;
+    return *ptr;
 }
 
 
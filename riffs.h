@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 
 class RiffFile;
 class VideoFrame;
@@ -10,6 +11,14 @@ class VideoFrame;
 extern std::vector<RiffFile *> gRiffFiles;
 extern std::vector<VideoFrame> gFrames;
 
-void load_all_riffs(std::string const &path);
+/* With follow set, the last segment is opened as growing (see RiffFile.) */
+void load_all_riffs(std::string const &path, bool follow = false);
+/* Does this path name another segment of the loaded session? */
+bool matches_session(std::string const &path);
+/* Add a new segment after the last one, for sessions still recording. */
+RiffFile *append_riff_file(std::string const &path, bool growing);
+//  Map an offset in the concatenation of all segments back to the segment
+//  that holds it and the position within that segment.
+RiffFile *find_riff_file(uint64_t concatOffset, uint64_t &pos);
 
 #endif // riffs_h
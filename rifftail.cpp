@@ -0,0 +1,136 @@
+#include "stdafx.h"
+#include "rifftail.h"
+#include "riffs.h"
+#include "video.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <algorithm>
+
+extern bool verbose;
+
+RiffTail::RiffTail() : fd_(-1), wd_(-1), current_(nullptr) {
+    memset(&state_, 0, sizeof(state_));
+}
+
+RiffTail::~RiffTail() {
+    stop();
+}
+
+bool RiffTail::start(RiffScanState const &state) {
+    if (fd_ >= 0 || gRiffFiles.empty()) {
+        return false;
+    }
+    current_ = gRiffFiles.back();
+    state_ = state;
+    dir_ = current_->path_.parent_path().string();
+    if (dir_.empty()) {
+        dir_ = ".";
+    }
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) {
+        fprintf(stderr, "inotify_init1(): %s\n", strerror(errno));
+        return false;
+    }
+    wd_ = inotify_add_watch(fd_, dir_.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO);
+    if (wd_ < 0) {
+        fprintf(stderr, "%s: inotify_add_watch(): %s\n", dir_.c_str(), strerror(errno));
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+void RiffTail::stop() {
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+        wd_ = -1;
+    }
+}
+
+bool RiffTail::drain_events() {
+    bool changed = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    std::string curname(current_ ? current_->path_.filename().string() : std::string());
+    while (true) {
+        ssize_t n = read(fd_, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event const *ev = (struct inotify_event const *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (!ev->len) {
+                continue;
+            }
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                std::string path(dir_ + "/" + ev->name);
+                if (matches_session(path) &&
+                        std::find(created_.begin(), created_.end(), path) == created_.end()) {
+                    if (verbose) {
+                        fprintf(stderr, "new segment: %s\n", path.c_str());
+                    }
+                    created_.push_back(path);
+                    changed = true;
+                }
+            }
+            else if (curname == ev->name) {
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+//  The recorder has moved on to a new segment, so current_ is complete:
+//  the scan of what is left of it closes its last GOP, and it gets the
+//  sidecar that a growing segment goes without.
+void RiffTail::finish_current(std::vector<VideoFrame> &frames, TelemetryStore *telemetry) {
+    current_->finish();
+    scan_riff_file(current_, frames, state_, telemetry);
+    std::vector<VideoFrame> scratch;
+    index_riff_file(current_, scratch);
+}
+
+size_t RiffTail::update(std::vector<VideoFrame> &frames, TelemetryStore *telemetry) {
+    size_t n0 = frames.size();
+    if (current_) {
+        if (created_.empty()) {
+            current_->refresh();
+            scan_riff_file(current_, frames, state_, telemetry);
+        }
+        else {
+            finish_current(frames, telemetry);
+        }
+    }
+    //  segment names differ only in digits, so this is numeric order
+    std::sort(created_.begin(), created_.end(), [](std::string const &a, std::string const &b) {
+        if (a.length() != b.length()) {
+            return a.length() < b.length();
+        }
+        return a < b;
+    });
+    for (size_t i = 0; i != created_.size(); ++i) {
+        //  only the newest segment can still be recording
+        bool newest = i + 1 == created_.size();
+        current_ = append_riff_file(created_[i], newest);
+        //  telemetry goes on in the same columns, so its time does too
+        uint64_t stamp = state_.stamp;
+        memset(&state_, 0, sizeof(state_));
+        state_.stamp = stamp;
+        if (newest) {
+            scan_riff_file(current_, frames, state_, telemetry);
+        }
+        else {
+            finish_current(frames, telemetry);
+        }
+    }
+    created_.clear();
+    return frames.size() - n0;
+}
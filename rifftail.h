@@ -0,0 +1,44 @@
+#if !defined(rifftail_h)
+#define rifftail_h
+
+#include "riffindex.h"
+#include <string>
+#include <vector>
+
+class RiffFile;
+struct VideoFrame;
+
+/*  Follow a session that is still being recorded. The directory is watched
+ *  with inotify; whenever the last segment grows, or a new segment shows up,
+ *  update() indexes only the chunks that have landed since the last call.
+ */
+class RiffTail {
+    public:
+        RiffTail();
+        ~RiffTail();
+
+        /* Watch the directory of the last loaded segment. state is where
+         * the scan of that segment left off. */
+        bool start(RiffScanState const &state);
+        void stop();
+        /* for Fl::add_fd() or poll() */
+        int fd() const { return fd_; }
+        /* Read pending events; returns true if the session changed. */
+        bool drain_events();
+        /* Append newly completed frames, and their telemetry if telemetry
+         * is not nullptr. Frame indices are relative to their segment, as
+         * with scan_riff_file(). */
+        size_t update(std::vector<VideoFrame> &frames, TelemetryStore *telemetry = nullptr);
+
+    private:
+        void finish_current(std::vector<VideoFrame> &frames, TelemetryStore *telemetry);
+
+        int fd_;
+        int wd_;
+        std::string dir_;
+        RiffFile *current_;
+        RiffScanState state_;
+        std::vector<std::string> created_;
+};
+
+#endif  //  rifftail_h
@@ -0,0 +1,247 @@
+#include "stdafx.h"
+#include "shardsink.h"
+#include "framesink.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+
+extern bool verbose;
+
+static size_t round_up(size_t n, size_t a) {
+    return (n + a - 1) / a * a;
+}
+
+class ShardSink : public FrameSink {
+    public:
+        ShardSink(std::string const &dir, ShardPixelFormat format, bool crop, size_t perShard)
+            : dir_(dir)
+            , format_(format)
+            , crop_(crop)
+            , perShard_(perShard)
+            , file_(nullptr)
+            , shardNo_(0)
+            , total_(0)
+        {
+            memset(&hdr_, 0, sizeof(hdr_));
+            if (mkdir(dir_.c_str(), 0777) < 0 && errno != EEXIST) {
+                throw std::runtime_error(dir_ + ": " + strerror(errno));
+            }
+        }
+        ~ShardSink() {
+            if (file_) {
+                fclose(file_);
+                unlink(tpath_.c_str());
+            }
+        }
+        char const *name() { return "shard"; }
+
+        void consume(SinkFrame const *frames, size_t count) {
+            for (size_t i = 0; i != count; ++i) {
+                write_record(frames[i]);
+            }
+        }
+
+        void finish() {
+            if (file_) {
+                close_shard();
+            }
+            fprintf(stderr, "shard sink: %llu records in %u shards in %s\n",
+                (unsigned long long)total_, shardNo_, dir_.c_str());
+        }
+
+    private:
+        void write_record(SinkFrame const &sf) {
+            DecodedFrame *df = sf.picture;
+            if (!df->valid()) {
+                return;
+            }
+            unsigned char const *cropped = crop_ ? df->crop() : nullptr;
+            int w = crop_ ? df->cropWidth : df->width;
+            int h = crop_ ? df->cropHeight : df->height;
+            if (hdr_.width == 0) {
+                set_geometry(w, h);
+            }
+            else if (w != (int)hdr_.width || h != (int)hdr_.height) {
+                throw std::runtime_error("picture size changed from " + std::to_string(hdr_.width) +
+                    "x" + std::to_string(hdr_.height) + " to " + std::to_string(w) +
+                    "x" + std::to_string(h));
+            }
+            if (!file_) {
+                open_shard();
+            }
+            VideoFrame const &vf = sf.telemetry;
+            ShardLabel *lab = (ShardLabel *)&record_[0];
+            lab->pts = vf.pts;
+            lab->time = df->time;
+            lab->steer = vf.steer;
+            lab->throttle = vf.throttle;
+            lab->frameIndex = vf.index;
+            lab->source = source_id(vf.file);
+            lab->flags = df->keyframe ? ShardFlagKeyframe : 0;
+            unsigned char *pix = &record_[hdr_.pixelOffset];
+            if (!cropped) {
+                memcpy(pix, (format_ == ShardPixelRGB24) ? df->decode_rgb() : df->packed_yuv(), hdr_.pixelSize);
+            }
+            else if (format_ == ShardPixelRGB24) {
+                //  straight into the record; the crop is small
+                unsigned char const *u = cropped + w * h;
+                unsigned char const *v = u + ((w + 1) / 2) * ((h + 1) / 2);
+                yuv420_to_rgb(cropped, u, v, w, h, w, (w + 1) / 2, pix, w * 3, df->matrix);
+            }
+            else {
+                memcpy(pix, cropped, hdr_.pixelSize);
+            }
+            if (fwrite(&record_[0], record_.size(), 1, file_) != 1) {
+                throw std::runtime_error(tpath_ + ": " + strerror(errno));
+            }
+            ShardIndexEntry ie;
+            ie.offset = hdr_.dataOffset + index_.size() * hdr_.recordStride;
+            ie.steer = vf.steer;
+            ie.throttle = vf.throttle;
+            ie.frameIndex = vf.index;
+            ie.source = lab->source;
+            index_.push_back(ie);
+            ++total_;
+            if (index_.size() >= perShard_) {
+                close_shard();
+            }
+        }
+
+        void set_geometry(uint32_t w, uint32_t h) {
+            hdr_.width = w;
+            hdr_.height = h;
+            hdr_.pixelFormat = format_;
+            hdr_.labelSize = sizeof(ShardLabel);
+            hdr_.pixelOffset = sizeof(ShardLabel);
+            if (format_ == ShardPixelRGB24) {
+                hdr_.pixelSize = w * h * 3;
+            }
+            else {
+                hdr_.pixelSize = w * h + 2 * ((w + 1) / 2) * ((h + 1) / 2);
+            }
+            hdr_.recordStride = round_up(hdr_.pixelOffset + hdr_.pixelSize, SHARD_ALIGN);
+            record_.assign(hdr_.recordStride, 0);
+        }
+
+        uint32_t source_id(RiffFile *rf) {
+            auto ptr = sourceIds_.find(rf);
+            if (ptr != sourceIds_.end()) {
+                return ptr->second;
+            }
+            uint32_t id = (uint32_t)sourceIds_.size();
+            sourceIds_[rf] = id;
+            sources_.push_back(rf ? rf->path_.string() : std::string());
+            return id;
+        }
+
+        void open_shard() {
+            char name[32];
+            sprintf(name, "/shard-%05u.vts", shardNo_);
+            path_ = dir_ + name;
+            tpath_ = path_ + ".tmp";
+            if (!(file_ = fopen(tpath_.c_str(), "wb"))) {
+                throw std::runtime_error(tpath_ + ": " + strerror(errno));
+            }
+            index_.clear();
+            sourceIds_.clear();
+            sources_.clear();
+            memcpy(hdr_.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+            hdr_.version = SHARD_VERSION;
+            hdr_.headerSize = SHARD_ALIGN;
+            hdr_.dataOffset = SHARD_ALIGN;
+            //  the header is written for real when the shard is closed
+            std::vector<char> zero(SHARD_ALIGN, 0);
+            if (fwrite(&zero[0], zero.size(), 1, file_) != 1) {
+                throw std::runtime_error(tpath_ + ": " + strerror(errno));
+            }
+        }
+
+        void close_shard() {
+            hdr_.count = index_.size();
+            hdr_.indexOffset = hdr_.dataOffset + hdr_.count * hdr_.recordStride;
+            std::string names;
+            for (auto const &s : sources_) {
+                names.append(s.c_str(), s.size() + 1);
+            }
+            hdr_.sourcesOffset = hdr_.indexOffset + hdr_.count * sizeof(ShardIndexEntry);
+            hdr_.sourcesSize = names.size();
+            bool ok = true;
+            if (!index_.empty()) {
+                ok = fwrite(&index_[0], sizeof(ShardIndexEntry), index_.size(), file_) == index_.size();
+            }
+            if (ok && !names.empty()) {
+                ok = fwrite(names.data(), names.size(), 1, file_) == 1;
+            }
+            ok = ok && fseek(file_, 0, SEEK_SET) == 0 && fwrite(&hdr_, sizeof(hdr_), 1, file_) == 1;
+            if (fclose(file_) != 0) {
+                ok = false;
+            }
+            file_ = nullptr;
+            if (!ok || rename(tpath_.c_str(), path_.c_str()) < 0) {
+                unlink(tpath_.c_str());
+                throw std::runtime_error(path_ + ": could not write shard");
+            }
+            if (verbose) {
+                fprintf(stderr, "%s: %llu records of %llu bytes\n", path_.c_str(),
+                    (unsigned long long)hdr_.count, (unsigned long long)hdr_.recordStride);
+            }
+            ++shardNo_;
+        }
+
+        std::string dir_;
+        ShardPixelFormat format_;
+        bool crop_;
+        size_t perShard_;
+        FILE *file_;
+        std::string path_;
+        std::string tpath_;
+        unsigned shardNo_;
+        uint64_t total_;
+        ShardHeader hdr_;
+        std::vector<unsigned char> record_;
+        std::vector<ShardIndexEntry> index_;
+        std::map<RiffFile *, uint32_t> sourceIds_;
+        std::vector<std::string> sources_;
+};
+
+static FrameSink *make_shard_sink(char const *arg) {
+    if (!arg || !*arg) {
+        throw std::runtime_error("needs an output directory");
+    }
+    std::string spec(arg);
+    std::string dir(spec.substr(0, spec.find(',')));
+    ShardPixelFormat format = ShardPixelRGB24;
+    bool crop = false;
+    size_t perShard = 4096;
+    size_t pos = spec.find(',');
+    while (pos != std::string::npos) {
+        size_t next = spec.find(',', pos + 1);
+        std::string opt(spec.substr(pos + 1, next == std::string::npos ? std::string::npos : next - pos - 1));
+        if (opt == "rgb") {
+            format = ShardPixelRGB24;
+        }
+        else if (opt == "yuv") {
+            format = ShardPixelYUV420;
+        }
+        else if (opt == "crop") {
+            crop = true;
+        }
+        else if (!strncmp(opt.c_str(), "frames=", 7) && atoi(opt.c_str() + 7) > 0) {
+            perShard = (size_t)atoi(opt.c_str() + 7);
+        }
+        else {
+            throw std::runtime_error("unknown option " + opt);
+        }
+        pos = next;
+    }
+    return new ShardSink(dir, format, crop, perShard);
+}
+
+void register_shard_sink() {
+    register_frame_sink("shard", ":dir[,rgb|yuv][,crop][,frames=n] fixed-stride training shards", make_shard_sink);
+}
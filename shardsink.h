@@ -0,0 +1,82 @@
+#if !defined(shardsink_h)
+#define shardsink_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*  Training shards, written by the "shard" frame sink. A shard is meant to
+ *  be mapped (or read with O_DIRECT) and indexed, never parsed:
+ *
+ *  - a ShardHeader, zero padded to SHARD_ALIGN bytes
+ *  - count records of recordStride bytes each, starting at dataOffset. A
+ *    record is a ShardLabel, then the picture at pixelOffset within the
+ *    record, then zero padding. recordStride is a multiple of SHARD_ALIGN.
+ *  - count ShardIndexEntry, at indexOffset
+ *  - the source segment paths, NUL terminated, at sourcesOffset; a label's
+ *    source is the position of its path in this list
+ *
+ *  Every picture in a shard has the same size and pixel format. Records are
+ *  in the order pictures came out of the decoders, not time order; sort by
+ *  (source, frameIndex) if that matters. Shards are written to a temp name
+ *  and renamed when complete, so a loader never sees a partial one.
+ */
+
+#define SHARD_MAGIC "VTSHARD"
+#define SHARD_VERSION 1
+#define SHARD_ALIGN 4096
+
+enum ShardPixelFormat {
+    //  interleaved R, G, B, 3 bytes per pixel
+    ShardPixelRGB24 = 1,
+    //  planar Y, then U, then V at half size each way
+    ShardPixelYUV420 = 2
+};
+
+struct ShardHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t count;
+    uint64_t recordStride;
+    uint64_t dataOffset;
+    uint64_t indexOffset;
+    uint64_t sourcesOffset;
+    uint64_t sourcesSize;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelFormat;
+    uint32_t pixelOffset;
+    uint32_t pixelSize;
+    uint32_t labelSize;
+};
+
+struct ShardLabel {
+    uint64_t pts;
+    uint64_t time;
+    float steer;
+    float throttle;
+    uint32_t frameIndex;
+    uint32_t source;
+    uint32_t flags;
+    uint32_t reserved[7];
+};
+
+enum {
+    ShardFlagKeyframe = 1
+};
+
+struct ShardIndexEntry {
+    uint64_t offset;
+    float steer;
+    float throttle;
+    uint32_t frameIndex;
+    uint32_t source;
+};
+
+/* Registers "shard:dir[,rgb|yuv][,crop][,frames=n]", which writes
+ * dir/shard-NNNNN.vts with at most n records each (4096 by default.) With
+ * crop, records hold DecodedFrame::crop() (see set_crop_spec()) instead of
+ * the whole picture. */
+void register_shard_sink();
+
+#endif  //  shardsink_h
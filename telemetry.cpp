@@ -0,0 +1,300 @@
+#include "stdafx.h"
+#include "telemetry.h"
+#include <string.h>
+#include <algorithm>
+
+TelemetryStore gTelemetry;
+
+
+void MinMaxPyramid::clear() {
+    min_.clear();
+    max_.clear();
+}
+
+void MinMaxPyramid::update(std::vector<float> const &v, size_t from) {
+    size_t n = v.size();
+    size_t cell = kBaseCell;
+    size_t dirty = from / kBaseCell;
+    for (size_t k = 0; ; ++k, cell *= kFanout, dirty /= kFanout) {
+        size_t count = (n + cell - 1) / cell;
+        if (k == min_.size()) {
+            if (count <= 1 && k) {
+                //  one cell is the whole column; nothing coarser is useful
+                break;
+            }
+            min_.push_back(std::vector<float>());
+            max_.push_back(std::vector<float>());
+            //  a new level has no cells to keep
+            dirty = 0;
+        }
+        std::vector<float> &mn = min_[k];
+        std::vector<float> &mx = max_[k];
+        mn.resize(count);
+        mx.resize(count);
+        for (size_t c = dirty; c < count; ++c) {
+            float lo, hi;
+            if (!k) {
+                size_t b = c * kBaseCell, e = std::min(b + kBaseCell, n);
+                lo = hi = v[b];
+                for (size_t i = b + 1; i < e; ++i) {
+                    lo = std::min(lo, v[i]);
+                    hi = std::max(hi, v[i]);
+                }
+            }
+            else {
+                std::vector<float> const &pmn = min_[k - 1];
+                std::vector<float> const &pmx = max_[k - 1];
+                size_t b = c * kFanout, e = std::min(b + kFanout, pmn.size());
+                lo = pmn[b];
+                hi = pmx[b];
+                for (size_t i = b + 1; i < e; ++i) {
+                    lo = std::min(lo, pmn[i]);
+                    hi = std::max(hi, pmx[i]);
+                }
+            }
+            mn[c] = lo;
+            mx[c] = hi;
+        }
+        if (count <= 1) {
+            break;
+        }
+    }
+}
+
+void MinMaxPyramid::minmax(std::vector<float> const &v, size_t begin, size_t end, float &mn, float &mx) const {
+    size_t len = end - begin;
+    if (min_.empty() || len < (size_t)kBaseCell * kFanout) {
+        mn = mx = v[begin];
+        for (size_t i = begin + 1; i < end; ++i) {
+            mn = std::min(mn, v[i]);
+            mx = std::max(mx, v[i]);
+        }
+        return;
+    }
+    //  the coarsest level that still has a few cells across the range
+    size_t k = 0;
+    size_t cell = kBaseCell;
+    while (k + 1 < min_.size() && cell * kFanout * kFanout <= len) {
+        ++k;
+        cell *= kFanout;
+    }
+    std::vector<float> const &lmn = min_[k];
+    std::vector<float> const &lmx = max_[k];
+    size_t c0 = begin / cell;
+    size_t c1 = std::min((end + cell - 1) / cell, lmn.size());
+    mn = lmn[c0];
+    mx = lmx[c0];
+    for (size_t c = c0 + 1; c < c1; ++c) {
+        mn = std::min(mn, lmn[c]);
+        mx = std::max(mx, lmx[c]);
+    }
+}
+
+
+TelemetryStore::TelemetryStore() {
+    clear();
+}
+
+void TelemetryStore::clear() {
+    for (int s = 0; s != TelemetrySourceCount; ++s) {
+        time_[s].clear();
+    }
+    for (int c = 0; c != TelemetryColumnCount; ++c) {
+        column_[c].value.clear();
+        column_[c].pyramid.clear();
+        column_[c].built = 0;
+    }
+}
+
+void TelemetryStore::add_steer(uint64_t t, float steer, float throttle) {
+    time_[TelemetrySourceSteer].push_back(t);
+    column_[TelemetrySteer].value.push_back(steer);
+    column_[TelemetryThrottle].value.push_back(throttle);
+}
+
+void TelemetryStore::add_trim(uint64_t t, int16_t const value[4]) {
+    time_[TelemetrySourceTrim].push_back(t);
+    for (int i = 0; i != 4; ++i) {
+        column_[TelemetryTrim0 + i].value.push_back(value[i]);
+    }
+}
+
+void TelemetryStore::add_ibus(uint64_t t, uint16_t const value[10]) {
+    time_[TelemetrySourceIbus].push_back(t);
+    for (int i = 0; i != 10; ++i) {
+        column_[TelemetryIbus0 + i].value.push_back(value[i]);
+    }
+}
+
+void TelemetryStore::append(TelemetryStore const &o) {
+    for (int s = 0; s != TelemetrySourceCount; ++s) {
+        time_[s].insert(time_[s].end(), o.time_[s].begin(), o.time_[s].end());
+    }
+    for (int c = 0; c != TelemetryColumnCount; ++c) {
+        column_[c].value.insert(column_[c].value.end(), o.column_[c].value.begin(), o.column_[c].value.end());
+    }
+}
+
+void TelemetryStore::build() {
+    for (int c = 0; c != TelemetryColumnCount; ++c) {
+        Column &col = column_[c];
+        if (col.built != col.value.size()) {
+            col.pyramid.update(col.value, col.built);
+            col.built = col.value.size();
+        }
+    }
+}
+
+size_t TelemetryStore::size(TelemetryColumnId c) const {
+    return column_[c].value.size();
+}
+
+uint64_t const *TelemetryStore::times(TelemetryColumnId c) const {
+    std::vector<uint64_t> const &t = time_[source_of(c)];
+    return t.empty() ? nullptr : &t[0];
+}
+
+float const *TelemetryStore::values(TelemetryColumnId c) const {
+    std::vector<float> const &v = column_[c].value;
+    return v.empty() ? nullptr : &v[0];
+}
+
+void TelemetryStore::minmax_index(TelemetryColumnId c, size_t begin, size_t end, float &mn, float &mx) const {
+    Column const &col = column_[c];
+    if (end <= col.built) {
+        col.pyramid.minmax(col.value, begin, end, mn, mx);
+        return;
+    }
+    //  samples the pyramid has not seen yet
+    mn = mx = col.value[begin];
+    for (size_t i = begin + 1; i < end; ++i) {
+        mn = std::min(mn, col.value[i]);
+        mx = std::max(mx, col.value[i]);
+    }
+}
+
+bool TelemetryStore::minmax(TelemetryColumnId c, uint64_t t0, uint64_t t1, float &mn, float &mx) const {
+    std::vector<uint64_t> const &t = time_[source_of(c)];
+    size_t b = std::lower_bound(t.begin(), t.end(), t0) - t.begin();
+    size_t e = std::lower_bound(t.begin() + b, t.end(), t1) - t.begin();
+    if (b >= e) {
+        return false;
+    }
+    minmax_index(c, b, e, mn, mx);
+    return true;
+}
+
+void TelemetryStore::plot(TelemetryColumnId c, uint64_t t0, uint64_t t1, int n, float *mn, float *mx) const {
+    std::vector<uint64_t> const &t = time_[source_of(c)];
+    size_t b = std::lower_bound(t.begin(), t.end(), t0) - t.begin();
+    double span = t1 > t0 ? (double)(t1 - t0) : 0;
+    for (int i = 0; i != n; ++i) {
+        uint64_t te = t0 + (uint64_t)(span * (i + 1) / n);
+        size_t e = std::lower_bound(t.begin() + b, t.end(), te) - t.begin();
+        if (b < e) {
+            minmax_index(c, b, e, mn[i], mx[i]);
+        }
+        else if (b > 0 && b < t.size()) {
+            //  zoomed in past the sample rate: hold the previous sample
+            mn[i] = mx[i] = column_[c].value[b - 1];
+        }
+        else {
+            mn[i] = 1;
+            mx[i] = 0;
+        }
+        b = e;
+    }
+}
+
+//  Per source: the sample count, the times, then each of its columns.
+size_t TelemetryStore::serialized_size() const {
+    size_t n = 0;
+    for (int s = 0; s != TelemetrySourceCount; ++s) {
+        n += sizeof(uint64_t) + time_[s].size() * sizeof(uint64_t);
+    }
+    for (int c = 0; c != TelemetryColumnCount; ++c) {
+        n += column_[c].value.size() * sizeof(float);
+    }
+    return n;
+}
+
+bool TelemetryStore::save(FILE *f) const {
+    for (int s = 0; s != TelemetrySourceCount; ++s) {
+        uint64_t count = time_[s].size();
+        if (fwrite(&count, sizeof(count), 1, f) != 1) {
+            return false;
+        }
+        if (count && fwrite(&time_[s][0], sizeof(uint64_t), count, f) != count) {
+            return false;
+        }
+        for (int c = 0; c != TelemetryColumnCount; ++c) {
+            if (source_of((TelemetryColumnId)c) == s && count &&
+                    fwrite(&column_[c].value[0], sizeof(float), count, f) != count) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool TelemetryStore::load(void const *data, size_t size) {
+    clear();
+    unsigned char const *p = (unsigned char const *)data;
+    unsigned char const *end = p + size;
+    for (int s = 0; s != TelemetrySourceCount; ++s) {
+        uint64_t count;
+        if (end - p < (ptrdiff_t)sizeof(count)) {
+            clear();
+            return false;
+        }
+        memcpy(&count, p, sizeof(count));
+        p += sizeof(count);
+        int ncols = 0;
+        for (int c = 0; c != TelemetryColumnCount; ++c) {
+            ncols += source_of((TelemetryColumnId)c) == s;
+        }
+        if (count > (uint64_t)(end - p) / (sizeof(uint64_t) + ncols * sizeof(float))) {
+            clear();
+            return false;
+        }
+        time_[s].resize(count);
+        if (count) {
+            memcpy(&time_[s][0], p, count * sizeof(uint64_t));
+        }
+        p += count * sizeof(uint64_t);
+        for (int c = 0; c != TelemetryColumnCount; ++c) {
+            if (source_of((TelemetryColumnId)c) == s) {
+                column_[c].value.resize(count);
+                if (count) {
+                    memcpy(&column_[c].value[0], p, count * sizeof(float));
+                }
+                p += count * sizeof(float);
+            }
+        }
+    }
+    if (p != end) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+TelemetrySource TelemetryStore::source_of(TelemetryColumnId c) {
+    if (c < TelemetryTrim0) {
+        return TelemetrySourceSteer;
+    }
+    if (c < TelemetryIbus0) {
+        return TelemetrySourceTrim;
+    }
+    return TelemetrySourceIbus;
+}
+
+char const *TelemetryStore::column_name(TelemetryColumnId c) {
+    static char const *const names[TelemetryColumnCount] = {
+        "steer", "throttle",
+        "trim0", "trim1", "trim2", "trim3",
+        "ibus0", "ibus1", "ibus2", "ibus3", "ibus4",
+        "ibus5", "ibus6", "ibus7", "ibus8", "ibus9",
+    };
+    return (c >= 0 && c < TelemetryColumnCount) ? names[c] : "unknown";
+}
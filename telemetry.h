@@ -0,0 +1,103 @@
+#if !defined(telemetry_h)
+#define telemetry_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+/*  Telemetry from the "time" chunks, as columns. Each packet type is a
+ *  source with its own sorted time column, and each value in the packet is
+ *  a float column of the same length:
+ *
+ *  - 'S' gives steer and throttle, scaled to -1 .. 1 as in VideoFrame
+ *  - 'T' gives four trim values, and 'i' ten ibus channels, both raw
+ *
+ *  Times are the stamps recorded with each chunk, on the pts clock.
+ */
+enum TelemetrySource {
+    TelemetrySourceSteer = 0,
+    TelemetrySourceTrim,
+    TelemetrySourceIbus,
+    TelemetrySourceCount
+};
+
+enum TelemetryColumnId {
+    TelemetrySteer = 0,
+    TelemetryThrottle,
+    TelemetryTrim0,
+    TelemetryIbus0 = TelemetryTrim0 + 4,
+    TelemetryColumnCount = TelemetryIbus0 + 10
+};
+
+/*  Min and max over blocks of a column, at several resolutions. A cell of
+ *  level k covers kBaseCell << (2 * k) samples, so a range of any length is
+ *  answered from a handful of cells; only ranges shorter than a few base
+ *  cells look at the samples themselves.
+ */
+class MinMaxPyramid {
+    public:
+        enum { kBaseCell = 16, kFanout = 4 };
+
+        void clear();
+        /* Recompute every cell that covers samples from from on. */
+        void update(std::vector<float> const &v, size_t from);
+        /* min and max of v over [begin, end), which must not be empty. A
+         * wide range may be widened to cell boundaries, which is fine
+         * for drawing, but not exact. */
+        void minmax(std::vector<float> const &v, size_t begin, size_t end, float &mn, float &mx) const;
+
+    private:
+        std::vector<std::vector<float> > min_;
+        std::vector<std::vector<float> > max_;
+};
+
+class TelemetryStore {
+    public:
+        TelemetryStore();
+
+        void clear();
+        void add_steer(uint64_t t, float steer, float throttle);
+        void add_trim(uint64_t t, int16_t const value[4]);
+        void add_ibus(uint64_t t, uint16_t const value[10]);
+        /* Append another store's samples; o should come later in time. */
+        void append(TelemetryStore const &o);
+        /* Bring the pyramids up to date with samples added since the last
+         * call. Queries before the first build() see no pyramid, only raw
+         * samples. */
+        void build();
+
+        size_t size(TelemetryColumnId c) const;
+        uint64_t const *times(TelemetryColumnId c) const;
+        float const *values(TelemetryColumnId c) const;
+        /* min and max over [t0, t1); false if there is no sample in it */
+        bool minmax(TelemetryColumnId c, uint64_t t0, uint64_t t1, float &mn, float &mx) const;
+        /* Split [t0, t1) into n equal buckets (one per pixel column, say)
+         * and get the min and max of each. A bucket with no sample of its
+         * own holds the previous sample's value; one before the first
+         * sample or after the last gets mn > mx. */
+        void plot(TelemetryColumnId c, uint64_t t0, uint64_t t1, int n, float *mn, float *mx) const;
+
+        /* Serialized form, for the sidecar index. */
+        size_t serialized_size() const;
+        bool save(FILE *f) const;
+        bool load(void const *data, size_t size);
+
+        static TelemetrySource source_of(TelemetryColumnId c);
+        static char const *column_name(TelemetryColumnId c);
+
+    private:
+        struct Column {
+            std::vector<float> value;
+            MinMaxPyramid pyramid;
+            size_t built;
+        };
+        void minmax_index(TelemetryColumnId c, size_t begin, size_t end, float &mn, float &mx) const;
+
+        std::vector<uint64_t> time_[TelemetrySourceCount];
+        Column column_[TelemetryColumnCount];
+};
+
+extern TelemetryStore gTelemetry;
+
+#endif  //  telemetry_h
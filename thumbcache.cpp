@@ -0,0 +1,248 @@
+#include "stdafx.h"
+#include "thumbcache.h"
+#include "video.h"
+#include "riffs.h"
+#include "frameindex.h"
+#include "yuvscale.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define THUMB_FILE_VERSION 1
+
+extern bool verbose;
+
+static char const kThumbMagic[4] = { 'V', 'T', 'T', 'H' };
+
+ThumbCache gThumbCache;
+
+
+static std::string thumb_path(RiffFile *rf) {
+    return rf->path_.string() + ".thm";
+}
+
+void thumb_size(int width, int height, int &tw, int &th) {
+    th = THUMB_HEIGHT;
+    tw = height > 0 ? (width * THUMB_HEIGHT / height + 1) & ~1 : 2;
+    if (tw < 2) {
+        tw = 2;
+    }
+}
+
+bool make_keyframe_thumb(std::vector<VideoFrame> &frames, ThumbPicture &pic) {
+    DecodedFrame df;
+    bool got = decode_keyframe(frames, &df);
+    if (got) {
+        int tw, th;
+        thumb_size(df.width, df.height, tw, th);
+        CropSpec spec = { 0, 0, 0, 0, tw, th, CropFilterBox };
+        CropSpec cs;
+        crop_geometry(spec, df.width, df.height, cs);
+        pic.width = tw;
+        pic.height = th;
+        pic.matrix = df.matrix;
+        pic.yuv.resize(yuv420_size(tw, th));
+        df.crop_to(cs, &pic.yuv[0]);
+    }
+    //  hands the codec its buffers back
+    df.clear();
+    return got;
+}
+
+
+ThumbCache::ThumbCache() {
+}
+
+size_t ThumbCache::thumb_bytes(Segment const &seg) const {
+    return yuv420_size(seg.width, seg.height);
+}
+
+void ThumbCache::sync() {
+    size_t firstNewSegment = segments_.size();
+    for (size_t k = key_.size(), n = gFrameIndex.num_keyframes(); k < n; ++k) {
+        uint32_t fid = gFrameIndex.file_id(gFrameIndex.keyframe(k));
+        while (segments_.size() <= fid) {
+            Segment seg;
+            seg.file = segments_.size() < gRiffFiles.size() ? gRiffFiles[segments_.size()] : nullptr;
+            seg.firstKey = k;
+            seg.numKeys = 0;
+            seg.numHave = 0;
+            seg.width = 0;
+            seg.height = 0;
+            seg.matrix = YuvMatrixBT601;
+            seg.saved = false;
+            segments_.push_back(seg);
+        }
+        ++segments_[fid].numKeys;
+        Key key = { fid, false, false };
+        key_.push_back(key);
+    }
+    for (size_t i = 0; i != segments_.size(); ++i) {
+        Segment &seg = segments_[i];
+        if (seg.width) {
+            seg.pixels.resize(seg.numKeys * thumb_bytes(seg));
+        }
+        if (i >= firstNewSegment && seg.file && !seg.file->growing() && seg.numKeys) {
+            load(seg);
+        }
+    }
+}
+
+unsigned char const *ThumbCache::get(size_t k, int &width, int &height, YuvMatrix &matrix) const {
+    if (!has(k)) {
+        return nullptr;
+    }
+    Segment const &seg = segments_[key_[k].segment];
+    width = seg.width;
+    height = seg.height;
+    matrix = seg.matrix;
+    return &seg.pixels[(k - seg.firstKey) * thumb_bytes(seg)];
+}
+
+void ThumbCache::put(size_t k, ThumbPicture const &pic) {
+    if (k >= key_.size() || key_[k].have) {
+        return;
+    }
+    Segment &seg = segments_[key_[k].segment];
+    if (!seg.width) {
+        seg.width = pic.width;
+        seg.height = pic.height;
+        seg.matrix = pic.matrix;
+        seg.pixels.resize(seg.numKeys * thumb_bytes(seg));
+    }
+    if (pic.width != seg.width || pic.height != seg.height || pic.yuv.size() != thumb_bytes(seg)) {
+        return;
+    }
+    memcpy(&seg.pixels[(k - seg.firstKey) * thumb_bytes(seg)], &pic.yuv[0], pic.yuv.size());
+    key_[k].have = true;
+    ++seg.numHave;
+}
+
+void ThumbCache::take_missing(size_t begin, size_t end, std::vector<size_t> &out) {
+    if (end > key_.size()) {
+        end = key_.size();
+    }
+    for (size_t k = begin; k < end; ++k) {
+        if (!key_[k].have && !key_[k].requested) {
+            key_[k].requested = true;
+            out.push_back(k);
+        }
+    }
+}
+
+void ThumbCache::save_complete() {
+    for (auto &seg : segments_) {
+        if (!seg.saved && seg.file && seg.numKeys && seg.numHave == seg.numKeys && !seg.file->growing()) {
+            //  once, whether it works or not
+            seg.saved = true;
+            save(seg);
+        }
+    }
+}
+
+bool ThumbCache::load(Segment &seg) {
+    struct stat st;
+    if (stat(seg.file->path_.string().c_str(), &st) < 0) {
+        return false;
+    }
+    std::string path(thumb_path(seg.file));
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    bool ok = false;
+    ThumbFileHeader hdr;
+    std::vector<uint64_t> offsets;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, kThumbMagic, 4) ||
+            hdr.version != THUMB_FILE_VERSION) {
+        if (verbose) {
+            fprintf(stderr, "%s: unknown thumbnail format\n", path.c_str());
+        }
+    }
+    else if (hdr.fileSize != (uint64_t)st.st_size ||
+            hdr.mtimeSec != (int64_t)st.st_mtim.tv_sec ||
+            hdr.mtimeNsec != (int64_t)st.st_mtim.tv_nsec ||
+            hdr.count != seg.numKeys || !hdr.width || !hdr.height) {
+        if (verbose) {
+            fprintf(stderr, "%s: thumbnails are stale\n", path.c_str());
+        }
+    }
+    else {
+        offsets.resize(hdr.count);
+        ok = fread(&offsets[0], sizeof(uint64_t), hdr.count, f) == hdr.count;
+        //  the keyframes must be the ones the thumbnails were made from
+        for (size_t i = 0; ok && i != hdr.count; ++i) {
+            ok = gFrames[gFrameIndex.keyframe(seg.firstKey + i)].offset == offsets[i];
+        }
+        if (ok) {
+            seg.width = hdr.width;
+            seg.height = hdr.height;
+            seg.matrix = hdr.matrix == YuvMatrixBT709 ? YuvMatrixBT709 : YuvMatrixBT601;
+            seg.pixels.resize(seg.numKeys * thumb_bytes(seg));
+            ok = fread(&seg.pixels[0], 1, seg.pixels.size(), f) == seg.pixels.size();
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: thumbnails are truncated or do not match\n", path.c_str());
+            seg.width = 0;
+            seg.height = 0;
+            std::vector<unsigned char>().swap(seg.pixels);
+        }
+    }
+    fclose(f);
+    if (ok) {
+        for (size_t i = 0; i != seg.numKeys; ++i) {
+            key_[seg.firstKey + i].have = true;
+        }
+        seg.numHave = seg.numKeys;
+        seg.saved = true;
+    }
+    return ok;
+}
+
+bool ThumbCache::save(Segment const &seg) {
+    struct stat st;
+    if (stat(seg.file->path_.string().c_str(), &st) < 0) {
+        return false;
+    }
+    ThumbFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, kThumbMagic, 4);
+    hdr.version = THUMB_FILE_VERSION;
+    hdr.fileSize = (uint64_t)st.st_size;
+    hdr.mtimeSec = (int64_t)st.st_mtim.tv_sec;
+    hdr.mtimeNsec = (int64_t)st.st_mtim.tv_nsec;
+    hdr.count = (uint32_t)seg.numKeys;
+    hdr.width = (uint16_t)seg.width;
+    hdr.height = (uint16_t)seg.height;
+    hdr.matrix = seg.matrix;
+    std::vector<uint64_t> offsets;
+    for (size_t i = 0; i != seg.numKeys; ++i) {
+        offsets.push_back(gFrames[gFrameIndex.keyframe(seg.firstKey + i)].offset);
+    }
+    //  write to a temp file and rename, so a crash never leaves a bad one
+    std::string path(thumb_path(seg.file));
+    std::string tpath(path + ".tmp");
+    FILE *f = fopen(tpath.c_str(), "wb");
+    if (!f) {
+        if (verbose) {
+            fprintf(stderr, "%s: could not write thumbnails: %s\n", tpath.c_str(), strerror(errno));
+        }
+        return false;
+    }
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+        fwrite(&offsets[0], sizeof(uint64_t), offsets.size(), f) == offsets.size() &&
+        fwrite(&seg.pixels[0], 1, seg.pixels.size(), f) == seg.pixels.size();
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(tpath.c_str(), path.c_str()) < 0) {
+        fprintf(stderr, "%s: could not write thumbnails\n", path.c_str());
+        unlink(tpath.c_str());
+        return false;
+    }
+    if (verbose) {
+        fprintf(stderr, "%s: %ld thumbnails\n", path.c_str(), (long)seg.numKeys);
+    }
+    return true;
+}
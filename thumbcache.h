@@ -0,0 +1,102 @@
+#if !defined(thumbcache_h)
+#define thumbcache_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "yuvrgb.h"
+
+class RiffFile;
+struct VideoFrame;
+
+/*  One small picture per keyframe, so the session can be browsed without
+ *  decoding video. Thumbnails are packed YUV 4:2:0, THUMB_HEIGHT lines
+ *  high, keeping the aspect of the source, and are keyed by keyframe
+ *  number (see FrameIndex::keyframe().)
+ *
+ *  Each segment's thumbnails are kept next to it as "<segment>.thm": a
+ *  ThumbFileHeader, the chunk offset of each keyframe, then the pictures.
+ *  Like the sidecar index, it is only trusted when the size and mtime of
+ *  the segment match, and it is written once every keyframe of a segment
+ *  that is no longer growing has its thumbnail.
+ *
+ *  The cache is not thread safe; viewtune only touches it on the FLTK
+ *  thread, and decodes on the work queue with make_keyframe_thumb().
+ */
+#define THUMB_HEIGHT 60
+
+struct ThumbFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint32_t count;
+    uint16_t width;
+    uint16_t height;
+    uint32_t matrix;
+    uint32_t reserved;
+};
+
+struct ThumbPicture {
+    int width;
+    int height;
+    YuvMatrix matrix;
+    std::vector<unsigned char> yuv;
+};
+
+class ThumbCache {
+    public:
+        ThumbCache();
+
+        /* Pick up keyframes and segments added to gFrameIndex since the
+         * last call, and load the sidecars of segments that are new. */
+        void sync();
+        size_t size() const { return key_.size(); }
+        bool has(size_t k) const { return k < key_.size() && key_[k].have; }
+        /* The thumbnail for keyframe k, or nullptr if there is none yet. */
+        unsigned char const *get(size_t k, int &width, int &height, YuvMatrix &matrix) const;
+        /* Store a thumbnail; one whose size does not match the others of its
+         * segment is dropped. */
+        void put(size_t k, ThumbPicture const &pic);
+        /* Keyframes in [begin, end) that have no thumbnail and have not been
+         * handed out by this call before. */
+        void take_missing(size_t begin, size_t end, std::vector<size_t> &out);
+        /* Write the sidecars of segments that have become complete. */
+        void save_complete();
+
+    private:
+        struct Segment {
+            RiffFile *file;
+            size_t firstKey;
+            size_t numKeys;
+            size_t numHave;
+            int width;
+            int height;
+            YuvMatrix matrix;
+            std::vector<unsigned char> pixels;
+            bool saved;
+        };
+        struct Key {
+            uint32_t segment;
+            bool have;
+            bool requested;
+        };
+        bool load(Segment &seg);
+        bool save(Segment const &seg);
+        size_t thumb_bytes(Segment const &seg) const;
+
+        std::vector<Segment> segments_;
+        std::vector<Key> key_;
+};
+
+extern ThumbCache gThumbCache;
+
+/* The thumbnail size for a picture of width x height. */
+void thumb_size(int width, int height, int &tw, int &th);
+/* Decode the keyframe that starts frames with decode_keyframe(), and scale
+ * it into pic. */
+bool make_keyframe_thumb(std::vector<VideoFrame> &frames, ThumbPicture &pic);
+
+#endif  //  thumbcache_h
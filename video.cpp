@@ -2,6 +2,7 @@
 #include "video.h"
 #include "riffs.h"
 #include <vector>
+#include <deque>
 #include <stdio.h>
 
 extern "C" {
@@ -28,10 +29,13 @@ bool firstTime = true;
 class Decoder {
 public:
     bool begin_decode(VideoFrame *frame);
-    VideoFrame *decode_frame_and_advance(VideoFrame *frame, DecodedFrame *result,
+    bool decode_frame_and_advance(VideoFrame *&frame, DecodedFrame *result,
             VideoFrame *(*next_frame)(VideoFrame *, void *), void *);
+    bool send_and_receive(VideoFrame *indata, DecodedFrame *result);
+    bool receive(VideoFrame const *indata, DecodedFrame *result);
+    bool drain(DecodedFrame *result);
 
-    Decoder();
+    Decoder(bool frameThreads = true);
     ~Decoder();
 
     AVCodec *codec;
@@ -43,9 +47,53 @@ public:
     uint64_t ptsbase = 0;
     uint64_t dtsbase = 0;
     std::vector<char> readBuf;
+    RiffFile *bufFile = nullptr;
+    uint64_t bufPos = 0;
+    unsigned char const *bufData = nullptr;
+    size_t bufSize = 0;
+    //  Chunks sent to the codec that have not come out as pictures yet.
+    //  Each packet carries its sequence number as pts; frame threads hand
+    //  pictures back a few packets late.
+    struct Pending {
+        int64_t seq;
+        uint64_t time;
+        uint32_t index;
+        bool keyframe;
+    };
+    std::deque<Pending> pending;
+    int64_t nextSeq = 0;
+    bool draining = false;
+    bool frameThreads;
+
+    bool buffer_view(VideoFrame const *indata, ChunkView &cv);
+
+private:
+    bool open();
+    void reset();
 };
 
-Decoder::Decoder() {
+static int gCodecThreads = 1;
+static int gCodecThreadType = DecoderThreadSlice;
+
+void set_decoder_threads(int count, int type) {
+    gCodecThreads = count;
+    gCodecThreadType = type ? type : DecoderThreadSlice;
+}
+
+int parse_decoder_thread_type(char const *str) {
+    if (!strcmp(str, "slice")) {
+        return DecoderThreadSlice;
+    }
+    if (!strcmp(str, "frame")) {
+        return DecoderThreadFrame;
+    }
+    if (!strcmp(str, "both")) {
+        return DecoderThreadSlice | DecoderThreadFrame;
+    }
+    return 0;
+}
+
+Decoder::Decoder(bool ft) : frameThreads(ft) {
     if (firstTime) {
         avcodec_register_all();
         firstTime = false;
@@ -56,11 +104,15 @@ Decoder::Decoder() {
 }
 
 Decoder::~Decoder() {
-    //  todo: deallocate libav
+    if (parser) {
+        av_parser_close(parser);
+    }
+    av_frame_free(&frame);
+    avcodec_free_context(&ctx);
 }
 
-bool Decoder::begin_decode(VideoFrame *) {
-    readBuf.clear();
+//  Opening the codec is the expensive part, so it happens once per Decoder.
+bool Decoder::open() {
     codec = avcodec_find_decoder(AV_CODEC_ID_H264);
     if (!codec) {
         fprintf(stderr, "avcodec_find_decoder(): h264 not found\n");
@@ -72,8 +124,19 @@ bool Decoder::begin_decode(VideoFrame *) {
         return false;
     }
     ctx->flags2 |= AV_CODEC_FLAG2_CHUNKS;
+    //  decoded pictures are handed out by reference
+    ctx->refcounted_frames = 1;
+    ctx->thread_count = gCodecThreads;
+    ctx->thread_type = 0;
+    if (gCodecThreadType & DecoderThreadFrame) {
+        ctx->thread_type |= frameThreads ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+    }
+    if (gCodecThreadType & DecoderThreadSlice) {
+        ctx->thread_type |= FF_THREAD_SLICE;
+    }
     if (avcodec_open2(ctx, codec, NULL) < 0) {
         fprintf(stderr, "avcodec_open2(): failed to open\n");
+        avcodec_free_context(&ctx);
         return false;
     }
     frame = av_frame_alloc();
@@ -86,6 +149,25 @@ bool Decoder::begin_decode(VideoFrame *) {
         fprintf(stderr, "av_parser_init(): h264 failed\n");
         return false;
     }
+    return true;
+}
+
+//  Drop reference frames and anything buffered, so the next GOP starts clean.
+void Decoder::reset() {
+    avcodec_flush_buffers(ctx);
+    av_frame_unref(frame);
+}
+
+bool Decoder::begin_decode(VideoFrame *) {
+    readBuf.clear();
+    if (!ctx) {
+        if (!open()) {
+            return false;
+        }
+    }
+    else {
+        reset();
+    }
     memset(&avp, 0, sizeof(avp));
     av_init_packet(&avp);
 
@@ -95,113 +177,297 @@ bool Decoder::begin_decode(VideoFrame *) {
     dtsbase = 0;
     avp.data = NULL;
     avp.size = 0;
+    bufFile = nullptr;
+    bufPos = 0;
+    bufData = nullptr;
+    bufSize = 0;
+    pending.clear();
+    draining = false;
+    ctx->skip_frame = AVDISCARD_DEFAULT;
 
     return true;
 }
 
-VideoFrame *Decoder::decode_frame_and_advance(VideoFrame *indata, DecodedFrame *result,
-        VideoFrame *(*next_frame)(VideoFrame *, void *), void *cookie) {
-    bool kf = false;
-    uint64_t t = indata->time;
-parse_more:
-    if (!indata) {
-        return nullptr;
+//  The Pi encoder writes one complete Annex B packet per h264 chunk, so a
+//  chunk that starts with a start code can go to the decoder as it is.
+static bool packet_is_direct(unsigned char const *data, uint32_t size) {
+    if (size >= 5 && data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 1) {
+        return !(data[4] & 0x80);
     }
-    indata->file->data_at(indata->offset, readBuf);
-    if (indata->keyframe) {
-        kf = true;
+    if (size >= 4 && data[0] == 0 && data[1] == 0 && data[2] == 1) {
+        return !(data[3] & 0x80);
     }
-    avp.pts = indata->pts;
-    avp.dts = indata->pts;
-    int lenParsed = av_parser_parse2(parser, ctx, &avp.data, &avp.size,
-        (unsigned char *)&readBuf[0], readBuf.size(), avp.pts, avp.dts, avp.pos);
-    if (verbose) {
-        fprintf(stderr, "av_parser_parse2(): offset %lld lenParsed %d size %d pointer %p readbuf 0x%p\n",
-            (long long)indata->offset, lenParsed, avp.size, avp.data, &readBuf[0]);
-    }
-    if (lenParsed) {
-        indata = next_frame(indata, cookie);
+    return false;
+}
+
+//  libavcodec only promises not to over-read a damaged stream if the first
+//  23 bits of the padding are zero. What follows a chunk in the file is
+//  usually the next chunk's FourCC, so it is only borrowed when it is zero.
+static bool padding_is_zero(ChunkView const &cv) {
+    return !cv.data[cv.size] && !cv.data[cv.size + 1] && !(cv.data[cv.size + 2] & 0xfe);
+}
+
+bool Decoder::decode_frame_and_advance(VideoFrame *&indata, DecodedFrame *result,
+        VideoFrame *(*next_frame)(VideoFrame *, void *), void *cookie) {
+    //  with frame threads, a picture may be ready without sending anything
+    if (!pending.empty() && receive(indata, result)) {
+        return true;
     }
-    if (avp.size) {
-        int lenSent = avcodec_send_packet(ctx, &avp);
-        if (lenSent < 0) {
-            if (verbose) {
-                fprintf(stderr, "avcodec_send_packet(): error %d at concatoffset %ld\n",
-                    lenSent, (long)avp.pos);
-            }
+    while (indata) {
+        ChunkView cv;
+        //  a chunk from the caller's buffer is followed by the next chunk's
+        //  header, and only the last one by zero padding
+        bool buffered = buffer_view(indata, cv);
+        if (!buffered && !indata->file->view_at(indata->offset, cv, readBuf)) {
+            fprintf(stderr, "ERROR reading chunk index %d offset %lld file %s\n",
+                indata->index, (long long)indata->offset, indata->file->path_.string().c_str());
+            indata = nullptr;
+            return false;
         }
-        avp.pos += avp.size;
-        int err = avcodec_receive_frame(ctx, frame);
-        if (err == 0) {
-            //  got a frame!
-            result->time = t;
-            result->width = 640;
-            result->height = 480;
-            if (!result->yuv_planar) {
-                result->yuv_planar = new unsigned char[640 * 480 + 320 * 240 * 2];
-            }
-            for (int r = 0; r != 480; ++r) {
-                memcpy(result->yuv_planar + result->width * r, frame->data[0] + frame->linesize[0] * r, 640);
-            }
-            unsigned char *du = result->yuv_planar + 640 * 480;
-            for (int r = 0; r != 240; ++r) {
-                memcpy(du + 320 * r, frame->data[1] + frame->linesize[1] * r, 320);
-            }
-            unsigned char *dv = result->yuv_planar + 640 * 480 + 320 * 240;
-            for (int r = 0; r != 240; ++r) {
-                memcpy(dv + 320 * r, frame->data[2] + frame->linesize[2] * r, 320);
-            }
-            result->set_decoded(t, 640, 480, result->yuv_planar, kf);
-            ++frameno;
-            if (ctx->refcounted_frames) {
-                av_frame_unref(frame);
-            }
-            if (lenParsed > 0) {
-                readBuf.erase(readBuf.begin(), readBuf.begin() + lenParsed);
+        else if ((!buffered && !indata->file->readable_past(cv, AV_INPUT_BUFFER_PADDING_SIZE)) ||
+                !padding_is_zero(cv)) {
+            //  stream mode, the very end of the mapping, or what follows
+            //  the chunk is not zero: pad a copy
+            size_t off = cv.data - (unsigned char const *)&readBuf[0];
+            if (!buffered && !indata->file->mapped()) {
+                readBuf.resize(readBuf.size() + AV_INPUT_BUFFER_PADDING_SIZE);
             }
             else {
-                readBuf.clear();    //  didn't advance frame pointers
+                readBuf.assign((char const *)cv.data, (char const *)cv.data + cv.size);
+                readBuf.resize(cv.size + AV_INPUT_BUFFER_PADDING_SIZE);
+                off = 0;
             }
-            goto ret;
+            memset(&readBuf[off + cv.size], 0, AV_INPUT_BUFFER_PADDING_SIZE);
+            cv.data = (unsigned char const *)&readBuf[off];
         }
-        else if (err == AVERROR(EAGAIN)) {
-            //  nothing for now
+        int64_t pts = nextSeq++;
+        Pending pd = { pts, indata->time, indata->index, indata->keyframe };
+        pending.push_back(pd);
+        int64_t pos = indata->file->offset_ + indata->offset;
+        bool direct = packet_is_direct(cv.data, cv.size);
+        if (!direct && verbose) {
+            fprintf(stderr, "chunk index %d offset %lld is not a packet; using parser\n",
+                indata->index, (long long)indata->offset);
         }
-        else if (err == AVERROR_EOF) {
-            //  nothing for now
+        VideoFrame *current = indata;
+        indata = next_frame(indata, cookie);
+        bool got = false;
+        if (direct) {
+            perf_add(PerfPacketsDirect, 1);
+            avp.data = (uint8_t *)cv.data;
+            avp.size = (int)cv.size;
+            avp.pts = pts;
+            avp.dts = pts;
+            avp.pos = pos;
+            got = send_and_receive(current, result);
         }
         else {
-            //  not a header
-            if (indata->size > 128) {
+            //  feed the chunk through the parser, then flush and reset it,
+            //  so that nothing is left buffered when the next chunk goes direct
+            unsigned char const *data = cv.data;
+            int left = (int)cv.size;
+            avp.pts = pts;
+            avp.dts = pts;
+            avp.pos = pos;
+            while (left > 0) {
+                int lenParsed;
+                {
+                    PerfTimer pt(PerfParseNs);
+                    lenParsed = av_parser_parse2(parser, ctx, &avp.data, &avp.size,
+                        data, left, pts, pts, pos);
+                }
                 if (verbose) {
-                    fprintf(stderr, "avcodec_receive_frame() error %d offset %ld file %s\n",
-                        err, (long)indata->offset, indata->file->path_.string().c_str());
+                    fprintf(stderr, "av_parser_parse2(): offset %lld lenParsed %d size %d pointer %p\n",
+                        (long long)current->offset, lenParsed, avp.size, avp.data);
+                }
+                data += lenParsed;
+                left -= lenParsed;
+                if (avp.size) {
+                    perf_add(PerfPacketsParsed, 1);
+                    got = send_and_receive(current, result) || got;
+                }
+                else if (!lenParsed) {
+                    fprintf(stderr, "ERROR in parser: lenParsed is 0 but no frame found index %d offset %lld file %s\n",
+                        current->index, (long long)current->offset, current->file->path_.string().c_str());
+                    indata = nullptr;
+                    return false;
                 }
-                // return false;
             }
+            {
+                PerfTimer pt(PerfParseNs);
+                av_parser_parse2(parser, ctx, &avp.data, &avp.size, nullptr, 0, pts, pts, pos);
+            }
+            if (avp.size) {
+                perf_add(PerfPacketsParsed, 1);
+                got = send_and_receive(current, result) || got;
+            }
+            av_parser_close(parser);
+            parser = av_parser_init(AV_CODEC_ID_H264);
+        }
+        if (got) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Decoder::buffer_view(VideoFrame const *indata, ChunkView &cv) {
+    if (!bufData || indata->file != bufFile || indata->offset < bufPos ||
+            indata->offset + 8 > bufPos + bufSize) {
+        return false;
+    }
+    cv.header = (ChunkHeader const *)(bufData + (indata->offset - bufPos));
+    if (indata->offset + 8 + cv.header->size > bufPos + bufSize) {
+        return false;
+    }
+    cv.data = (unsigned char const *)(cv.header + 1);
+    cv.size = cv.header->size;
+    return true;
+}
+
+bool Decoder::send_and_receive(VideoFrame *indata, DecodedFrame *result) {
+    int lenSent;
+    {
+        PerfTimer pt(PerfDecodeNs);
+        lenSent = avcodec_send_packet(ctx, &avp);
+    }
+    if (lenSent < 0) {
+        if (verbose) {
+            fprintf(stderr, "avcodec_send_packet(): error %d at concatoffset %ld\n",
+                lenSent, (long)avp.pos);
+        }
+    }
+    return receive(indata, result);
+}
+
+bool Decoder::receive(VideoFrame const *indata, DecodedFrame *result) {
+    int err;
+    {
+        PerfTimer pt(PerfDecodeNs);
+        err = avcodec_receive_frame(ctx, frame);
+    }
+    if (err == 0) {
+        perf_add(PerfFramesDecoded, 1);
+        //  got a frame! it stands for every chunk sent since the previous
+        //  picture, so it takes the time and index of the first of them
+        uint64_t t = 0;
+        uint32_t index = 0;
+        bool kf = frame->key_frame != 0;
+        if (!pending.empty()) {
+            t = pending.front().time;
+            index = pending.front().index;
+            int64_t seq = (frame->pts == AV_NOPTS_VALUE) ? pending.front().seq : frame->pts;
+            while (!pending.empty() && pending.front().seq <= seq) {
+                kf = kf || pending.front().keyframe;
+                pending.pop_front();
+            }
+        }
+        if (!result->set_decoded(t, frame, kf)) {
+            fprintf(stderr, "unsupported pixel format %d\n", frame->format);
+            av_frame_unref(frame);
+            return false;
         }
+        result->index = index;
+        ++frameno;
+        return true;
     }
-    if (lenParsed > 0) {
-        readBuf.erase(readBuf.begin(), readBuf.begin() + lenParsed);
-        goto parse_more;
+    else if (err == AVERROR(EAGAIN)) {
+        //  nothing for now
+    }
+    else if (err == AVERROR_EOF) {
+        //  nothing for now
     }
     else {
-        readBuf.clear();    //  didn't advance frame pointers
+        //  not a header
+        if (indata && indata->size > 128) {
+            if (verbose) {
+                fprintf(stderr, "avcodec_receive_frame() error %d offset %ld file %s\n",
+                    err, (long)indata->offset, indata->file->path_.string().c_str());
+            }
+        }
     }
-    //  it didn't consume any data, yet it didn't return a frame?
-    fprintf(stderr, "ERROR in parser: lenParsed is 0 but no frame found index %d offset %lld file %s\n",
-        indata->index, (long long)indata->offset, indata->file->path_.string().c_str());
-    return nullptr;
-ret:
-    return indata;
+    return false;
+}
+
+bool Decoder::drain(DecodedFrame *result) {
+    if (!draining) {
+        avcodec_send_packet(ctx, nullptr);
+        draining = true;
+    }
+    return receive(nullptr, result);
+}
+
+
+DecodedFrame::~DecodedFrame() {
+    clear();
+    av_frame_free(&av_);
+}
+
+void DecodedFrame::clear() {
+    delete[] yuv_planar;
+    yuv_planar = nullptr;
+    delete[] rgb_interleaved;
+    rgb_interleaved = nullptr;
+    delete[] cropped;
+    cropped = nullptr;
+    if (av_) {
+        av_frame_unref(av_);
+    }
+    for (int i = 0; i != 3; ++i) {
+        planes_[i] = nullptr;
+        strides_[i] = 0;
+    }
+}
+
+bool DecodedFrame::set_decoded(uint64_t t, AVFrame *frame, bool kf) {
+    clear();
+    if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+        return false;
+    }
+    if (!av_ && !(av_ = av_frame_alloc())) {
+        return false;
+    }
+    av_frame_move_ref(av_, frame);
+    time = t;
+    width = (uint16_t)av_->width;
+    height = (uint16_t)av_->height;
+    keyframe = kf;
+    matrix = (av_->colorspace == AVCOL_SPC_BT709) ? YuvMatrixBT709 : YuvMatrixBT601;
+    for (int i = 0; i != 3; ++i) {
+        planes_[i] = av_->data[i];
+        strides_[i] = av_->linesize[i];
+    }
+    return true;
+}
+
+unsigned char const *DecodedFrame::packed_yuv() {
+    if (!yuv_planar && valid()) {
+        PerfTimer pt(PerfCopyNs);
+        int cw = (width + 1) / 2;
+        int ch = (height + 1) / 2;
+        perf_add(PerfCopyBytes, (size_t)width * height + 2 * cw * ch);
+        yuv_planar = new unsigned char[width * height + 2 * cw * ch];
+        unsigned char *d = yuv_planar;
+        for (int r = 0; r != height; ++r, d += width) {
+            memcpy(d, planes_[0] + (size_t)strides_[0] * r, width);
+        }
+        for (int p = 1; p != 3; ++p) {
+            for (int r = 0; r != ch; ++r, d += cw) {
+                memcpy(d, planes_[p] + (size_t)strides_[p] * r, cw);
+            }
+        }
+    }
+    return yuv_planar;
 }
 
 
 Decoder *gDecoder;
 
 void begin_decode(VideoFrame *frame) {
-    delete gDecoder;
-    gDecoder = new Decoder();
+    if (!gDecoder) {
+        //  one picture per call leaves no room to drain frame threads
+        gDecoder = new Decoder(false);
+    }
     gDecoder->begin_decode(frame);
 }
 
@@ -215,24 +481,125 @@ static VideoFrame *static_next_frame(VideoFrame *indata, void *) {
     return indata;
 }
 
-VideoFrame *decode_frame_and_advance(VideoFrame *frame, DecodedFrame *result) {
+bool decode_frame_and_advance(VideoFrame *&frame, DecodedFrame *result) {
     return gDecoder->decode_frame_and_advance(frame, result, static_next_frame, nullptr);
 }
 
+/*  Decoders that are not in use, ready to be flushed and reused. There is
+ *  at most one per thread that ever decoded at the same time.
+ */
+static std::vector<Decoder *> gDecoderPool;
+static pthread_mutex_t gDecoderPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
 struct decoder_t *new_decoder() {
-    Decoder *dec = new Decoder();
-    dec->begin_decode(nullptr);
+    Decoder *dec = nullptr;
+    pthread_mutex_lock(&gDecoderPoolLock);
+    if (!gDecoderPool.empty()) {
+        dec = gDecoderPool.back();
+        gDecoderPool.pop_back();
+    }
+    pthread_mutex_unlock(&gDecoderPoolLock);
+    if (!dec) {
+        dec = new Decoder();
+    }
+    if (!dec->begin_decode(nullptr)) {
+        delete dec;
+        return nullptr;
+    }
     return (decoder_t *)dec;
 }
 
-VideoFrame *decode_frame_and_advance(decoder_t *decoder, VideoFrame *frame, DecodedFrame *result,
+bool decode_frame_and_advance(decoder_t *decoder, VideoFrame *&frame, DecodedFrame *result,
         VideoFrame *(next_frame)(VideoFrame *, void *), void *cookie) {
     Decoder *dec = (Decoder *)decoder;
     return dec->decode_frame_and_advance(frame, result, next_frame, cookie);
 }
 
+bool decoder_drain(decoder_t *decoder, DecodedFrame *result) {
+    return ((Decoder *)decoder)->drain(result);
+}
+
+FrameRunDecoder::FrameRunDecoder(decoder_t *dec, std::vector<VideoFrame> &frames, size_t pos)
+    : dec_(dec)
+    , frames_(frames)
+{
+    for (size_t i = 0; i != frames_.size(); ++i) {
+        frames_[i].index = (uint32_t)i;
+    }
+    next_ = pos < frames_.size() ? &frames_[pos] : nullptr;
+}
+
+size_t FrameRunDecoder::position() const {
+    return next_ ? next_->index : frames_.size();
+}
+
+VideoFrame *FrameRunDecoder::next_frame(VideoFrame *fr, void *co) {
+    FrameRunDecoder *r = (FrameRunDecoder *)co;
+    if (fr->index + 1 < r->frames_.size()) {
+        return &r->frames_[fr->index + 1];
+    }
+    return nullptr;
+}
+
+bool FrameRunDecoder::next(DecodedFrame *result) {
+    if (next_ && decode_frame_and_advance(dec_, next_, result, &FrameRunDecoder::next_frame, this)) {
+        return true;
+    }
+    //  frame threads still hold the last few pictures
+    return decoder_drain(dec_, result);
+}
+
+bool decode_keyframe(std::vector<VideoFrame> &frames, DecodedFrame *result) {
+    if (frames.empty()) {
+        return false;
+    }
+    decoder_t *d = new_decoder();
+    if (!d) {
+        return false;
+    }
+    decoder_set_keyframes_only(d, true);
+    FrameRunDecoder run(d, frames);
+    bool got = run.next(result);
+    release_decoder(d);
+    return got && result->valid();
+}
+
+void release_decoder(struct decoder_t *dec) {
+    if (!dec) {
+        return;
+    }
+    pthread_mutex_lock(&gDecoderPoolLock);
+    gDecoderPool.push_back((Decoder *)dec);
+    pthread_mutex_unlock(&gDecoderPoolLock);
+}
+
 void destroy_decoder(struct decoder_t *dec) {
     delete (Decoder *)dec;
 }
 
+void free_decoders() {
+    pthread_mutex_lock(&gDecoderPoolLock);
+    std::vector<Decoder *> pool;
+    pool.swap(gDecoderPool);
+    pthread_mutex_unlock(&gDecoderPoolLock);
+    for (auto dec : pool) {
+        delete dec;
+    }
+    delete gDecoder;
+    gDecoder = nullptr;
+}
+
+void decoder_set_keyframes_only(decoder_t *decoder, bool on) {
+    ((Decoder *)decoder)->ctx->skip_frame = on ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+}
+
+void decoder_set_buffer(decoder_t *decoder, RiffFile *rf, uint64_t pos, unsigned char const *data, size_t size) {
+    static_assert(DECODER_BUFFER_PADDING >= AV_INPUT_BUFFER_PADDING_SIZE, "decoder buffer padding is too small");
+    Decoder *dec = (Decoder *)decoder;
+    dec->bufFile = data ? rf : nullptr;
+    dec->bufPos = pos;
+    dec->bufData = data;
+    dec->bufSize = data ? size : 0;
+}
+
 
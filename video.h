@@ -4,8 +4,21 @@
 #include <stdint.h>
 #include <pthread.h>
 
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <stdexcept>
+#include <utility>
+
+#include "yuvrgb.h"
+#include "yuvscale.h"
+#include "perfcount.h"
 
 struct steer_packet {
     uint16_t code;
@@ -13,6 +26,16 @@ struct steer_packet {
     int16_t throttle;
 };
 
+struct trim_packet {
+    uint16_t code;
+    int16_t value[4];
+};
+
+struct ibus_packet {
+    uint16_t code;
+    uint16_t channel[10];
+};
+
 struct ChunkHeader {
     char type[4];
     uint32_t size;
@@ -26,6 +49,18 @@ struct FileHeader {
 
 namespace fs = std::experimental::filesystem;
 
+//  address space reserved past the end of a segment that is still recording
+#define LIVE_MAP_RESERVE ((size_t)1 << 32)
+
+//  A zero-copy view of one chunk. In mapped mode, header and data point
+//  straight into the file mapping and stay valid for the life of the
+//  RiffFile; in stream mode they point into the caller's scratch buffer.
+struct ChunkView {
+    ChunkHeader const *header;
+    unsigned char const *data;
+    uint32_t size;
+};
+
 class RiffFile {
     class Locker {
         public:
@@ -42,14 +77,32 @@ class RiffFile {
     pthread_mutex_t mtx;
 
 public:
-    RiffFile(fs::path const &path, uint64_t offset) : path_(path), offset_(offset) {
+    //  By default, the file is memory mapped, and any number of threads can
+    //  read from it at the same time without taking the lock. If mapping
+    //  fails (or is turned off,) reads go through the locked ifstream.
+    //  A growing file is one that is still being recorded; call refresh()
+    //  to pick up what has been appended since.
+    RiffFile(fs::path const &path, uint64_t offset, bool mapped = true, bool growing = false)
+        : path_(path), size_(0), offset_(offset), fd_(-1), map_(nullptr), mapSize_(0), growing_(growing) {
         pthread_mutex_init(&mtx, nullptr);
-        file_.open(path_.string(), std::ifstream::binary);
-        if (!file_.good()) {
-            throw std::runtime_error("Could not open file: " + path.string());
+        if (mapped) {
+            map_file();
+        }
+        if (!map_) {
+            file_.open(path_.string(), std::ifstream::binary);
+            if (!file_.good()) {
+                if (fd_ >= 0) {
+                    close(fd_);
+                }
+                pthread_mutex_destroy(&mtx);
+                throw std::runtime_error("Could not open file: " + path.string());
+            }
+            file_.seekg(0, std::ios_base::end);
+            size_ = file_.tellg();
+            if (fd_ < 0) {
+                fd_ = open(path_.string().c_str(), O_RDONLY);
+            }
         }
-        file_.seekg(0, std::ios_base::end);
-        size_ = file_.tellg();
         if (size_ < 12) {
             size_ = 0;
         }
@@ -58,20 +111,106 @@ public:
         }
     }
     ~RiffFile() {
+        if (map_) {
+            munmap((void *)map_, mapSize_);
+        }
+        for (auto const &m : retired_) {
+            munmap((void *)m.first, m.second);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
         pthread_mutex_destroy(&mtx);
     }
 
+    bool mapped() const {
+        return map_ != nullptr;
+    }
+
+    bool growing() const {
+        return __atomic_load_n(&growing_, __ATOMIC_ACQUIRE);
+    }
+
+    //  The file is no longer being recorded: pick up the rest of it, and
+    //  give back the address space reserved past its end. Views into it,
+    //  including ones into outgrown mappings, stay valid.
+    void finish() {
+        if (!growing_) {
+            return;
+        }
+        refresh();
+        if (map_) {
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t keep = ((size_t)size_ + 12 + page - 1) & ~(page - 1);
+            trim_map(map_, mapSize_, keep);
+            for (auto &m : retired_) {
+                trim_map(m.first, m.second, keep);
+            }
+        }
+        __atomic_store_n(&growing_, false, __ATOMIC_RELEASE);
+    }
+
+    //  Pick up data appended to a growing file. Returns true if it grew.
+    //  Readers on other threads keep working; an outgrown mapping is kept
+    //  alive until the RiffFile goes away.
+    bool refresh() {
+        uint64_t fsize = 0;
+        if (map_ || fd_ >= 0) {
+            struct stat st;
+            if (fstat(fd_, &st) < 0) {
+                return false;
+            }
+            fsize = (uint64_t)st.st_size;
+            if (map_ && fsize > mapSize_) {
+                size_t len = (size_t)fsize + LIVE_MAP_RESERVE;
+                void *m = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd_, 0);
+                if (m == MAP_FAILED) {
+                    return false;
+                }
+                retired_.push_back(std::make_pair(map_, mapSize_));
+                __atomic_store_n(&map_, (unsigned char const *)m, __ATOMIC_RELEASE);
+                mapSize_ = len;
+            }
+        }
+        else {
+            Locker l(mtx);
+            file_.clear();
+            file_.seekg(0, std::ios_base::end);
+            fsize = file_.tellg();
+        }
+        uint64_t nsize = (fsize < 12) ? 0 : fsize - 12;
+        if (nsize <= size_) {
+            return false;
+        }
+        __atomic_store_n(&size_, nsize, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    //  for pread() and async I/O; a chunk at pos is at file position pos + 12
+    int fd() const {
+        return fd_;
+    }
+
     bool header_at(uint64_t pos, ChunkHeader &ret, uint64_t &opos) {
         if (pos >= size_) {
             opos = size_;
             return false;
         }
-        Locker l(mtx);
-        file_.seekg(pos + 12, std::ios_base::beg);
-        file_.read((char *)&ret, 8);
-        if (!file_.good()) {
-            opos = size_;
-            return false;
+        if (map_) {
+            if (pos + 8 > size_) {
+                opos = size_;
+                return false;
+            }
+            memcpy(&ret, map_ + 12 + pos, 8);
+        }
+        else {
+            Locker l(mtx);
+            file_.seekg(pos + 12, std::ios_base::beg);
+            file_.read((char *)&ret, 8);
+            if (!file_.good()) {
+                opos = size_;
+                return false;
+            }
         }
         opos = pos + 8 + ((ret.size + 3) & -4);
         return true;
@@ -83,6 +222,15 @@ public:
     }
 
     bool data_header_at(uint64_t hdrpos, ChunkHeader &ch, std::vector<char> &data, size_t max_size) {
+        if (map_) {
+            ChunkView cv;
+            if (!map_view(hdrpos, cv, max_size)) {
+                return false;
+            }
+            ch = *cv.header;
+            data.insert(data.end(), (char const *)cv.data, (char const *)cv.data + cv.size);
+            return true;
+        }
         Locker l(mtx);
         file_.seekg(hdrpos + 12, std::ios_base::beg);
         file_.read((char *)&ch, sizeof(ch));
@@ -103,6 +251,7 @@ public:
             return true;
         }
         file_.read((char *)&data[initsize], max_size);
+        perf_add(PerfBytesRead, max_size);
         if (!file_.good()) {
             fprintf(stderr, "%s: block %.4s at %lld size %ld was truncated\n",
                 path_.string().c_str(), ch.type, (long long)hdrpos, (long)ch.size);
@@ -111,10 +260,98 @@ public:
         return true;
     }
 
+    //  Return a view of the chunk at hdrpos, with at most max_size bytes of
+    //  payload (0 means all of it.) When the file is mapped, this does not
+    //  copy and does not lock; otherwise, the data is read into scratch.
+    bool view_at(uint64_t hdrpos, ChunkView &cv, std::vector<char> &scratch, size_t max_size = 0) {
+        if (map_) {
+            return map_view(hdrpos, cv, max_size);
+        }
+        ChunkHeader ch;
+        scratch.resize(sizeof(ChunkHeader));
+        if (!data_header_at(hdrpos, ch, scratch, max_size)) {
+            return false;
+        }
+        memcpy(&scratch[0], &ch, sizeof(ch));
+        cv.header = (ChunkHeader const *)&scratch[0];
+        cv.data = (unsigned char const *)&scratch[sizeof(ChunkHeader)];
+        cv.size = (uint32_t)(scratch.size() - sizeof(ChunkHeader));
+        return true;
+    }
+
+    //  Can a consumer read n bytes past the end of this view without faulting?
+    //  libavcodec wants input padding, and a mapped chunk can borrow it from
+    //  whatever follows it in the file, if that is zero.
+    bool readable_past(ChunkView const &cv, size_t n) const {
+        return map_ && cv.data >= map_ && cv.data + cv.size + n <= map_ + 12 + size_;
+    }
+
     fs::path path_;
     std::ifstream file_;
     uint64_t size_;
     uint64_t offset_;
+
+private:
+    void map_file() {
+        fd_ = open(path_.string().c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("Could not open file: " + path_.string());
+        }
+        struct stat st;
+        if (fstat(fd_, &st) < 0 || (st.st_size == 0 && !growing_)) {
+            return;
+        }
+        //  a growing file maps address space past the end, which becomes
+        //  readable as the file is appended to
+        size_t len = (size_t)st.st_size + (growing_ ? LIVE_MAP_RESERVE : 0);
+        void *m = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd_, 0);
+        if (m == MAP_FAILED) {
+            fprintf(stderr, "%s: mmap failed; falling back to stream reads\n", path_.string().c_str());
+            return;
+        }
+        map_ = (unsigned char const *)m;
+        mapSize_ = len;
+        size_ = (uint64_t)st.st_size;
+    }
+
+    static void trim_map(unsigned char const *m, size_t &len, size_t keep) {
+        if (len > keep) {
+            munmap((void *)(m + keep), len - keep);
+            len = keep;
+        }
+    }
+
+    bool map_view(uint64_t hdrpos, ChunkView &cv, size_t max_size) {
+        if (hdrpos + 8 > size_) {
+            fprintf(stderr, "%s: block at %lld is past end of file\n",
+                path_.string().c_str(), (long long)hdrpos);
+            return false;
+        }
+        cv.header = (ChunkHeader const *)(map_ + 12 + hdrpos);
+        uint32_t size = cv.header->size;
+        if (max_size == 0 || max_size > size) {
+            max_size = size;
+        }
+        if (max_size > 8 * 1024 * 1024) {
+            fprintf(stderr, "%s: block %.4s at %lld size %ld is too big to read\n",
+                path_.string().c_str(), cv.header->type, (long long)hdrpos, (long)size);
+            return false;
+        }
+        if (hdrpos + 8 + max_size > size_) {
+            fprintf(stderr, "%s: block %.4s at %lld size %ld was truncated\n",
+                path_.string().c_str(), cv.header->type, (long long)hdrpos, (long)size);
+            return false;
+        }
+        cv.data = map_ + 12 + hdrpos + 8;
+        cv.size = (uint32_t)max_size;
+        return true;
+    }
+
+    int fd_;
+    unsigned char const *map_;
+    size_t mapSize_;
+    bool growing_;
+    std::vector<std::pair<unsigned char const *, size_t> > retired_;
 };
 
 
@@ -130,10 +367,21 @@ struct VideoFrame {
     bool keyframe;
 };
 
+struct AVFrame;
+
+//  A picture, either holding a reference to the codec's own buffers (with
+//  their native strides; nothing is copied) or owning a packed YUV 4:2:0
+//  buffer. Packed and RGB copies are made only when someone asks for them.
 struct DecodedFrame {
 public:
-    DecodedFrame() : yuv_planar(0), rgb_interleaved(0), cropped(0), time(0), width(0), height(0), keyframe(false) {}
-    ~DecodedFrame() { clear(); }
+    DecodedFrame() : yuv_planar(0), rgb_interleaved(0), cropped(0), time(0), width(0), height(0), cropWidth(0), cropHeight(0), keyframe(false), matrix(YuvMatrixBT601), index(0), av_(0) {
+        for (int i = 0; i != 3; ++i) {
+            planes_[i] = nullptr;
+            strides_[i] = 0;
+        }
+    }
+    ~DecodedFrame();
+    //  yuv is packed Y, U, V and becomes owned by the frame
     void set_decoded(uint64_t t, uint16_t w, uint16_t h, unsigned char *yuv, bool kf) {
         if (yuv == yuv_planar) {
             //  re-use buffer on decoding
@@ -145,47 +393,163 @@ public:
         width = w;
         height = h;
         keyframe = kf;
+        planes_[0] = yuv;
+        planes_[1] = yuv + w * h;
+        planes_[2] = planes_[1] + ((w + 1) / 2) * ((h + 1) / 2);
+        strides_[0] = w;
+        strides_[1] = strides_[2] = (w + 1) / 2;
     }
+    //  takes over the picture in frame (which is left empty); false if it
+    //  is not 4:2:0
+    bool set_decoded(uint64_t t, AVFrame *frame, bool kf);
+    bool valid() const { return planes_[0] != nullptr; }
+    unsigned char const *plane(int i) const { return planes_[i]; }
+    int stride(int i) const { return strides_[i]; }
+    //  packed Y, U, V; copied out of the codec's picture on first use
+    unsigned char const *packed_yuv();
+    //  converted once, on first use; set_decoded() drops it
     unsigned char const *decode_rgb() {
-        if (!rgb_interleaved) {
+        if (!rgb_interleaved && valid()) {
+            PerfTimer pt(PerfCopyNs);
+            perf_add(PerfCopyBytes, (size_t)width * height * 3);
             rgb_interleaved = new unsigned char[width * height * 3];
-
+            yuv420_to_rgb(planes_[0], planes_[1], planes_[2], width, height, strides_[0], strides_[1],
+                    rgb_interleaved, width * 3, matrix);
         }
         return rgb_interleaved;
     }
+    //  packed Y, U, V of the region set with set_crop_spec(), at its output
+    //  size (cropWidth x cropHeight); scaled straight from the codec's
+    //  planes on first use, without a full size copy
     unsigned char const *crop() {
-        if (!cropped) {
-            cropped = new unsigned char[width * height * 2];
-
+        if (!cropped && valid()) {
+            PerfTimer pt(PerfCopyNs);
+            CropSpec cs;
+            crop_geometry(crop_spec(), width, height, cs);
+            cropped = new unsigned char[yuv420_size(cs.outWidth, cs.outHeight)];
+            perf_add(PerfCopyBytes, yuv420_size(cs.outWidth, cs.outHeight));
+            crop_to(cs, cropped);
+            cropWidth = (uint16_t)cs.outWidth;
+            cropHeight = (uint16_t)cs.outHeight;
         }
         return cropped;
     }
+    //  the same for any crop (resolved with crop_geometry()), into dst,
+    //  which takes yuv420_size(cs.outWidth, cs.outHeight) bytes
+    void crop_to(CropSpec const &cs, unsigned char *dst) const {
+        yuv420_crop(planes_[0], planes_[1], planes_[2], strides_[0], strides_[1], cs, dst);
+    }
+    //  memory held by the decoded data, for cache budgeting
+    size_t bytes() const {
+        size_t n = 0;
+        if (av_ && planes_[0]) {
+            n += (size_t)strides_[0] * height + (size_t)(strides_[1] + strides_[2]) * ((height + 1) / 2);
+        }
+        if (yuv_planar) {
+            n += (size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+        }
+        if (rgb_interleaved) {
+            n += (size_t)width * height * 3;
+        }
+        if (cropped) {
+            n += yuv420_size(cropWidth, cropHeight);
+        }
+        return n;
+    }
     unsigned char *yuv_planar;
     unsigned char *rgb_interleaved;
     unsigned char *cropped;
     uint64_t time;
     uint16_t width;
     uint16_t height;
+    uint16_t cropWidth;
+    uint16_t cropHeight;
     bool keyframe;
-    void clear() {
-        delete[] yuv_planar;
-        yuv_planar = nullptr;
-        delete[] rgb_interleaved;
-        rgb_interleaved = nullptr;
-        delete[] cropped;
-        cropped = nullptr;
-    }
+    YuvMatrix matrix;
+    //  VideoFrame::index of the first chunk that went into the picture
+    uint32_t index;
+    //  drops the pictures and copies; the buffers go back to the codec
+    void clear();
+
+private:
+    DecodedFrame(DecodedFrame const &) = delete;
+    DecodedFrame &operator=(DecodedFrame const &) = delete;
+
+    AVFrame *av_;
+    unsigned char const *planes_[3];
+    int strides_[3];
 };
 
 
-/* using a static decoder */
+/* libavcodec threading for decoders opened from now on (pooled decoders
+ * keep what they were opened with.) count 0 lets libavcodec pick one per
+ * core, 1 decodes on the calling thread. The static decoder never uses
+ * frame threads. */
+enum DecoderThreadType {
+    DecoderThreadSlice = 1,
+    DecoderThreadFrame = 2
+};
+void set_decoder_threads(int count, int type);
+/* "slice", "frame" or "both"; 0 if it is none of those */
+int parse_decoder_thread_type(char const *str);
+
+/* using a static decoder, stepping through gFrames; as with the pooled
+ * one below, true if a picture came out, and frame is left at the next
+ * chunk to feed, or nullptr after the last one */
 void begin_decode(VideoFrame *frame);
-VideoFrame *decode_frame_and_advance(VideoFrame *frame, DecodedFrame *result);
+bool decode_frame_and_advance(VideoFrame *&frame, DecodedFrame *result);
 
-/* using parallel decoders */
+/* using parallel decoders. new_decoder() hands out a released decoder,
+ * flushed with avcodec_flush_buffers(), when there is one, and opens a new
+ * one otherwise; release_decoder() gives it back for reuse, and
+ * destroy_decoder() closes it for good. */
 struct decoder_t *new_decoder();
-VideoFrame *decode_frame_and_advance(decoder_t *dec, VideoFrame *frame, DecodedFrame *result,
+/* Feed chunks from frame on, stepping with next_frame, until a picture comes
+ * out; true if one did. frame is left at the next chunk to feed, or nullptr
+ * once they have run out, which may be on the call that got the last
+ * picture. FrameRunDecoder does the stepping for a vector of chunks. */
+bool decode_frame_and_advance(decoder_t *dec, VideoFrame *&frame, DecodedFrame *result,
         VideoFrame *(*next_frame)(VideoFrame *, void *), void *cookie);
+/* Decode chunks of rf that fall inside [pos, pos+size) from data instead of
+ * the file. data must be followed by DECODER_BUFFER_PADDING zero bytes.
+ * Pass nullptr to go back to reading from the file. */
+#define DECODER_BUFFER_PADDING 64
+void decoder_set_buffer(decoder_t *dec, RiffFile *rf, uint64_t pos, unsigned char const *data, size_t size);
+/* After the last chunk, call until it returns false to collect pictures the
+ * codec still holds; with frame threads, that is up to thread count - 1. */
+bool decoder_drain(decoder_t *dec, DecodedFrame *result);
+/* With on, the codec skips everything but keyframes (AVDISCARD_NONKEY), so
+ * a GOP yields only its first picture, at the cost of that one. Lasts until
+ * the decoder is released. */
+void decoder_set_keyframes_only(decoder_t *dec, bool on);
+/* Decode just the keyframe that starts frames, on a pooled decoder in
+ * keyframes-only mode. All of frames are fed, in case the keyframe's
+ * headers and picture are in separate chunks; they are renumbered from 0.
+ * False if no picture came out. */
+bool decode_keyframe(std::vector<VideoFrame> &frames, DecodedFrame *result);
+void release_decoder(struct decoder_t *dec);
 void destroy_decoder(struct decoder_t *dec);
 
+/* Decodes a run of chunks held in a vector of their own, such as a copy of
+ * a GOP (gFrames may grow, and move, while it is decoded). The run is
+ * renumbered from 0, so a picture's index is its chunk's position in it.
+ * next() feeds chunks until a picture comes out, and once they run out,
+ * drains the codec; it returns false when there are no pictures left. */
+class FrameRunDecoder {
+    public:
+        FrameRunDecoder(decoder_t *dec, std::vector<VideoFrame> &frames, size_t pos = 0);
+        bool next(DecodedFrame *result);
+        /* The next chunk to feed; frames.size() once all have been fed. */
+        size_t position() const;
+
+    private:
+        static VideoFrame *next_frame(VideoFrame *fr, void *co);
+
+        decoder_t *dec_;
+        std::vector<VideoFrame> &frames_;
+        VideoFrame *next_;
+};
+/* close every pooled decoder, and the static one */
+void free_decoders();
+
 #endif  //  video_H
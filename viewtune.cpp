@@ -2,6 +2,15 @@
 #include "stdafx.h"
 #include "video.h"
 #include "riffs.h"
+#include "riffindex.h"
+#include "workqueue.h"
+#include "rifftail.h"
+#include "frameindex.h"
+#include "framecache.h"
+#include "perfcount.h"
+#include "telemetry.h"
+#include "thumbcache.h"
+#include "player.h"
 #include <string>
 #include <vector>
 #include <list>
@@ -10,6 +19,7 @@
 #include <assert.h>
 #include <algorithm>
 #include <math.h>
+#include <unistd.h>
 
 #include <FL/Fl.H>
 #include <FL/Fl_Double_Window.H>
@@ -17,6 +27,8 @@
 #include <FL/Fl_Value_Slider.H>
 #include <FL/Fl_Value_Input.H>
 #include <FL/Fl_Output.H>
+#include <FL/Fl_Button.H>
+#include <FL/Fl_Choice.H>
 #include <FL/Fl_Roller.H>
 #include <FL/Fl_Image.H>
 #include <FL/fl_draw.H>
@@ -40,143 +52,250 @@ bool file_exists(std::string const &path) {
 }
 
 double finalFrameTime;
+bool gFollow;
+RiffTail gTail;
 
-std::map<uint64_t, DecodedFrame *> gDecodedFrames;
-std::list<DecodedFrame *> gDecodedFreeList;
+extern bool verbose;
 
-enum GetFrameMode {
-    GetFrameModeClosest = 0,
-    GetFrameModeEarlier = 1,
-    GetFrameModeLater = 2,
-    GetFrameModeFollowing = 3,
-    GetFrameModePreceeding = 4
-};
 
-uint64_t determine_frame_time(uint64_t time, GetFrameMode mode) {
-    if (gFrames.size() == 0) {
-        return 0;
-    }
-    size_t top = gFrames.size();
-    size_t bottom = 0;
-    while (top > bottom+1) {
-        size_t avg = (top + bottom) / 2;
-        if (gFrames[avg].time > time) {
-            top = avg;
+/*  Background decoding. Each GOP is decoded on the work queue by its own
+ *  decoder; the frames are handed back to the FLTK thread with Fl::awake(),
+ *  and only the FLTK thread touches the frame cache.
+ *
+ *  The GOP for the frame being sought is interactive work, and the ones
+ *  decoded ahead are prefetch work. Each seek cancels whatever in-flight
+ *  GOPs it no longer needs.
+ */
+#define DECODE_AHEAD_GOPS 2
+#define MAX_GOPS_IN_FLIGHT 8
+//  chunks fed when decoding a keyframe alone, in case its headers and
+//  picture are split
+#define KEYFRAME_CHUNKS 3
+
+class GopDecodeWork;
+static std::map<uint32_t, GopDecodeWork *> gGopsInFlight;
+static size_t gWantedPos = ~(size_t)0;
+static double gLastRequestTime;
+
+void gop_decoded(void *);
+
+class GopDecodeWork : public Work {
+    public:
+        GopDecodeWork(uint32_t kfpos, uint32_t endpos)
+            : kfpos_(kfpos)
+            , frames_(gFrames.begin() + kfpos, gFrames.begin() + endpos)
+        {
+            //  a copy, since gFrames may grow (and move) while we work when
+            //  following
+            for (size_t i = 0; i != frames_.size(); ++i) {
+                spare_.push_back(gFrameCache.take());
+            }
+            decoded_.resize(frames_.size());
+            sprintf(name_, "gop %ld", (long)kfpos);
+            CancelToken *token = new CancelToken();
+            set_token(token);
+            token->unref();
         }
-        else {
-            bottom = avg;
+        ~GopDecodeWork() {}
+        char const *name() {
+            return name_;
         }
-    }
-    uint64_t bottomTime = gFrames[bottom].time;
-    while (bottom > 0 && gFrames[bottom - 1].time == bottomTime) {
-        --bottom;
-    }
-    if (bottomTime > time) {
-        assert(bottom == 0);
-        return bottomTime;
-    }
-    if (top == gFrames.size()) {
-        return gFrames[top - 1].time;
-    }
-    uint64_t topTime = gFrames[top].time;
-    //  top is strictly greater, bottom is less-or-equal
-    switch (mode) {
-    case GetFrameModeClosest:
-        if (time - bottomTime <= topTime - time) {
-            return bottomTime;
+        void work() {
+            decoder_t *d = new_decoder();
+            if (!d) {
+                throw std::runtime_error("could not open a decoder");
+            }
+            __atomic_store_n(&started_, true, __ATOMIC_RELEASE);
+            //  renumbers frames_ from 0, so a picture's index is its
+            //  position in the GOP
+            FrameRunDecoder run(d, frames_);
+            //  a seek elsewhere stops us between packets
+            while (!spare_.empty() && !is_cancelled() && run.next(spare_.back())) {
+                keep(spare_.back());
+            }
+            release_decoder(d);
         }
-        return topTime;
-    case GetFrameModeEarlier:
-        return bottomTime;
-    case GetFrameModeLater:
-        return (bottomTime == time) ? bottomTime : topTime;
-    case GetFrameModeFollowing:
-        return topTime;
-    case GetFrameModePreceeding:
-        if (bottomTime == time && bottom > 0) {
-            return gFrames[bottom - 1].time;
+        void complete() {
+            Fl::awake(gop_decoded, this);
+        }
+        void error() {
+            Fl::awake(gop_decoded, this);
+        }
+        void cancelled() {
+            Fl::awake(gop_decoded, this);
+        }
+        bool started() const {
+            return __atomic_load_n(&started_, __ATOMIC_ACQUIRE);
+        }
+        //  df is spare_.back(); if its position is already taken, it stays
+        //  spare and gets decoded over
+        void keep(DecodedFrame *df) {
+            if (df->index < decoded_.size() && !decoded_[df->index]) {
+                spare_.pop_back();
+                decoded_[df->index] = df;
+                ++numDecoded_;
+            }
+        }
+
+        uint32_t kfpos_;
+        std::vector<VideoFrame> frames_;
+        std::vector<DecodedFrame *> spare_;
+        //  by position within the GOP; nullptr where no picture came out
+        std::vector<DecodedFrame *> decoded_;
+        size_t numDecoded_ = 0;
+        bool started_ = false;
+        char name_[40];
+};
+
+bool gop_is_cached(size_t kfpos) {
+    return gFrameCache.has_gop(kfpos);
+}
+
+size_t live_gops_in_flight() {
+    size_t n = 0;
+    for (auto const &g : gGopsInFlight) {
+        if (!g.second->is_cancelled()) {
+            ++n;
         }
-        return bottomTime;
     }
-    assert(!"unknown get frame mode");
-    return 0;
+    return n;
 }
 
-VideoFrame *get_keyframe_for_time(uint64_t frametime) {
-    size_t bottom = 0;
-    size_t top = gFrames.size();
-    if (!top) {
-        return nullptr;
+bool request_gop(size_t kfpos, bool force, WorkPriority priority) {
+    if (kfpos >= gFrames.size()) {
+        return false;
     }
-    while (top > bottom + 1) {
-        size_t avg = (top + bottom) / 2;
-        if (gFrames[avg].time > frametime) {
-            top = avg;
-        }
-        else {
-            bottom = avg;
+    auto found(gGopsInFlight.find((uint32_t)kfpos));
+    if (found != gGopsInFlight.end()) {
+        GopDecodeWork *w = found->second;
+        if (!w->is_cancelled() && (w->started() || w->priority() <= priority)) {
+            //  already on its way, soon enough
+            return false;
         }
+        //  a queued prefetch that became the seek target goes again, up front
+        w->token()->cancel();
     }
-    while (bottom > 0 && !gFrames[bottom].keyframe) {
-        --bottom;
+    if (!force && gop_is_cached(kfpos)) {
+        return false;
     }
-    return &gFrames[bottom];
+    size_t endpos = gFrameIndex.keyframe_after(kfpos);
+    GopDecodeWork *w = new GopDecodeWork((uint32_t)kfpos, (uint32_t)endpos);
+    gGopsInFlight[(uint32_t)kfpos] = w;
+    add_work(w, priority);
+    return true;
 }
 
-#define MAX_FRAME_CACHE_SIZE 350
-#define FRAME_CACHE_HYSTERESIS 90
+/*  Keyframe thumbnails for the filmstrip are made in the background, at
+ *  bulk priority, so they never hold up a seek. Results go back to the
+ *  FLTK thread, which owns gThumbCache, a batch at a time.
+ */
+#define THUMBS_PER_WORK 32
 
-extern bool verbose;
+void thumbs_decoded(void *);
 
-DecodedFrame *get_frame_at(uint64_t t, GetFrameMode mode = GetFrameModeClosest) {
-    uint64_t frameTime = determine_frame_time(t, mode);
-    auto found(gDecodedFrames.lower_bound(frameTime));
-    if ((found != gDecodedFrames.end()) && (found->first == frameTime)) {
-        return found->second;
-    }
-    if (gDecodedFrames.size() >= MAX_FRAME_CACHE_SIZE) {
-        do {
-            gDecodedFreeList.push_back(gDecodedFrames.begin()->second);
-            gDecodedFrames.erase(gDecodedFrames.begin());
-        } while ((gDecodedFrames.size() > (MAX_FRAME_CACHE_SIZE - FRAME_CACHE_HYSTERESIS)) &&
-            !gDecodedFrames.begin()->second->keyframe);
-    }
-    VideoFrame *keyframe = get_keyframe_for_time(frameTime);
-    begin_decode(keyframe);
-    VideoFrame *curFrame = keyframe;
-    DecodedFrame *ret = nullptr;
-    while (true) {
-        DecodedFrame *df = nullptr;
-        if (gDecodedFreeList.empty()) {
-            df = new DecodedFrame();
+class ThumbWork : public Work {
+    public:
+        ThumbWork(std::vector<size_t> const &keys) : keys_(keys) {
+            for (size_t k : keys_) {
+                size_t kfpos = gFrameIndex.keyframe(k);
+                size_t end = std::min(gFrameIndex.keyframe_after(kfpos), kfpos + KEYFRAME_CHUNKS);
+                frames_.push_back(std::vector<VideoFrame>(gFrames.begin() + kfpos, gFrames.begin() + end));
+            }
+            pics_.resize(keys_.size());
+            ok_.resize(keys_.size());
+            sprintf(name_, "thumbs %ld", keys_.empty() ? 0L : (long)keys_[0]);
         }
-        else {
-            df = gDecodedFreeList.front();
-            gDecodedFreeList.pop_front();
-        }
-        size_t previx = curFrame->index;
-        uint64_t prevoff = curFrame->offset;
-        size_t prevsz = curFrame->size;
-        uint64_t prevtime = curFrame->time;
-        curFrame = decode_frame_and_advance(curFrame, df);
-        if (!curFrame) {
-            gDecodedFreeList.push_back(df);
-            fprintf(stderr, "decode_frame_and_advance() failed\n");
-            break;
+        char const *name() {
+            return name_;
         }
-        if (verbose) {
-            fprintf(stderr, "decoded frame %ld at offset %lld size %ld with time %lld for time %lld\n",
-                    (long)previx, (long long)prevoff, (long)prevsz, (long long)df->time, (long long)prevtime);
+        void work() {
+            for (size_t i = 0; i != keys_.size(); ++i) {
+                ok_[i] = make_keyframe_thumb(frames_[i], pics_[i]);
+            }
         }
-        gDecodedFrames[df->time] = df;
-        if (df->time >= frameTime && !ret) {
-            ret = df;
+        void complete() {
+            Fl::awake(thumbs_decoded, this);
         }
-        if (curFrame->keyframe) {
-            break;
+        void error() {
+            Fl::awake(thumbs_decoded, this);
+        }
+        void cancelled() {
+            Fl::awake(thumbs_decoded, this);
+        }
+
+        std::vector<size_t> keys_;
+        std::vector<std::vector<VideoFrame> > frames_;
+        std::vector<ThumbPicture> pics_;
+        std::vector<bool> ok_;
+        char name_[40];
+};
+
+//  Catch the thumbnail cache up with the index, and queue thumbnails for
+//  keyframes that have none.
+void request_thumbs() {
+    gThumbCache.sync();
+    std::vector<size_t> missing;
+    gThumbCache.take_missing(0, gThumbCache.size(), missing);
+    for (size_t i = 0; i < missing.size(); i += THUMBS_PER_WORK) {
+        std::vector<size_t> keys(missing.begin() + i,
+            missing.begin() + std::min(missing.size(), i + THUMBS_PER_WORK));
+        add_work(new ThumbWork(keys), WorkPriorityBulk);
+    }
+}
+
+/*  While the playhead is being dragged, only the keyframe of the GOP under
+ *  it is decoded: one picture, not the chain of frames up to the exact one.
+ *  One keyframe is in flight at a time; when it lands, the keyframe wanted
+ *  by then goes next, so a fast drag skips the ones it has left behind.
+ */
+void keyframe_decoded(void *);
+
+class KeyframeWork : public Work {
+    public:
+        KeyframeWork(size_t kfpos)
+            : kfpos_(kfpos)
+            , frames_(gFrames.begin() + kfpos,
+                gFrames.begin() + std::min(gFrameIndex.keyframe_after(kfpos), kfpos + KEYFRAME_CHUNKS))
+            , df_(gFrameCache.take())
+            , ok_(false)
+        {
+            sprintf(name_, "keyframe %ld", (long)kfpos);
+        }
+        char const *name() {
+            return name_;
+        }
+        void work() {
+            ok_ = decode_keyframe(frames_, df_);
+        }
+        void complete() {
+            Fl::awake(keyframe_decoded, this);
+        }
+        void error() {
+            Fl::awake(keyframe_decoded, this);
+        }
+        void cancelled() {
+            Fl::awake(keyframe_decoded, this);
         }
+
+        size_t kfpos_;
+        std::vector<VideoFrame> frames_;
+        DecodedFrame *df_;
+        bool ok_;
+        char name_[40];
+};
+
+static KeyframeWork *gKeyframeInFlight;
+//  the keyframe the drag wants, and the one on screen
+static size_t gScrubKfpos = ~(size_t)0;
+static size_t gShownKfpos = ~(size_t)0;
+static size_t gScrubPos = ~(size_t)0;
+
+void request_keyframe() {
+    if (gKeyframeInFlight || gScrubKfpos == ~(size_t)0 || gScrubKfpos == gShownKfpos) {
+        return;
     }
-    return ret;
+    gKeyframeInFlight = new KeyframeWork(gScrubKfpos);
+    add_work(gKeyframeInFlight, WorkPriorityInteractive);
 }
 
 bool gTimeoutSet = false;
@@ -185,109 +304,28 @@ void set_timeout(void *) {
     gTimeoutSet = true;
 }
 
-void analyze_all_riffs() {
-    Fl_Double_Window progress(600, 50, "Loading Progress");
-    Fl_Output output(10, 5, 580, 40, "");
-    progress.end();
-    progress.show();
-    ChunkHeader hdr;
-    VideoFrame vf = { 0 };
-    for (auto const &rp : gRiffFiles) {
-        output.value(rp->path_.string().c_str());
-        progress.redraw();
-        Fl::wait(0.1);
-        uint64_t pos = 0;
-        uint64_t nextpos = 0;
-        vf.file = rp;
-        std::vector<char> data;
-        while (rp->header_at(pos, hdr, nextpos)) {
-            data.resize(0);
-            //  data for keyframe frame info start with 0000 0001 28
-            //  data for pframes start with 0000 0001 21
-            //  the Pi encoder seems to write the keyframe headers in a 
-            //  distinct packet from the payload data, so packet size is 
-            //  also a seemingly reliable indicator.
-            if (!strncmp(hdr.type, "info", 4)) {
-                //  ignore
-            }
-            else if (!strncmp(hdr.type, "pdts", 4)) {
-                struct pdts {
-                    uint64_t pts;
-                    uint64_t dts;
-                };
-                if (rp->data_at(pos, data, 1024)) {
-                    if (data.size() >= sizeof(pdts)) {
-                        vf.pts = ((pdts *)&data[0])->pts;
-                        vf.time = vf.pts;
-                    }
-                }
-            }
-            else if (!strncmp(hdr.type, "time", 4)) {
-                if (rp->data_at(pos, data, 1024)) {
-                    /* time is not very regular -- pts is better
-                    if (data.size() >= 8) {
-                        memcpy(&vf.time, &data[0], 8);
-                        if (startTime == 1) {
-                            startTime = vf.time;
-                        }
-                        vf.time -= startTime;
-                    }
-                    */
-                    size_t offset = 8;
-                    while (offset <= data.size() - 6) {
-                        steer_packet sp;
-                        memcpy(&sp, &data[offset], 6);
-                        switch (sp.code) {
-                        case 'S':
-                            //  steer
-                            vf.steer = (sp.steer == -32768) ? 0 : sp.steer / 16383.0f;
-                            vf.throttle = (sp.throttle == -32768) ? 0 : sp.throttle / 16383.0f;
-                            offset += 6;
-                            break;
-                        case 'i':
-                            //  ibus
-                            offset += 22;
-                            break;
-                        case 'T':
-                            //  trim
-                            offset += 10;
-                            break;
-                        default:
-                            //  unknown
-                            offset = data.size();
-                            break;
-                        }
-                    }
-                }
-            }
-            else if (!strncmp(hdr.type, "h264", 4)) {
-                if (rp->data_at(pos, data, 1024) && data.size() > 16) {
-                    char kf[5] = { 0x00, 0x00, 0x00, 0x01, 0x27 };
-                    if (!memcmp(kf, &data[0], sizeof(kf))) {
-                        vf.keyframe = true;
-                    }
-                    else {
-                        vf.keyframe = false;
-                    }
-                    vf.offset = pos;
-                    vf.size = hdr.size;
-                    vf.index = (uint32_t)gFrames.size();
-                    gFrames.push_back(vf);
-                    finalFrameTime = vf.pts * 1e-6 + APPROXIMATE_FRAME_DURATION;
-                }
-            }
-            else {
-                //  unknown
-            }
-            pos = nextpos;
+static int64_t ptsOffset;
+static uint64_t prevPts;
+static size_t numFramesNormalized;
+
+//  Make pts (and time) relative to the start of the session, for frames
+//  from numFramesNormalized on. When following a recording, this runs
+//  again for each batch of frames that gets appended.
+void normalize_pts() {
+    if (numFramesNormalized == 0) {
+        if (gFrames.size() < 2 && gFollow) {
+            //  wait for enough frames to establish the start time
+            return;
         }
+        ptsOffset = 0;
+        if (gFrames.size() > 1) {
+            ptsOffset = std::max(gFrames[0].pts, gFrames[1].pts);
+        }
+        prevPts = 0;
     }
-    int64_t ptsOffset = 0;
-    if (gFrames.size() > 1) {
-        ptsOffset = std::max(gFrames[0].pts, gFrames[1].pts);
-    }
-    uint64_t prev = 0;
-    for (auto &frm : gFrames) {
+    uint64_t prev = prevPts;
+    for (auto ptr = gFrames.begin() + numFramesNormalized, end = gFrames.end(); ptr != end; ++ptr) {
+        VideoFrame &frm = *ptr;
         if (frm.pts && frm.pts < 0x8000000000000000ULL) {
             if (frm.pts - ptsOffset < prev) {
                 fprintf(stderr, "ERROR: PTS %lld is before previous PTS %lld\n", (long long)frm.pts, (long long)prev);
@@ -307,7 +345,87 @@ void analyze_all_riffs() {
             frm.time = prev;
         }
     }
+    prevPts = prev;
+    numFramesNormalized = gFrames.size();
+    gFrameIndex.append(gFrames);
+    if (!gFrames.empty()) {
+        finalFrameTime = gFrames.back().time * 1e-6 + APPROXIMATE_FRAME_DURATION;
+    }
+}
+
+static int numSegmentsIndexed;
+
+class IndexWork : public Work {
+    public:
+        IndexWork(RiffFile *rf) : file_(rf), n_(rf->path_.string()), state_(nullptr) {}
+        ~IndexWork() {}
+        char const *name() {
+            return n_.c_str();
+        }
+        void work() {
+            if (state_) {
+                //  still recording; remember where the scan stopped
+                scan_riff_file(file_, frames_, *state_, &telemetry_);
+            }
+            else {
+                index_riff_file(file_, frames_, &telemetry_);
+            }
+        }
+        //  analyze_all_riffs() owns these, and merges them when all are done
+        void complete() {
+            __sync_fetch_and_add(&numSegmentsIndexed, 1);
+        }
+        void error() {
+            frames_.clear();
+            telemetry_.clear();
+            __sync_fetch_and_add(&numSegmentsIndexed, 1);
+        }
+        RiffFile *file_;
+        std::string n_;
+        RiffScanState *state_;
+        std::vector<VideoFrame> frames_;
+        TelemetryStore telemetry_;
+};
+
+RiffScanState gTailState;
+
+void analyze_all_riffs() {
+    Fl_Double_Window progress(600, 50, "Loading Progress");
+    Fl_Output output(10, 5, 580, 40, "");
+    progress.end();
+    progress.show();
+    //  index one segment per task, then merge in segment order
+    std::vector<IndexWork *> work;
+    numSegmentsIndexed = 0;
+    for (auto const &rp : gRiffFiles) {
+        work.push_back(new IndexWork(rp));
+        if (rp->growing()) {
+            work.back()->state_ = &gTailState;
+        }
+        add_work(work.back());
+    }
     char str[256];
+    while (__sync_fetch_and_add(&numSegmentsIndexed, 0) < (int)work.size()) {
+        sprintf(str, "indexed %d of %ld files", numSegmentsIndexed, (long)work.size());
+        output.value(str);
+        progress.redraw();
+        Fl::wait(0.05);
+    }
+    size_t total = 0;
+    for (auto const &w : work) {
+        total += w->frames_.size();
+    }
+    gFrames.reserve(total);
+    for (auto const &w : work) {
+        for (auto &vf : w->frames_) {
+            vf.index = (uint32_t)gFrames.size();
+            gFrames.push_back(vf);
+        }
+        gTelemetry.append(w->telemetry_);
+        delete w;
+    }
+    gTelemetry.build();
+    normalize_pts();
     sprintf(str, "loaded %ld h264 packets from %ld files", (long)gFrames.size(), (long)gRiffFiles.size());
     fprintf(stderr, "%s\n", str);
     output.value(str);
@@ -324,8 +442,55 @@ void analyze_all_riffs() {
 }
 
 
+/*  Seek latency, from the moment on_idle() starts looking for a new frame
+ *  to the moment the exact frame is on screen, over the last few seeks.
+ */
+#define SEEK_HISTORY 128
+
+static bool gShowOverlay;
+static uint64_t gSeekStartNs;
+static uint64_t gSeekNs[SEEK_HISTORY];
+static size_t gNumSeeks;
+
+void seek_done() {
+    if (gSeekStartNs) {
+        gSeekNs[gNumSeeks % SEEK_HISTORY] = perf_now_ns() - gSeekStartNs;
+        ++gNumSeeks;
+        gSeekStartNs = 0;
+    }
+}
+
+//  pct of 0.5 is the median; 0 if there have been no seeks
+double seek_latency_ms(double pct) {
+    size_t n = std::min(gNumSeeks, (size_t)SEEK_HISTORY);
+    if (!n) {
+        return 0;
+    }
+    std::vector<uint64_t> v(gSeekNs, gSeekNs + n);
+    size_t k = std::min((size_t)(pct * n), n - 1);
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k] * 1e-6;
+}
+
+
+/*  Playback runs on its own decode thread (see player.h). The display side
+ *  ticks at DISPLAY_HZ, since FLTK has no vertical blank to wait for, and
+ *  shows the newest picture that is due. The picture on screen belongs to
+ *  the player, not the frame cache, until something replaces it.
+ */
+#define DISPLAY_HZ 60
+
+static Player gPlayer;
+static DecodedFrame *gPlayFrame;
+static double const kPlaySpeeds[] = { 0.25, 0.5, 1, 2, 4, 8 };
+#define NUM_PLAY_SPEEDS (sizeof(kPlaySpeeds) / sizeof(kPlaySpeeds[0]))
+#define DEFAULT_PLAY_SPEED 2
+
+
 int winWidth = 1280;
 int winHeight = 640;
+int stripHeight = 80;
+int filmstripHeight = THUMB_HEIGHT + 8;
 int oneRow = 20;
 int scrubberWidth = 100;
 int titleBarHeight = 10;
@@ -368,7 +533,7 @@ public:
     }
 
     void draw() override {
-        if (!frame_ || !frame_->yuv_planar) {
+        if (!frame_ || !frame_->valid()) {
             fl_rectf(x(), y(), w(), h(), 128, 128, 128);
         }
         else {
@@ -382,7 +547,37 @@ public:
                 hh = frame_->height;
                 fl_rectf(x(), frame_->height, w(), h() - frame_->height, 128, 128, 128);
             }
-            fl_draw_image(frame_->yuv_planar, x(), y(), ww, hh, 1, frame_->width);
+            fl_draw_image(frame_->decode_rgb(), x(), y(), ww, hh, 3, frame_->width * 3);
+        }
+        if (gShowOverlay) {
+            draw_overlay();
+        }
+    }
+
+    void draw_overlay() {
+        FrameCache::Stats st = gFrameCache.stats();
+        double last = gNumSeeks ? gSeekNs[(gNumSeeks - 1) % SEEK_HISTORY] * 1e-6 : 0;
+        uint64_t lookups = st.hits + st.misses;
+        char lines[5][128];
+        sprintf(lines[0], "seek %.1f ms  p50 %.1f  p99 %.1f  (%ld seeks)",
+            last, seek_latency_ms(0.5), seek_latency_ms(0.99), (long)gNumSeeks);
+        sprintf(lines[1], "cache %ld frames  %ld gops  %.0f / %.0f MB",
+            (long)st.frames, (long)st.gops, st.bytes / (1024.0 * 1024.0),
+            gFrameCache.budget() / (1024.0 * 1024.0));
+        sprintf(lines[2], "hits %llu  misses %llu  (%.1f%%)  evictions %llu",
+            (unsigned long long)st.hits, (unsigned long long)st.misses,
+            lookups ? 100.0 * st.hits / lookups : 0.0, (unsigned long long)st.evictions);
+        sprintf(lines[3], "gops in flight %ld", (long)gGopsInFlight.size());
+        Player::Stats ps = gPlayer.stats();
+        sprintf(lines[4], "play %gx  shown %llu  late %llu  superseded %llu  skipped %llu",
+            gPlayer.speed(), (unsigned long long)ps.shown, (unsigned long long)ps.late,
+            (unsigned long long)ps.superseded, (unsigned long long)ps.skipped);
+        fl_font(FL_COURIER, 12);
+        int lh = fl_height();
+        fl_rectf(x() + 4, y() + 4, 480, lh * 5 + 8, 0, 0, 0);
+        fl_color(FL_GREEN);
+        for (int i = 0; i != 5; ++i) {
+            fl_draw(lines[i], x() + 8, y() + 8 + lh * i + fl_height() - fl_descent());
         }
     }
 
@@ -456,14 +651,238 @@ Fl_Output *outG;
 Fl_Output *outB;
 
 Fl_Value_Input *outTime;
+Fl_Button *playButton;
+Fl_Choice *speedChoice;
 
 static double targetTime = 0.0;
 static double actualTime = -1.0;
 
 static double const DELTA_VALUE = 0.01f;
 
+void select_frame_time(uint64_t time);
+
+/*  Steer (top) and throttle (bottom) across the session, under the shuttle.
+ *  Each pixel column is one min/max query on the telemetry pyramid, so the
+ *  cost of a redraw depends on the width, not on the length of the session.
+ *  The wheel zooms around the pointer; clicking or dragging seeks.
+ */
+class Fl_TelemetryStrip : public Fl_Widget {
+
+public:
+
+    Fl_TelemetryStrip(int x, int y, int w, int h, char const *l) : Fl_Widget(x, y, w, h, l) {
+        t0_ = 0;
+        t1_ = 0;
+    }
+
+    //  the visible range, in seconds from the start of the session; the
+    //  whole session until zoomed
+    double view_begin() const {
+        return t1_ > t0_ ? t0_ : 0;
+    }
+    double view_end() const {
+        return t1_ > t0_ ? t1_ : finalFrameTime;
+    }
+
+    int handle(int event) override {
+        double b = view_begin(), e = view_end();
+        double at = b + (e - b) * (Fl::event_x() - x()) / std::max(1, w());
+        switch (event) {
+        case FL_PUSH:
+        case FL_DRAG:
+            select_frame_time((uint64_t)(std::max(0.0, std::min(at, finalFrameTime)) * 1e6));
+            return 1;
+        case FL_RELEASE:
+            return 1;
+        case FL_MOUSEWHEEL: {
+            //  down zooms out; all the way out goes back to following the
+            //  length of the session
+            double f = Fl::event_dy() > 0 ? 1.5 : 1 / 1.5;
+            double nb = at - (at - b) * f;
+            double ne = at + (e - at) * f;
+            if (nb <= 0 && ne >= finalFrameTime) {
+                t0_ = t1_ = 0;
+            }
+            else if (ne - nb > 0.05) {
+                t0_ = std::max(0.0, nb);
+                t1_ = std::min(finalFrameTime, ne);
+            }
+            redraw();
+            return 1;
+        }
+        }
+        return Fl_Widget::handle(event);
+    }
+
+    void draw() override {
+        fl_rectf(x(), y(), w(), h(), 32, 32, 32);
+        int half = h() / 2;
+        draw_column(TelemetrySteer, y(), half, 96, 224, 96);
+        draw_column(TelemetryThrottle, y() + half, h() - half, 224, 160, 64);
+        fl_color(96, 96, 96);
+        fl_line(x(), y() + half, x() + w() - 1, y() + half);
+        double b = view_begin(), e = view_end();
+        if (e > b && targetTime >= b && targetTime <= e) {
+            int px = x() + (int)((targetTime - b) / (e - b) * (w() - 1));
+            fl_color(FL_WHITE);
+            fl_line(px, y(), px, y() + h() - 1);
+        }
+    }
+
+    //  one band, with -1 at the bottom and 1 at the top
+    void draw_column(TelemetryColumnId c, int yy, int hh, unsigned char r, unsigned char g, unsigned char b) {
+        int n = w();
+        if (n <= 0 || hh <= 2) {
+            return;
+        }
+        mins_.resize(n);
+        maxs_.resize(n);
+        uint64_t t0 = (uint64_t)(view_begin() * 1e6) + ptsOffset;
+        uint64_t t1 = (uint64_t)(view_end() * 1e6) + ptsOffset;
+        gTelemetry.plot(c, t0, t1, n, &mins_[0], &maxs_[0]);
+        fl_color(r, g, b);
+        double scale = (hh - 2) / 2.0;
+        int mid = yy + hh / 2;
+        for (int i = 0; i != n; ++i) {
+            if (mins_[i] > maxs_[i]) {
+                continue;
+            }
+            int ylo = mid - (int)(std::max(-1.0f, std::min(1.0f, mins_[i])) * scale);
+            int yhi = mid - (int)(std::max(-1.0f, std::min(1.0f, maxs_[i])) * scale);
+            fl_line(x() + i, yhi, x() + i, ylo);
+        }
+    }
+
+    double t0_;
+    double t1_;
+    std::vector<float> mins_;
+    std::vector<float> maxs_;
+};
+
+Fl_TelemetryStrip *strip;
+
+/*  A row of keyframe thumbnails, one cell per GOP. Only the cells in view
+ *  are drawn, and only from gThumbCache, so scrolling never decodes; cells
+ *  whose thumbnail has not been made yet are blank. The strip follows the
+ *  playhead until it is scrolled by hand (wheel or drag); clicking a cell
+ *  seeks to its keyframe, and follows again.
+ */
+class Fl_Filmstrip : public Fl_Widget {
+
+public:
+
+    enum { kCell = THUMB_HEIGHT * 4 / 3 + 4 };
+
+    Fl_Filmstrip(int x, int y, int w, int h, char const *l) : Fl_Widget(x, y, w, h, l) {
+        scroll_ = 0;
+        follow_ = true;
+        pushX_ = 0;
+        dragged_ = false;
+    }
+
+    //  the keyframe number of the GOP under the playhead
+    size_t current_key() const {
+        if (!gFrameIndex.size()) {
+            return 0;
+        }
+        size_t pos = std::min(gFrameIndex.lower_bound((uint64_t)(targetTime * 1e6)), gFrameIndex.size() - 1);
+        size_t n = gFrameIndex.keyframes_through(pos);
+        return n ? n - 1 : 0;
+    }
+
+    void clamp_scroll() {
+        double most = (double)gThumbCache.size() * kCell - w();
+        scroll_ = std::max(0.0, std::min(scroll_, most));
+    }
+
+    int handle(int event) override {
+        switch (event) {
+        case FL_PUSH:
+            pushX_ = Fl::event_x();
+            dragged_ = false;
+            return 1;
+        case FL_DRAG:
+            if (abs(Fl::event_x() - pushX_) > 3 || dragged_) {
+                scroll_ -= Fl::event_x() - pushX_;
+                pushX_ = Fl::event_x();
+                dragged_ = true;
+                follow_ = false;
+                clamp_scroll();
+                redraw();
+            }
+            return 1;
+        case FL_RELEASE:
+            if (!dragged_) {
+                size_t k = (size_t)((Fl::event_x() - x() + scroll_) / kCell);
+                if (k < gThumbCache.size()) {
+                    follow_ = true;
+                    select_frame_time(gFrames[gFrameIndex.keyframe(k)].time);
+                }
+            }
+            return 1;
+        case FL_MOUSEWHEEL:
+            scroll_ += (Fl::event_dy() + Fl::event_dx()) * kCell * 2;
+            follow_ = false;
+            clamp_scroll();
+            redraw();
+            return 1;
+        }
+        return Fl_Widget::handle(event);
+    }
+
+    void draw() override {
+        fl_rectf(x(), y(), w(), h(), 24, 24, 24);
+        size_t n = gThumbCache.size();
+        size_t cur = current_key();
+        if (follow_) {
+            scroll_ = (double)cur * kCell + kCell / 2 - w() / 2;
+        }
+        clamp_scroll();
+        int top = y() + (h() - THUMB_HEIGHT) / 2;
+        for (size_t k = (size_t)(scroll_ / kCell); k < n; ++k) {
+            int cx = x() + (int)(k * kCell - scroll_);
+            if (cx >= x() + w()) {
+                break;
+            }
+            draw_cell(k, cx, top);
+            if (k == cur) {
+                fl_color(FL_YELLOW);
+                fl_rect(cx + 1, top - 2, kCell - 2, THUMB_HEIGHT + 4);
+            }
+        }
+    }
+
+    void draw_cell(size_t k, int cx, int top) {
+        int tw, th;
+        YuvMatrix matrix;
+        unsigned char const *yuv = gThumbCache.get(k, tw, th, matrix);
+        fl_push_clip(cx + 2, top, kCell - 4, THUMB_HEIGHT);
+        if (!yuv) {
+            fl_rectf(cx + 2, top, kCell - 4, THUMB_HEIGHT, 64, 64, 64);
+        }
+        else {
+            rgb_.resize((size_t)tw * th * 3);
+            int cw = (tw + 1) / 2;
+            yuv420_to_rgb(yuv, yuv + tw * th, yuv + tw * th + cw * ((th + 1) / 2),
+                tw, th, tw, cw, &rgb_[0], tw * 3, matrix);
+            fl_draw_image(&rgb_[0], cx + (kCell - tw) / 2, top, tw, th, 3, tw * 3);
+        }
+        fl_pop_clip();
+    }
+
+    double scroll_;
+    bool follow_;
+    int pushX_;
+    bool dragged_;
+    std::vector<unsigned char> rgb_;
+};
+
+Fl_Filmstrip *filmstrip;
+
 void shuttle_callback(Fl_Widget *, void *) {
     targetTime = shuttle->value();
+    strip->redraw();
+    filmstrip->redraw();
 }
 
 void scrub_callback(Fl_Widget *, void *) {
@@ -488,6 +907,22 @@ void scrub_callback(Fl_Widget *, void *) {
     targetTime = shuttle->value();
 }
 
+void start_playback();
+void stop_playback();
+
+void play_callback(Fl_Widget *, void *) {
+    if (gPlayer.playing()) {
+        stop_playback();
+    }
+    else {
+        start_playback();
+    }
+}
+
+void speed_callback(Fl_Widget *, void *) {
+    gPlayer.set_speed(kPlaySpeeds[speedChoice->value()]);
+}
+
 void build_gui() {
     shuttle = new Fl_Value_Slider(0, titleBarHeight + winHeight - oneRow, winWidth - scrubberWidth, oneRow, "");
     shuttle->type(FL_HORIZONTAL);
@@ -499,6 +934,8 @@ void build_gui() {
     scrubber->bounds(-1, 1);
     scrubber->step(APPROXIMATE_FRAME_DURATION);
     scrubber->callback(scrub_callback, 0);
+    strip = new Fl_TelemetryStrip(0, titleBarHeight + winHeight, winWidth - scrubberWidth, stripHeight, "");
+    filmstrip = new Fl_Filmstrip(0, titleBarHeight + winHeight + stripHeight, winWidth, filmstripHeight, "");
     frame = new Fl_VideoFrame(0, 0, 640, 480, "");
     outY = new Fl_Output(640 + colorLabelWidth, titleBarHeight, 30, oneRow, "Y");
     outU = new Fl_Output(640 + colorLabelWidth, titleBarHeight+oneRow, 30, oneRow, "U");
@@ -507,6 +944,50 @@ void build_gui() {
     outG = new Fl_Output(640 + colorLabelWidth, titleBarHeight+oneRow*4, 30, oneRow, "G");
     outB = new Fl_Output(640 + colorLabelWidth, titleBarHeight+oneRow*5, 30, oneRow, "B");
     outTime = new Fl_Value_Input(640 + colorLabelWidth*2, titleBarHeight + oneRow * 6, 120, oneRow, "Time");
+    playButton = new Fl_Button(640 + colorLabelWidth*2, titleBarHeight + oneRow * 8, 40, oneRow, "@>");
+    playButton->callback(play_callback, nullptr);
+    speedChoice = new Fl_Choice(640 + colorLabelWidth*2 + 50, titleBarHeight + oneRow * 8, 70, oneRow, "");
+    for (size_t i = 0; i != NUM_PLAY_SPEEDS; ++i) {
+        char str[16];
+        sprintf(str, "%gx", kPlaySpeeds[i]);
+        speedChoice->add(str);
+    }
+    speedChoice->value(DEFAULT_PLAY_SPEED);
+    speedChoice->callback(speed_callback, nullptr);
+    speed_callback(speedChoice, nullptr);
+}
+
+static bool tailUpdatePending;
+
+void tail_update(void *) {
+    tailUpdatePending = false;
+    std::vector<VideoFrame> frames;
+    if (!gTail.update(frames, &gTelemetry)) {
+        return;
+    }
+    gTelemetry.build();
+    for (auto &vf : frames) {
+        vf.index = (uint32_t)gFrames.size();
+        gFrames.push_back(vf);
+    }
+    normalize_pts();
+    if (verbose) {
+        fprintf(stderr, "tail: %ld new frames, %ld total, %.2f seconds\n",
+            (long)frames.size(), (long)gFrames.size(), finalFrameTime);
+    }
+    shuttle->maximum(finalFrameTime);
+    shuttle->redraw();
+    strip->redraw();
+    request_thumbs();
+    filmstrip->redraw();
+}
+
+void tail_callback(int, void *) {
+    //  the recorder writes in small pieces; batch them up a little
+    if (gTail.drain_events() && !tailUpdatePending) {
+        tailUpdatePending = true;
+        Fl::add_timeout(0.25, tail_update, nullptr);
+    }
 }
 
 void select_frame_time(uint64_t time) {
@@ -514,25 +995,335 @@ void select_frame_time(uint64_t time) {
     shuttle->do_callback();
 }
 
+void display_frame(DecodedFrame *df, bool fromPlayer = false) {
+    df->decode_rgb();
+    if (gPlayFrame && gPlayFrame != df) {
+        gPlayer.recycle(gPlayFrame);
+        gPlayFrame = nullptr;
+    }
+    if (fromPlayer) {
+        gPlayFrame = df;
+    }
+    gFrameCache.show(fromPlayer ? nullptr : df);
+    frame->frame_ = df;
+    frame->redraw();
+    strip->redraw();
+    filmstrip->redraw();
+}
+
+void show_exact_frame(DecodedFrame *df) {
+    seek_done();
+    gWantedPos = ~(size_t)0;
+    actualTime = df->time * 1e-6;
+    targetTime = actualTime;
+    display_frame(df);
+    outTime->value(actualTime);
+}
+
+//  While waiting for the exact frame, show the closest one we have.
+void show_standin_frame(size_t pos) {
+    DecodedFrame *df = gFrameCache.nearest(pos);
+    if (!df) {
+        return;
+    }
+    display_frame(df);
+    outTime->value(df->time * 1e-6);
+}
+
+bool scrubbing() {
+    Fl_Widget *w = Fl::pushed();
+    return w && (w == shuttle || w == scrubber || w == strip);
+}
+
+//  Show what is cheap to show for pos while it is being dragged through:
+//  the exact frame if it is cached, else its GOP's keyframe. Nothing else
+//  is decoded; the exact frame is asked for once the drag lets go.
+void scrub_to(size_t pos) {
+    if (pos == gScrubPos) {
+        return;
+    }
+    gScrubPos = pos;
+    gWantedPos = ~(size_t)0;
+    for (auto const &g : gGopsInFlight) {
+        g.second->token()->cancel();
+    }
+    DecodedFrame *df = gFrameCache.peek(pos);
+    if (df) {
+        gScrubKfpos = gShownKfpos = ~(size_t)0;
+        display_frame(df);
+        outTime->value(df->time * 1e-6);
+        return;
+    }
+    gScrubKfpos = gFrameIndex.keyframe_at_or_before(pos);
+    request_keyframe();
+}
+
+void end_scrub() {
+    gScrubPos = gScrubKfpos = gShownKfpos = ~(size_t)0;
+}
+
+void play_tick(void *) {
+    if (!gPlayer.playing()) {
+        return;
+    }
+    gPlayer.feed(gFrames, gTail.fd() >= 0);
+    DecodedFrame *df = gPlayer.present();
+    if (df) {
+        actualTime = targetTime = df->time * 1e-6;
+        shuttle->value(actualTime);
+        outTime->value(actualTime);
+        display_frame(df, true);
+    }
+    else if (gPlayer.finished()) {
+        stop_playback();
+        return;
+    }
+    Fl::repeat_timeout(1.0 / DISPLAY_HZ, play_tick, nullptr);
+}
+
+//  Play from the playhead, or from the start if it is at the end. The
+//  player is fed from gFrames as it goes, so playback goes on into frames
+//  the tail appends.
+void start_playback() {
+    if (gFrames.empty()) {
+        return;
+    }
+    size_t pos = gFrameIndex.lower_bound((uint64_t)(targetTime * 1e6));
+    if (pos + 1 >= gFrames.size()) {
+        pos = 0;
+    }
+    size_t kfpos = gFrameIndex.keyframe_at_or_before(pos);
+    //  whatever was being sought is moot now
+    gWantedPos = ~(size_t)0;
+    for (auto const &g : gGopsInFlight) {
+        g.second->token()->cancel();
+    }
+    end_scrub();
+    if (!gPlayer.start(kfpos, gFrames[pos].time, kPlaySpeeds[speedChoice->value()])) {
+        return;
+    }
+    gPlayer.feed(gFrames, gTail.fd() >= 0);
+    playButton->label("@||");
+    Fl::add_timeout(1.0 / DISPLAY_HZ, play_tick, nullptr);
+}
+
+void stop_playback() {
+    Fl::remove_timeout(play_tick, nullptr);
+    gPlayer.stop();
+    playButton->label("@>");
+}
+
+//  Queue the GOP for pos, then the next ones in the scrub direction, and
+//  cancel in-flight GOPs that are neither.
+void request_frame(size_t pos) {
+    size_t kfpos = gFrameIndex.keyframe_at_or_before(pos);
+    bool forward = targetTime >= gLastRequestTime;
+    gLastRequestTime = targetTime;
+    std::vector<size_t> ahead;
+    size_t kp = kfpos;
+    for (int i = 0; i != DECODE_AHEAD_GOPS; ++i) {
+        if (forward) {
+            kp = gFrameIndex.keyframe_after(kp);
+        }
+        else {
+            if (kp == 0) {
+                break;
+            }
+            kp = gFrameIndex.keyframe_at_or_before(kp - 1);
+        }
+        if (kp >= gFrames.size()) {
+            break;
+        }
+        ahead.push_back(kp);
+    }
+    for (auto const &g : gGopsInFlight) {
+        if (g.first != kfpos && std::find(ahead.begin(), ahead.end(), g.first) == ahead.end()) {
+            g.second->token()->cancel();
+        }
+    }
+    //  the frame itself is not cached, even if the start of its GOP is
+    request_gop(kfpos, true, WorkPriorityInteractive);
+    for (size_t k : ahead) {
+        if (live_gops_in_flight() >= MAX_GOPS_IN_FLIGHT) {
+            break;
+        }
+        request_gop(k, false, WorkPriorityPrefetch);
+    }
+}
+
+void gop_decoded(void *p) {
+    GopDecodeWork *w = (GopDecodeWork *)p;
+    auto found(gGopsInFlight.find(w->kfpos_));
+    if (found != gGopsInFlight.end() && found->second == w) {
+        gGopsInFlight.erase(found);
+    }
+    if (w->numDecoded_ && !w->is_cancelled()) {
+        gFrameCache.insert_gop(w->kfpos_, w->decoded_);
+    }
+    else {
+        //  a partial GOP would look cached to the decode-ahead
+        for (auto df : w->decoded_) {
+            if (df) {
+                gFrameCache.release(df);
+            }
+        }
+    }
+    for (auto df : w->spare_) {
+        gFrameCache.release(df);
+    }
+    if (gWantedPos != ~(size_t)0) {
+        DecodedFrame *df = gFrameCache.peek(gWantedPos);
+        if (df) {
+            show_exact_frame(df);
+        }
+        else if (gGopsInFlight.empty()) {
+            fprintf(stderr, "ERROR: Could not find frame %ld\n", (long)gWantedPos);
+            gWantedPos = ~(size_t)0;
+            actualTime = targetTime;
+        }
+    }
+    delete w;
+}
+
+void keyframe_decoded(void *p) {
+    KeyframeWork *w = (KeyframeWork *)p;
+    gKeyframeInFlight = nullptr;
+    if (w->ok_ && w->kfpos_ == gScrubKfpos) {
+        gShownKfpos = w->kfpos_;
+        display_frame(w->df_);
+        outTime->value(w->df_->time * 1e-6);
+    }
+    else {
+        gFrameCache.release(w->df_);
+    }
+    delete w;
+    request_keyframe();
+}
+
+void thumbs_decoded(void *p) {
+    ThumbWork *w = (ThumbWork *)p;
+    for (size_t i = 0; i != w->keys_.size(); ++i) {
+        if (w->ok_[i]) {
+            gThumbCache.put(w->keys_[i], w->pics_[i]);
+        }
+    }
+    gThumbCache.save_complete();
+    filmstrip->redraw();
+    delete w;
+}
+
 void on_idle(void *) {
+    if (gPlayer.playing()) {
+        if (targetTime == actualTime) {
+            return;
+        }
+        //  the playhead was moved by hand
+        stop_playback();
+    }
     if (targetTime != actualTime) {
         uint64_t time = (uint64_t)ceil(targetTime * 1e6);
-        DecodedFrame *df = get_frame_at(time);
-        if (!df) {
-            fprintf(stderr, "ERROR: Could not find frame at time %lld\n", (long long)time);
+        uint64_t frameTime = determine_frame_time(time, GetFrameModeClosest);
+        size_t pos = gFrameIndex.lower_bound(frameTime);
+        if (pos >= gFrames.size()) {
+            return;
+        }
+        gFrameCache.set_playhead(pos);
+        if (scrubbing()) {
+            scrub_to(pos);
             return;
         }
-        actualTime = df->time * 1e-6;
-        targetTime = actualTime;
-        frame->frame_ = df;
+        end_scrub();
+        if (pos == gWantedPos) {
+            //  already on its way
+            return;
+        }
+        gSeekStartNs = perf_now_ns();
+        DecodedFrame *df = gFrameCache.lookup(pos);
+        if (df) {
+            show_exact_frame(df);
+            return;
+        }
+        gWantedPos = pos;
+        show_standin_frame(pos);
+        request_frame(pos);
+    }
+}
+
+//  'o' toggles the statistics overlay, space plays and stops, '[' and ']'
+//  step the playback speed
+int key_handler(int event) {
+    if (event != FL_SHORTCUT) {
+        return 0;
+    }
+    switch (Fl::event_key()) {
+    case 'o':
+        gShowOverlay = !gShowOverlay;
+        frame->redraw();
+        return 1;
+    case ' ':
+        play_callback(playButton, nullptr);
+        return 1;
+    case '[':
+    case ']': {
+        int v = speedChoice->value() + (Fl::event_key() == ']' ? 1 : -1);
+        if (v >= 0 && v < (int)NUM_PLAY_SPEEDS) {
+            speedChoice->value(v);
+            speed_callback(speedChoice, nullptr);
+        }
+        return 1;
+    }
+    }
+    return 0;
+}
+
+//  the cache fills in the background, so keep the overlay current
+void overlay_tick(void *) {
+    if (gShowOverlay) {
         frame->redraw();
-        outTime->value(actualTime);
     }
+    Fl::repeat_timeout(0.5, overlay_tick, nullptr);
+}
+
+void usage() {
+    fprintf(stderr, "usage: viewtune [-f] [-o] [-c cachemb] [--codec-threads=n] [--codec-thread-type=frame|slice|both] [file.riff]\n");
+    exit(1);
 }
 
 int main(int argc, char const *argv[])
 {
     std::string path;
+    //  one seek decodes one GOP, so let the codec spread it over the cores
+    int codecThreads = 0;
+    int codecThreadType = DecoderThreadFrame | DecoderThreadSlice;
+    while (argv[1] && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-f")) {
+            //  follow a session that is still being recorded
+            gFollow = true;
+        }
+        else if (!strcmp(argv[1], "-o")) {
+            //  start with the seek and cache statistics overlay on
+            gShowOverlay = true;
+        }
+        else if (!strcmp(argv[1], "-c") && argv[2]) {
+            //  decoded frame cache budget, in megabytes
+            gFrameCache.set_budget((size_t)atol(argv[2]) * 1024 * 1024);
+            ++argv;
+            --argc;
+        }
+        else if (!strncmp(argv[1], "--codec-threads=", 16)) {
+            codecThreads = atoi(argv[1] + 16);
+        }
+        else if (!strncmp(argv[1], "--codec-thread-type=", 20)) {
+            if (!(codecThreadType = parse_decoder_thread_type(argv[1] + 20))) {
+                usage();
+            }
+        }
+        else {
+            usage();
+        }
+        ++argv;
+        --argc;
+    }
     if (!argv[1]) {
         char const *cpath = fl_file_chooser("Choose a riff file", "*.riff", NULL);
         if (!cpath) {
@@ -547,22 +1338,42 @@ int main(int argc, char const *argv[])
         exit(1);
     }
 
-    load_all_riffs(path);
+    set_decoder_threads(codecThreads, codecThreadType);
+
+    //  enables Fl::awake() from the decode threads
+    Fl::lock();
+
+    load_all_riffs(path, gFollow);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    start_work_queue(ncpu > 0 ? (int)ncpu : 4);
     analyze_all_riffs();
 
-    Fl_Double_Window win(winWidth, winHeight+titleBarHeight, "Viewer");
+    Fl_Double_Window win(winWidth, winHeight + titleBarHeight + stripHeight + filmstripHeight, "Viewer");
     build_gui();
     win.end();
     win.show();
     mainWindow = &win;
+    request_thumbs();
 
     select_frame_time(0);
     shuttle_callback(shuttle, nullptr);
 
+    if (gFollow && gTail.start(gTailState)) {
+        Fl::add_fd(gTail.fd(), tail_callback, nullptr);
+    }
+
+    Fl::add_handler(key_handler);
+    Fl::add_timeout(0.5, overlay_tick, nullptr);
     Fl::add_idle(on_idle, nullptr);
     int ret = Fl::run();
 
     mainWindow = NULL;
+    gPlayer.stop();
+    stop_work_queue();
+    free_decoders();
+    if (verbose) {
+        gFrameCache.print_stats(stderr);
+    }
     return ret;
 }
 
@@ -0,0 +1,573 @@
+#include "stdafx.h"
+#include "video.h"
+#include "riffs.h"
+#include "riffindex.h"
+#include "workqueue.h"
+#include "frameindex.h"
+#include "framecache.h"
+#include "perfcount.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
+
+/*  Benchmarks for the decode pipeline, run against a real recording.
+ *
+ *  vtbench codec-threads [-n gops] file.riff
+ *      Decodes the same GOPs with each codec threading configuration, and
+ *      reports how long one GOP takes (what a viewtune seek waits for) and
+ *      the overall frame rate.
+ *
+ *  vtbench workqueue [-n items]
+ *      Runs many small work items on 1 to 64 threads, both added from
+ *      outside the queue and fanned out from inside work items (the way
+ *      gobble splits files into GOPs.)
+ *
+ *  vtbench crop [-n pictures]
+ *      Crops and scales a synthetic 640x480 picture with each crop kernel,
+ *      for the 1x copy, the 2x and 4x box fast paths, and bilinear.
+ *
+ *  vtbench suite [-n seeks] [--json out.json] file.riff
+ *      The regression suite, usually run on a vtgen session by "make bench":
+ *      index scan MB/s, decode fps for 1 to ncpu worker threads, latency of
+ *      random seeks and of stepping frame by frame through get_frame_at(),
+ *      and the frame cache hit rate of each. Results are written as JSON.
+ */
+
+extern bool verbose;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct BenchGop {
+    std::vector<VideoFrame> frames;
+};
+
+//  Keeps up to ngops GOPs that start with a keyframe.
+class BenchGopCollector : public RiffScanSink {
+    public:
+        BenchGopCollector(std::vector<BenchGop> &gops, size_t ngops) : gops_(gops), ngops_(ngops) {}
+        void frame(VideoFrame const &vf) {
+            frames_.push_back(vf);
+        }
+        void gop(uint32_t begin, uint32_t end) {
+            if (gops_.size() < ngops_ && frames_[begin].keyframe) {
+                BenchGop g;
+                g.frames.assign(frames_.begin() + begin, frames_.begin() + end);
+                gops_.push_back(g);
+            }
+        }
+        std::vector<BenchGop> &gops_;
+        size_t ngops_;
+        std::vector<VideoFrame> frames_;
+};
+
+//  The first ngops GOPs of the session.
+static bool load_gops(char const *path, size_t ngops, std::vector<BenchGop> &gops) {
+    load_all_riffs(path);
+    for (auto rf : gRiffFiles) {
+        BenchGopCollector bc(gops, ngops);
+        index_riff_file(rf, bc);
+        if (gops.size() >= ngops) {
+            break;
+        }
+    }
+    return !gops.empty();
+}
+
+//  Decodes one GOP on a pooled decoder; returns the number of pictures.
+static size_t decode_gop(BenchGop &g) {
+    decoder_t *d = new_decoder();
+    if (!d) {
+        fprintf(stderr, "could not open a decoder\n");
+        exit(1);
+    }
+    DecodedFrame df;
+    size_t n = 0;
+    FrameRunDecoder run(d, g.frames);
+    while (run.next(&df)) {
+        ++n;
+    }
+    release_decoder(d);
+    return n;
+}
+
+//  Returns the number of pictures; seconds gets the time for each GOP.
+static size_t decode_gops(std::vector<BenchGop> &gops, std::vector<double> &seconds) {
+    size_t n = 0;
+    for (auto &g : gops) {
+        double start = now_seconds();
+        n += decode_gop(g);
+        seconds.push_back(now_seconds() - start);
+    }
+    return n;
+}
+
+struct ThreadConfig {
+    int count;
+    int type;
+    double meanGop;
+    double worstGop;
+    double fps;
+};
+
+static char const *thread_type_name(int type) {
+    switch (type) {
+        case DecoderThreadSlice: return "slice";
+        case DecoderThreadFrame: return "frame";
+        default: return "both";
+    }
+}
+
+static int bench_codec_threads(char const *path, size_t ngops) {
+    std::vector<BenchGop> gops;
+    if (!load_gops(path, ngops, gops)) {
+        fprintf(stderr, "%s: no GOPs found\n", path);
+        return 1;
+    }
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) {
+        ncpu = 1;
+    }
+    std::vector<int> counts;
+    for (int c = 1; c < ncpu; c *= 2) {
+        counts.push_back(c);
+    }
+    counts.push_back((int)ncpu);
+    std::vector<ThreadConfig> configs;
+    for (int c : counts) {
+        for (int type = DecoderThreadSlice; type <= (DecoderThreadSlice | DecoderThreadFrame); ++type) {
+            if (c == 1 && type != DecoderThreadSlice) {
+                continue;
+            }
+            ThreadConfig tc = { c, type, 0, 0, 0 };
+            configs.push_back(tc);
+        }
+    }
+
+    size_t nframes = 0;
+    for (auto const &g : gops) {
+        nframes += g.frames.size();
+    }
+    fprintf(stderr, "%ld GOPs, %ld chunks, %ld cpus\n", (long)gops.size(), (long)nframes, ncpu);
+    printf("%8s %6s %12s %12s %10s\n", "threads", "type", "gop ms", "worst ms", "fps");
+    ThreadConfig const *best = nullptr;
+    for (auto &tc : configs) {
+        set_decoder_threads(tc.count, tc.type);
+        //  opened with the old settings
+        free_decoders();
+        std::vector<double> seconds;
+        //  once to warm up the page cache and the decoder pool
+        decode_gops(gops, seconds);
+        seconds.clear();
+        double start = now_seconds();
+        size_t n = decode_gops(gops, seconds);
+        double total = now_seconds() - start;
+        double sum = 0;
+        for (double s : seconds) {
+            sum += s;
+            tc.worstGop = std::max(tc.worstGop, s);
+        }
+        tc.meanGop = sum / seconds.size();
+        tc.fps = total > 0 ? n / total : 0;
+        printf("%8d %6s %12.2f %12.2f %10.1f\n", tc.count, thread_type_name(tc.type),
+            tc.meanGop * 1e3, tc.worstGop * 1e3, tc.fps);
+        fflush(stdout);
+        if (!best || tc.meanGop < best->meanGop) {
+            best = &tc;
+        }
+    }
+    free_decoders();
+    printf("fastest seek: --codec-threads=%d --codec-thread-type=%s\n",
+        best->count, thread_type_name(best->type));
+    return 0;
+}
+
+
+/*  A few microseconds of arithmetic, standing in for real work. */
+static uint32_t gBenchSink;
+
+class SpinWork : public Work {
+    public:
+        SpinWork(int spins) : spins_(spins) {}
+        char const *name() { return "spin"; }
+        void work() {
+            uint32_t x = (uint32_t)(uintptr_t)this;
+            for (int i = 0; i != spins_; ++i) {
+                x = x * 1664525u + 1013904223u;
+            }
+            __sync_fetch_and_add(&gBenchSink, x & 1);
+        }
+        int spins_;
+};
+
+class FanoutWork : public Work {
+    public:
+        FanoutWork(int children, int spins) : children_(children), spins_(spins) {}
+        char const *name() { return "fanout"; }
+        void work() {
+            for (int i = 0; i != children_; ++i) {
+                add_work(new SpinWork(spins_));
+            }
+        }
+        int children_;
+        int spins_;
+};
+
+static int bench_workqueue(size_t nitems) {
+    int const spins = 1000;
+    int const fanout = 1000;
+    printf("%8s %14s %14s\n", "threads", "flat items/s", "fanout items/s");
+    for (int nt = 1; nt <= 64; nt *= 2) {
+        start_work_queue(nt);
+        double start = now_seconds();
+        for (size_t i = 0; i != nitems; ++i) {
+            add_work(new SpinWork(spins));
+        }
+        wait_for_all_work_to_complete();
+        double flat = now_seconds() - start;
+        start = now_seconds();
+        size_t nparents = (nitems + fanout - 1) / fanout;
+        for (size_t i = 0; i != nparents; ++i) {
+            add_work(new FanoutWork(fanout, spins));
+        }
+        wait_for_all_work_to_complete();
+        double fan = now_seconds() - start;
+        stop_work_queue();
+        printf("%8d %14.0f %14.0f\n", nt, nitems / flat, (nparents * fanout) / fan);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static int bench_crop(size_t npictures) {
+    int const w = 640;
+    int const h = 480;
+    //  codec-like strides, with padding past the picture
+    int const ystride = w + 64;
+    int const uvstride = w / 2 + 32;
+    std::vector<unsigned char> y((size_t)ystride * h), u((size_t)uvstride * h / 2), v((size_t)uvstride * h / 2);
+    uint32_t x = 1;
+    for (auto *p : { &y, &u, &v }) {
+        for (auto &c : *p) {
+            x = x * 1664525u + 1013904223u;
+            c = (unsigned char)(x >> 24);
+        }
+    }
+    char const *specs[] = {
+        "0,120,640,240",
+        "0,120,640,240:320x120",
+        "0,120,640,240:160x60",
+        "0,0,640,480:200x150:bilinear",
+    };
+    YuvScaleKernel kernels[] = { YuvScaleKernelScalar, YuvScaleKernelSSE4 };
+    printf("%-30s %8s %14s\n", "crop", "kernel", "pictures/s");
+    for (auto spec : specs) {
+        CropSpec cs, g;
+        parse_crop_spec(spec, cs);
+        crop_geometry(cs, w, h, g);
+        std::vector<unsigned char> out(yuv420_size(g.outWidth, g.outHeight));
+        for (auto k : kernels) {
+            if (!set_yuv_scale_kernel(k)) {
+                continue;
+            }
+            double start = now_seconds();
+            for (size_t i = 0; i != npictures; ++i) {
+                yuv420_crop(&y[0], &u[0], &v[0], ystride, uvstride, g, &out[0]);
+            }
+            double secs = now_seconds() - start;
+            printf("%-30s %8s %14.0f\n", spec, yuv_scale_kernel_name(k), npictures / secs);
+            fflush(stdout);
+        }
+    }
+    set_yuv_scale_kernel(YuvScaleKernelAuto);
+    return 0;
+}
+
+/*  One GOP per work item, each on its own pooled decoder, like gobble. */
+class GopDecodeWork : public Work {
+    public:
+        GopDecodeWork(BenchGop *g, size_t *count) : gop_(g), count_(count) {}
+        char const *name() { return "gop"; }
+        void work() {
+            __sync_fetch_and_add(count_, decode_gop(*gop_));
+        }
+        BenchGop *gop_;
+        size_t *count_;
+};
+
+struct SeekResult {
+    size_t count;
+    double p50;
+    double p99;
+    double mean;
+    double worst;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static double percentile(std::vector<double> sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+static SeekResult time_seeks(std::vector<uint64_t> const &times) {
+    FrameCache::Stats before = gFrameCache.stats();
+    std::vector<double> ms;
+    for (uint64_t t : times) {
+        double start = now_seconds();
+        if (!get_frame_at(t)) {
+            fprintf(stderr, "no frame at %lld\n", (long long)t);
+        }
+        ms.push_back((now_seconds() - start) * 1e3);
+    }
+    FrameCache::Stats after = gFrameCache.stats();
+    SeekResult r;
+    r.count = ms.size();
+    r.p50 = percentile(ms, 0.5);
+    r.p99 = percentile(ms, 0.99);
+    double sum = 0;
+    r.worst = 0;
+    for (double m : ms) {
+        sum += m;
+        r.worst = std::max(r.worst, m);
+    }
+    r.mean = ms.empty() ? 0 : sum / ms.size();
+    r.hits = after.hits - before.hits;
+    r.misses = after.misses - before.misses;
+    return r;
+}
+
+static void print_seek_json(FILE *f, char const *name, SeekResult const &r, bool last) {
+    uint64_t lookups = r.hits + r.misses;
+    fprintf(f, "    \"%s\": { \"count\": %ld, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"mean_ms\": %.3f, \"worst_ms\": %.3f, "
+        "\"cache_hits\": %llu, \"cache_misses\": %llu, \"cache_hit_rate\": %.4f }%s\n",
+        name, (long)r.count, r.p50, r.p99, r.mean, r.worst, (unsigned long long)r.hits,
+        (unsigned long long)r.misses, lookups ? (double)r.hits / lookups : 0.0, last ? "" : ",");
+}
+
+static int bench_suite(char const *path, size_t nseeks, char const *jsonPath) {
+    load_all_riffs(path);
+    if (gRiffFiles.empty()) {
+        fprintf(stderr, "%s: no segments\n", path);
+        return 1;
+    }
+
+    //  index scan; the first pass warms the page cache, so this measures
+    //  the scanner, not the disk
+    std::vector<std::vector<VideoFrame> > segFrames(gRiffFiles.size());
+    uint64_t bytes = 0;
+    for (size_t i = 0; i != gRiffFiles.size(); ++i) {
+        scan_riff_file(gRiffFiles[i], segFrames[i]);
+        bytes += gRiffFiles[i]->size_;
+    }
+    //  every chunk walked, not just the h264 ones that become frames
+    PerfSnapshot before, after;
+    perf_snapshot(before);
+    double start = now_seconds();
+    for (size_t i = 0; i != gRiffFiles.size(); ++i) {
+        segFrames[i].clear();
+        scan_riff_file(gRiffFiles[i], segFrames[i]);
+    }
+    double scanSecs = now_seconds() - start;
+    perf_snapshot(after);
+    uint64_t chunks = after.value[PerfChunksScanned] - before.value[PerfChunksScanned];
+    double scanMBps = scanSecs > 0 ? bytes / (1024.0 * 1024.0) / scanSecs : 0;
+    fprintf(stderr, "scan: %.1f MB, %llu chunks, %.1f MB/s\n", bytes / (1024.0 * 1024.0),
+        (unsigned long long)chunks, scanMBps);
+
+    //  the whole session, with times relative to its start, as viewtune has it
+    for (auto const &sf : segFrames) {
+        for (auto const &vf : sf) {
+            gFrames.push_back(vf);
+            gFrames.back().index = (uint32_t)(gFrames.size() - 1);
+        }
+    }
+    if (gFrames.empty()) {
+        fprintf(stderr, "%s: no frames\n", path);
+        return 1;
+    }
+    uint64_t base = gFrames[0].pts;
+    for (auto &vf : gFrames) {
+        vf.pts = vf.pts >= base ? vf.pts - base : 0;
+        vf.time = vf.pts;
+    }
+    gFrameIndex.append(gFrames);
+
+    //  decode throughput for each worker count
+    std::vector<BenchGop> gops;
+    size_t begin = 0;
+    for (size_t i = 1; i <= gFrames.size(); ++i) {
+        if (i == gFrames.size() || gFrames[i].keyframe) {
+            if (gFrames[begin].keyframe) {
+                BenchGop g;
+                g.frames.assign(gFrames.begin() + begin, gFrames.begin() + i);
+                gops.push_back(g);
+            }
+            begin = i;
+        }
+    }
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) {
+        ncpu = 1;
+    }
+    std::vector<int> counts;
+    for (int c = 1; c < ncpu; c *= 2) {
+        counts.push_back(c);
+    }
+    counts.push_back((int)ncpu);
+    set_decoder_threads(1, DecoderThreadSlice);
+    std::vector<std::pair<int, double> > decodeFps;
+    for (int nt : counts) {
+        start_work_queue(nt);
+        size_t n = 0;
+        start = now_seconds();
+        for (auto &g : gops) {
+            add_work(new GopDecodeWork(&g, &n));
+        }
+        wait_for_all_work_to_complete();
+        double secs = now_seconds() - start;
+        stop_work_queue();
+        decodeFps.push_back(std::make_pair(nt, secs > 0 ? n / secs : 0));
+        fprintf(stderr, "decode: %d threads, %ld pictures, %.1f fps\n", nt, (long)n, decodeFps.back().second);
+    }
+    free_decoders();
+
+    //  random seeks over the whole session, then stepping through frames
+    //  after one of them, which the GOP cache should mostly serve
+    uint64_t span = gFrames.back().time;
+    std::vector<uint64_t> times;
+    uint32_t x = 12345;
+    for (size_t i = 0; i != nseeks; ++i) {
+        x = x * 1664525u + 1013904223u;
+        times.push_back(span ? (uint64_t)((x >> 8) / (double)(1 << 24) * span) : 0);
+    }
+    SeekResult random = time_seeks(times);
+    times.clear();
+    size_t from = gFrames.size() / 3;
+    for (size_t i = from; i != gFrames.size() && times.size() != nseeks; ++i) {
+        times.push_back(gFrames[i].time);
+    }
+    SeekResult step = time_seeks(times);
+    fprintf(stderr, "random seek: p50 %.2f ms, p99 %.2f ms, %.1f%% cache hits\n", random.p50, random.p99,
+        100.0 * random.hits / std::max<uint64_t>(1, random.hits + random.misses));
+    fprintf(stderr, "step: p50 %.2f ms, p99 %.2f ms, %.1f%% cache hits\n", step.p50, step.p99,
+        100.0 * step.hits / std::max<uint64_t>(1, step.hits + step.misses));
+    FrameCache::Stats cs = gFrameCache.stats();
+    free_decoders();
+    PerfSnapshot counters;
+    perf_snapshot(counters);
+
+    FILE *f = stdout;
+    if (jsonPath && !(f = fopen(jsonPath, "w"))) {
+        perror(jsonPath);
+        return 1;
+    }
+    time_t now = time(nullptr);
+    fprintf(f, "{\n");
+    fprintf(f, "  \"session\": \"%s\",\n", path);
+    fprintf(f, "  \"timestamp\": %lld,\n", (long long)now);
+    fprintf(f, "  \"cpus\": %ld,\n", ncpu);
+    fprintf(f, "  \"segments\": %ld,\n", (long)gRiffFiles.size());
+    fprintf(f, "  \"frames\": %ld,\n", (long)gFrames.size());
+    fprintf(f, "  \"gops\": %ld,\n", (long)gops.size());
+    fprintf(f, "  \"scan\": { \"bytes\": %llu, \"chunks\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.1f },\n",
+        (unsigned long long)bytes, (unsigned long long)chunks, scanSecs, scanMBps);
+    fprintf(f, "  \"decode\": [\n");
+    for (size_t i = 0; i != decodeFps.size(); ++i) {
+        fprintf(f, "    { \"threads\": %d, \"fps\": %.1f }%s\n", decodeFps[i].first, decodeFps[i].second,
+            i + 1 == decodeFps.size() ? "" : ",");
+    }
+    fprintf(f, "  ],\n");
+    fprintf(f, "  \"seek\": {\n");
+    print_seek_json(f, "random", random, false);
+    print_seek_json(f, "step", step, true);
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"cache\": { \"hits\": %llu, \"misses\": %llu, \"inserts\": %llu, \"evictions\": %llu, "
+        "\"bytes\": %ld, \"frames\": %ld, \"gops\": %ld },\n",
+        (unsigned long long)cs.hits, (unsigned long long)cs.misses, (unsigned long long)cs.inserts,
+        (unsigned long long)cs.evictions, (long)cs.bytes, (long)cs.frames, (long)cs.gops);
+    fprintf(f, "  \"counters\": {");
+    for (int i = 0; i != PerfCounterCount; ++i) {
+        fprintf(f, "%s \"%s\": %llu", i ? "," : "", perf_counter_name((PerfCounterId)i),
+            (unsigned long long)counters.value[i]);
+    }
+    fprintf(f, " }\n");
+    fprintf(f, "}\n");
+    bool ok = !ferror(f);
+    if (f != stdout && fclose(f) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: write failed\n", jsonPath ? jsonPath : "stdout");
+        return 1;
+    }
+    return 0;
+}
+
+
+void usage() {
+    fprintf(stderr, "usage: vtbench [-v] codec-threads [-n gops] some-file.riff\n");
+    fprintf(stderr, "       vtbench [-v] workqueue [-n items]\n");
+    fprintf(stderr, "       vtbench [-v] crop [-n pictures]\n");
+    fprintf(stderr, "       vtbench [-v] suite [-n seeks] [--json out.json] some-file.riff\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    if (argv[1] && !strcmp(argv[1], "-v")) {
+        verbose = true;
+        ++argv;
+        --argc;
+    }
+    if (!argv[1]) {
+        usage();
+    }
+    std::string bench(argv[1]);
+    ++argv;
+    --argc;
+    size_t count = 0;
+    char const *json = nullptr;
+    while (argv[1] && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-n") && argv[2]) {
+            count = (size_t)atol(argv[2]);
+            ++argv;
+            --argc;
+        }
+        else if (!strcmp(argv[1], "--json") && argv[2]) {
+            json = argv[2];
+            ++argv;
+            --argc;
+        }
+        else {
+            usage();
+        }
+        ++argv;
+        --argc;
+    }
+    if (bench == "workqueue") {
+        return bench_workqueue(count ? count : 200000);
+    }
+    if (bench == "crop") {
+        return bench_crop(count ? count : 2000);
+    }
+    if (!argv[1]) {
+        usage();
+    }
+    if (bench == "codec-threads") {
+        return bench_codec_threads(argv[1], count ? count : 50);
+    }
+    if (bench == "suite") {
+        return bench_suite(argv[1], count ? count : 200, json);
+    }
+    usage();
+    return 1;
+}
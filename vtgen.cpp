@@ -0,0 +1,425 @@
+#include "stdafx.h"
+#include "video.h"
+#include <vector>
+#include <string>
+#include <math.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <algorithm>
+
+/*  Synthetic recordings, for benchmarks.
+ *
+ *  vtgen session [options] fixture.h264 out-000.riff
+ *      Writes a session of riff segments out-000.riff, out-001.riff, ...
+ *      laid out the way the car records them: an info chunk, then for each
+ *      frame a time chunk (with a steer packet), a pdts chunk and an h264
+ *      chunk. Pictures come from the fixture, an Annex B stream that starts
+ *      with SPS, PPS and an IDR picture followed by P pictures; each GOP
+ *      replays its first access units.
+ *          --gop=n         frames per GOP (default 30; at most the fixture's)
+ *          --segments=n    number of segments (default 4)
+ *          --segment-mb=n  size of each segment (default 64)
+ *          --fps=n         frame rate for pts (default 30)
+ *
+ *  vtgen fixture out.h264
+ *      Writes bench/fixture.h264: 64 pictures of 320x240, intra coded as
+ *      I_PCM, and then each P picture skips all but a strip of four I_PCM
+ *      macroblocks that moves across the frame. It needs no encoder, and
+ *      any Annex B recording (say, from raspivid) can stand in for it.
+ */
+
+//  Exp-Golomb and fixed-width fields, MSB first.
+class BitWriter {
+    public:
+        BitWriter() : cur_(0), nbits_(0) {}
+        void u(int n, uint32_t v) {
+            for (int i = n - 1; i >= 0; --i) {
+                cur_ = (cur_ << 1) | ((v >> i) & 1);
+                if (++nbits_ == 8) {
+                    bytes_.push_back(cur_);
+                    cur_ = 0;
+                    nbits_ = 0;
+                }
+            }
+        }
+        void ue(uint32_t v) {
+            uint32_t x = v + 1;
+            int len = 0;
+            while ((x >> len) > 1) {
+                ++len;
+            }
+            u(len, 0);
+            u(len + 1, x);
+        }
+        void se(int32_t v) {
+            ue(v > 0 ? 2 * v - 1 : -2 * v);
+        }
+        void align_zero() {
+            while (nbits_) {
+                u(1, 0);
+            }
+        }
+        void byte(unsigned char b) {
+            u(8, b);
+        }
+        //  rbsp_trailing_bits()
+        std::vector<unsigned char> &finish() {
+            u(1, 1);
+            align_zero();
+            return bytes_;
+        }
+    private:
+        std::vector<unsigned char> bytes_;
+        unsigned char cur_;
+        int nbits_;
+};
+
+static void put_nal(std::vector<unsigned char> &out, unsigned char header, std::vector<unsigned char> const &rbsp) {
+    static unsigned char const sc[4] = { 0, 0, 0, 1 };
+    out.insert(out.end(), sc, sc + 4);
+    out.push_back(header);
+    int zeros = 0;
+    for (unsigned char b : rbsp) {
+        if (zeros == 2 && b <= 3) {
+            out.push_back(3);
+            zeros = 0;
+        }
+        out.push_back(b);
+        zeros = b ? 0 : zeros + 1;
+    }
+}
+
+#define FIXTURE_WIDTH 320
+#define FIXTURE_HEIGHT 240
+#define FIXTURE_FRAMES 64
+#define FIXTURE_STRIP 4
+
+static void pcm_macroblock(BitWriter &bw, int frame, int mbx, int mby) {
+    bw.align_zero();
+    //  a gradient that drifts with the frame; PCM samples stay in video range
+    for (int y = 0; y != 16; ++y) {
+        for (int x = 0; x != 16; ++x) {
+            bw.byte((unsigned char)(16 + ((mbx * 16 + x + mby * 16 + y + frame * 3) & 0x7f) + (((x ^ y) & 8) ? 64 : 0)));
+        }
+    }
+    for (int c = 0; c != 2; ++c) {
+        for (int i = 0; i != 64; ++i) {
+            bw.byte((unsigned char)(96 + ((mbx * 8 + mby * 4 + frame + c * 40 + i) & 0x3f)));
+        }
+    }
+}
+
+static int make_fixture(char const *path) {
+    int const mbw = FIXTURE_WIDTH / 16;
+    int const mbh = FIXTURE_HEIGHT / 16;
+    int const nmb = mbw * mbh;
+    std::vector<unsigned char> out;
+    {
+        //  baseline, 4:2:0, frame_num in 8 bits, POC type 2 (output order
+        //  is decode order), one reference frame
+        BitWriter bw;
+        bw.u(8, 66);
+        bw.u(8, 0xc0);
+        bw.u(8, 30);
+        bw.ue(0);
+        bw.ue(4);
+        bw.ue(2);
+        bw.ue(1);
+        bw.u(1, 0);
+        bw.ue(mbw - 1);
+        bw.ue(mbh - 1);
+        bw.u(1, 1);
+        bw.u(1, 1);
+        bw.u(1, 0);
+        bw.u(1, 0);
+        put_nal(out, 0x27, bw.finish());
+    }
+    {
+        //  CAVLC, one slice group, qp 26, no deblocking control
+        BitWriter bw;
+        bw.ue(0);
+        bw.ue(0);
+        bw.u(1, 0);
+        bw.u(1, 0);
+        bw.ue(0);
+        bw.ue(0);
+        bw.ue(0);
+        bw.u(1, 0);
+        bw.u(2, 0);
+        bw.se(0);
+        bw.se(0);
+        bw.se(0);
+        bw.u(1, 0);
+        bw.u(1, 0);
+        bw.u(1, 0);
+        put_nal(out, 0x28, bw.finish());
+    }
+    for (int f = 0; f != FIXTURE_FRAMES; ++f) {
+        BitWriter bw;
+        bw.ue(0);
+        bw.ue(f ? 5 : 7);
+        bw.ue(0);
+        bw.u(8, f);
+        if (!f) {
+            bw.ue(0);
+            //  dec_ref_pic_marking: no_output_of_prior_pics, long_term_reference
+            bw.u(1, 0);
+            bw.u(1, 0);
+            bw.se(0);
+            for (int mb = 0; mb != nmb; ++mb) {
+                bw.ue(25);
+                pcm_macroblock(bw, f, mb % mbw, mb / mbw);
+            }
+            put_nal(out, 0x65, bw.finish());
+            continue;
+        }
+        //  num_ref_idx_active_override, ref_pic_list_modification,
+        //  adaptive_ref_pic_marking
+        bw.u(1, 0);
+        bw.u(1, 0);
+        bw.u(1, 0);
+        bw.se(0);
+        int first = (f * FIXTURE_STRIP) % nmb;
+        int last = std::min(first + FIXTURE_STRIP, nmb);
+        bw.ue(first);
+        for (int mb = first; mb != last; ++mb) {
+            if (mb != first) {
+                bw.ue(0);
+            }
+            //  I_PCM in a P slice
+            bw.ue(30);
+            pcm_macroblock(bw, f, mb % mbw, mb / mbw);
+        }
+        if (last != nmb) {
+            bw.ue(nmb - last);
+        }
+        put_nal(out, 0x21, bw.finish());
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    bool ok = fwrite(&out[0], 1, out.size(), f) == out.size();
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "%s: write failed\n", path);
+        return 1;
+    }
+    fprintf(stderr, "%s: %d pictures, %ld bytes\n", path, FIXTURE_FRAMES, (long)out.size());
+    return 0;
+}
+
+//  Split an Annex B stream into access units: parameter sets go with the
+//  slice that follows them, and every slice starts a new unit.
+static bool load_access_units(char const *path, std::vector<std::vector<unsigned char> > &aus) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    std::vector<unsigned char> data;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+    std::vector<size_t> starts;
+    for (size_t i = 0; i + 4 < data.size(); ++i) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 0 && data[i + 3] == 1) {
+            starts.push_back(i);
+            i += 3;
+        }
+    }
+    starts.push_back(data.size());
+    size_t auStart = starts[0];
+    for (size_t i = 0; i + 1 < starts.size(); ++i) {
+        int type = data[starts[i] + 4] & 0x1f;
+        if (type == 1 || type == 5) {
+            aus.push_back(std::vector<unsigned char>(data.begin() + auStart, data.begin() + starts[i + 1]));
+            auStart = starts[i + 1];
+        }
+    }
+    if (aus.empty() || (aus[0][4] & 0x1f) != 7) {
+        fprintf(stderr, "%s: must start with SPS, PPS and an IDR picture\n", path);
+        return false;
+    }
+    //  P pictures that come with their own parameter sets start a new GOP
+    for (size_t i = 1; i != aus.size(); ++i) {
+        if ((aus[i][4] & 0x1f) == 7) {
+            aus.resize(i);
+            break;
+        }
+    }
+    return true;
+}
+
+class SegmentWriter {
+    public:
+        SegmentWriter() : f_(nullptr), size_(0) {}
+        ~SegmentWriter() {
+            close();
+        }
+        bool open(std::string const &path) {
+            path_ = path;
+            if (!(f_ = fopen(path.c_str(), "wb"))) {
+                perror(path.c_str());
+                return false;
+            }
+            FileHeader fh;
+            memcpy(fh.type, "RIFF", 4);
+            fh.zero = 0;
+            memcpy(fh.subtype, "vtun", 4);
+            size_ = 0;
+            put(&fh, sizeof(fh));
+            char const info[] = "vtgen synthetic session";
+            chunk("info", info, sizeof(info));
+            return true;
+        }
+        void chunk(char const *type, void const *data, uint32_t size) {
+            ChunkHeader ch;
+            memcpy(ch.type, type, 4);
+            ch.size = size;
+            put(&ch, sizeof(ch));
+            put(data, size);
+            static char const pad[4] = { 0 };
+            put(pad, ((size + 3) & -4) - size);
+        }
+        uint64_t size() const { return size_; }
+        bool close() {
+            if (!f_) {
+                return true;
+            }
+            bool ok = !ferror(f_);
+            if (fclose(f_) != 0 || !ok) {
+                fprintf(stderr, "%s: write failed\n", path_.c_str());
+                ok = false;
+            }
+            f_ = nullptr;
+            return ok;
+        }
+    private:
+        void put(void const *data, size_t size) {
+            if (size) {
+                fwrite(data, 1, size, f_);
+                size_ += size;
+            }
+        }
+        FILE *f_;
+        uint64_t size_;
+        std::string path_;
+};
+
+//  out-000.riff becomes out-001.riff and so on; the digits are the last run
+//  of digits in the name.
+static std::string segment_path(std::string const &first, int n) {
+    size_t end = first.find_last_of("0123456789");
+    if (end == std::string::npos) {
+        return first;
+    }
+    size_t start = end;
+    while (start > 0 && isdigit((unsigned char)first[start - 1])) {
+        --start;
+    }
+    char num[32];
+    sprintf(num, "%0*d", (int)(end - start + 1), n);
+    return first.substr(0, start) + num + first.substr(end + 1);
+}
+
+static int make_session(char const *fixture, char const *out, int gop, int segments, uint64_t segmentBytes, int fps) {
+    std::vector<std::vector<unsigned char> > aus;
+    if (!load_access_units(fixture, aus)) {
+        return 1;
+    }
+    if (gop > (int)aus.size()) {
+        fprintf(stderr, "%s has %ld pictures; using GOPs of that length\n", fixture, (long)aus.size());
+        gop = (int)aus.size();
+    }
+    uint64_t pts = 1000000;
+    uint64_t frameNo = 0;
+    uint64_t total = 0;
+    for (int s = 0; s != segments; ++s) {
+        std::string path(segment_path(out, s));
+        SegmentWriter sw;
+        if (!sw.open(path)) {
+            return 1;
+        }
+        //  segments end on GOP boundaries
+        while (sw.size() < segmentBytes) {
+            for (int i = 0; i != gop; ++i, ++frameNo) {
+                struct {
+                    uint64_t stamp;
+                    steer_packet sp;
+                } __attribute__((packed)) tc;
+                double t = frameNo / (double)fps;
+                tc.stamp = pts;
+                tc.sp.code = 'S';
+                tc.sp.steer = (int16_t)(sin(t * 0.7) * 16383);
+                tc.sp.throttle = (int16_t)((0.5 + 0.4 * sin(t * 0.13)) * 16383);
+                sw.chunk("time", &tc, sizeof(tc));
+                uint64_t pdts[2] = { pts, pts };
+                sw.chunk("pdts", pdts, sizeof(pdts));
+                sw.chunk("h264", &aus[i][0], (uint32_t)aus[i].size());
+                pts += 1000000 / fps;
+            }
+        }
+        total += sw.size();
+        if (!sw.close()) {
+            return 1;
+        }
+        fprintf(stderr, "%s: %.1f MB\n", path.c_str(), sw.size() / (1024.0 * 1024.0));
+    }
+    fprintf(stderr, "%d segments, %lld frames, %.1f MB\n", segments, (long long)frameNo, total / (1024.0 * 1024.0));
+    return 0;
+}
+
+void usage() {
+    fprintf(stderr, "usage: vtgen session [--gop=n] [--segments=n] [--segment-mb=n] [--fps=n] fixture.h264 out-000.riff\n");
+    fprintf(stderr, "       vtgen fixture out.h264\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    if (!argv[1]) {
+        usage();
+    }
+    std::string cmd(argv[1]);
+    ++argv;
+    --argc;
+    if (cmd == "fixture") {
+        if (!argv[1]) {
+            usage();
+        }
+        return make_fixture(argv[1]);
+    }
+    if (cmd != "session") {
+        usage();
+    }
+    int gop = 30;
+    int segments = 4;
+    int segmentMb = 64;
+    int fps = 30;
+    while (argv[1] && argv[1][0] == '-') {
+        if (!strncmp(argv[1], "--gop=", 6)) {
+            gop = atoi(argv[1] + 6);
+        }
+        else if (!strncmp(argv[1], "--segments=", 11)) {
+            segments = atoi(argv[1] + 11);
+        }
+        else if (!strncmp(argv[1], "--segment-mb=", 13)) {
+            segmentMb = atoi(argv[1] + 13);
+        }
+        else if (!strncmp(argv[1], "--fps=", 6)) {
+            fps = atoi(argv[1] + 6);
+        }
+        else {
+            usage();
+        }
+        ++argv;
+        --argc;
+    }
+    if (!argv[1] || !argv[2] || gop < 1 || segments < 1 || segmentMb < 1 || fps < 1) {
+        usage();
+    }
+    return make_session(argv[1], argv[2], gop, segments, (uint64_t)segmentMb * 1024 * 1024, fps);
+}
@@ -1,54 +1,332 @@
 #include "stdafx.h"
 #include "workqueue.h"
+#include "perfcount.h"
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <list>
+#include <deque>
+#include <vector>
+
+/*  Work-stealing scheduler. Each worker owns a Chase-Lev deque: it pushes
+ *  and pops work at the bottom without locks, and idle workers steal from
+ *  the top. Work added from other threads goes into a shared lock-free
+ *  ring (with a locked overflow list for when the ring is full.) Idle
+ *  workers sleep on a condition variable; wait_for_all_work_to_complete()
+ *  sleeps on another one until the count of outstanding work drops to 0.
+ *
+ *  Interactive and prefetch work is rare, and sits in two small locked
+ *  queues that every worker checks first.
+ */
+
+struct WsArray {
+    WsArray(int64_t n) : size(n), mask(n - 1), items(new Work *[n]) {}
+    ~WsArray() { delete[] items; }
+    Work *get(int64_t i) const { return __atomic_load_n(&items[i & mask], __ATOMIC_RELAXED); }
+    void put(int64_t i, Work *w) { __atomic_store_n(&items[i & mask], w, __ATOMIC_RELAXED); }
+    int64_t size;
+    int64_t mask;
+    Work **items;
+};
+
+#define WS_ABORT ((Work *)1)
+
+class WsDeque {
+    public:
+        WsDeque() : top_(0), bottom_(0), array_(new WsArray(256)) {}
+        ~WsDeque() {
+            delete array_;
+            for (auto a : retired_) {
+                delete a;
+            }
+        }
+
+        //  owner only
+        void push(Work *w) {
+            int64_t b = __atomic_load_n(&bottom_, __ATOMIC_RELAXED);
+            int64_t t = __atomic_load_n(&top_, __ATOMIC_ACQUIRE);
+            WsArray *a = __atomic_load_n(&array_, __ATOMIC_RELAXED);
+            if (b - t > a->size - 1) {
+                a = grow(a, b, t);
+            }
+            a->put(b, w);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            __atomic_store_n(&bottom_, b + 1, __ATOMIC_RELAXED);
+        }
+
+        //  owner only
+        Work *take() {
+            int64_t b = __atomic_load_n(&bottom_, __ATOMIC_RELAXED) - 1;
+            WsArray *a = __atomic_load_n(&array_, __ATOMIC_RELAXED);
+            __atomic_store_n(&bottom_, b, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            int64_t t = __atomic_load_n(&top_, __ATOMIC_RELAXED);
+            Work *w = nullptr;
+            if (t <= b) {
+                w = a->get(b);
+                if (t == b) {
+                    //  the last one; race the thieves for it
+                    if (!__atomic_compare_exchange_n(&top_, &t, t + 1, false,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                        w = nullptr;
+                    }
+                    __atomic_store_n(&bottom_, b + 1, __ATOMIC_RELAXED);
+                }
+            }
+            else {
+                __atomic_store_n(&bottom_, b + 1, __ATOMIC_RELAXED);
+            }
+            return w;
+        }
+
+        //  any thread; WS_ABORT if it lost a race and should try again
+        Work *steal() {
+            int64_t t = __atomic_load_n(&top_, __ATOMIC_ACQUIRE);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            int64_t b = __atomic_load_n(&bottom_, __ATOMIC_ACQUIRE);
+            if (t >= b) {
+                return nullptr;
+            }
+            WsArray *a = __atomic_load_n(&array_, __ATOMIC_ACQUIRE);
+            Work *w = a->get(t);
+            if (!__atomic_compare_exchange_n(&top_, &t, t + 1, false,
+                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                return WS_ABORT;
+            }
+            return w;
+        }
+
+    private:
+        WsArray *grow(WsArray *a, int64_t b, int64_t t) {
+            WsArray *na = new WsArray(a->size * 2);
+            for (int64_t i = t; i != b; ++i) {
+                na->put(i, a->get(i));
+            }
+            //  thieves may still be reading the old array
+            retired_.push_back(a);
+            __atomic_store_n(&array_, na, __ATOMIC_RELEASE);
+            return na;
+        }
+
+        //  top_ and bottom_ on their own cache lines
+        char pad0_[64];
+        int64_t top_;
+        char pad1_[64];
+        int64_t bottom_;
+        char pad2_[64];
+        WsArray *array_;
+        std::vector<WsArray *> retired_;
+};
+
+/*  Bounded multi-producer, multi-consumer ring (after Vyukov.) Each cell
+ *  stores its sequence number minus its index, so the zeroed static array
+ *  starts out valid.
+ */
+#define WQ_INJECT_SIZE 65536
+
+struct InjectCell {
+    int64_t seq;
+    Work *work;
+};
+
+static InjectCell wqInject[WQ_INJECT_SIZE];
+static int64_t wqEnqPos __attribute__((aligned(64)));
+static int64_t wqDeqPos __attribute__((aligned(64)));
+
+static bool inject_push(Work *w) {
+    int64_t pos = __atomic_load_n(&wqEnqPos, __ATOMIC_RELAXED);
+    InjectCell *cell;
+    while (true) {
+        cell = &wqInject[pos & (WQ_INJECT_SIZE - 1)];
+        int64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) + (pos & (WQ_INJECT_SIZE - 1));
+        int64_t diff = seq - pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&wqEnqPos, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return false;
+        }
+        else {
+            pos = __atomic_load_n(&wqEnqPos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->work = w;
+    __atomic_store_n(&cell->seq, pos + 1 - (pos & (WQ_INJECT_SIZE - 1)), __ATOMIC_RELEASE);
+    return true;
+}
+
+static Work *inject_pop() {
+    int64_t pos = __atomic_load_n(&wqDeqPos, __ATOMIC_RELAXED);
+    InjectCell *cell;
+    while (true) {
+        cell = &wqInject[pos & (WQ_INJECT_SIZE - 1)];
+        int64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) + (pos & (WQ_INJECT_SIZE - 1));
+        int64_t diff = seq - (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&wqDeqPos, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return nullptr;
+        }
+        else {
+            pos = __atomic_load_n(&wqDeqPos, __ATOMIC_RELAXED);
+        }
+    }
+    Work *w = cell->work;
+    __atomic_store_n(&cell->seq, pos + WQ_INJECT_SIZE - (pos & (WQ_INJECT_SIZE - 1)), __ATOMIC_RELEASE);
+    return w;
+}
 
 static pthread_mutex_t wqMutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t wqCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wqDoneCond = PTHREAD_COND_INITIALIZER;
 static pthread_t *wqThreads;
+static WsDeque *wqDeques;
 static int wqThreadCount;
 static int wqWorking;
-static int wqComplete;
+static int wqSleeping;
+static int wqPending;       //  added, not yet picked up
+static int wqOutstanding;   //  added, not yet finished
+static int wqOverflowCount;
 static bool wqRunning;
-static std::list<Work *> wqWork;
+static std::list<Work *> wqOverflow;
+static std::deque<Work *> wqInteractive;
+static std::deque<Work *> wqPrefetch;
+static int wqPriorityCount;
+static __thread int wqSelf = -1;
 
 extern bool verbose;
 
-static void *wq_worker(void *) {
-    pthread_mutex_lock(&wqMutex);
-    while (wqRunning) {
-        if (wqWork.empty()) {
-            pthread_cond_wait(&wqCond, &wqMutex);
-            if (!wqRunning) {
-                break;
-            }
+static Work *find_work(int self, uint32_t &rnd) {
+    Work *w = nullptr;
+    if (__atomic_load_n(&wqPriorityCount, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&wqMutex);
+        if (!wqInteractive.empty()) {
+            //  newest first: the latest request is the one that matters
+            w = wqInteractive.back();
+            wqInteractive.pop_back();
         }
-        if (!wqWork.empty()) {
-            Work *w = wqWork.front();
-            wqWork.pop_front();
-            wqWorking += 1;
-            if (verbose) {
-                fprintf(stderr, "got work: %s\n", w->name());
-            }
-            pthread_mutex_unlock(&wqMutex);
-            try {
-                w->work();
-                w->complete();
-            } catch (std::exception const &x) {
-                fprintf(stderr, "Work exception in %s: %s\n", w->name(), x.what());
-                w->error();
-            } catch (...) {
-                fprintf(stderr, "Work exception in %s, unknown kind\n", w->name());
-                w->error();
+        else if (!wqPrefetch.empty()) {
+            w = wqPrefetch.front();
+            wqPrefetch.pop_front();
+        }
+        if (w) {
+            __atomic_sub_fetch(&wqPriorityCount, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&wqMutex);
+        if (w) {
+            return w;
+        }
+    }
+    if ((w = wqDeques[self].take()) != nullptr) {
+        return w;
+    }
+    if ((w = inject_pop()) != nullptr) {
+        return w;
+    }
+    if (__atomic_load_n(&wqOverflowCount, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&wqMutex);
+        if (!wqOverflow.empty()) {
+            w = wqOverflow.front();
+            wqOverflow.pop_front();
+            __atomic_sub_fetch(&wqOverflowCount, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&wqMutex);
+        if (w) {
+            return w;
+        }
+    }
+    //  start at a random victim, so thieves spread out
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 17;
+    rnd ^= rnd << 5;
+    int n = wqThreadCount;
+    int start = (int)(rnd % (uint32_t)n);
+    for (int i = 0; i != n; ++i) {
+        int victim = (start + i) % n;
+        if (victim == self) {
+            continue;
+        }
+        do {
+            w = wqDeques[victim].steal();
+        } while (w == WS_ABORT);
+        if (w) {
+            return w;
+        }
+    }
+    return nullptr;
+}
+
+static void run_work(Work *w) {
+    __atomic_add_fetch(&wqWorking, 1, __ATOMIC_RELAXED);
+    if (verbose) {
+        fprintf(stderr, "got work: %s%s\n", w->name(), w->is_cancelled() ? " (cancelled)" : "");
+    }
+    try {
+        if (w->is_cancelled()) {
+            w->cancelled();
+        }
+        else {
+            w->work();
+            w->complete();
+        }
+    } catch (std::exception const &x) {
+        fprintf(stderr, "Work exception in %s: %s\n", w->name(), x.what());
+        w->error();
+    } catch (...) {
+        fprintf(stderr, "Work exception in %s, unknown kind\n", w->name());
+        w->error();
+    }
+    __atomic_sub_fetch(&wqWorking, 1, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&wqOutstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&wqMutex);
+        pthread_cond_broadcast(&wqDoneCond);
+        pthread_mutex_unlock(&wqMutex);
+    }
+}
+
+static void *wq_worker(void *arg) {
+    int self = (int)(intptr_t)arg;
+    wqSelf = self;
+    uint32_t rnd = 2463534242u + self * 7919u;
+    int idle = 0;
+    uint64_t idleSince = 0;
+    while (__atomic_load_n(&wqRunning, __ATOMIC_ACQUIRE)) {
+        Work *w = find_work(self, rnd);
+        if (w) {
+            __atomic_sub_fetch(&wqPending, 1, __ATOMIC_SEQ_CST);
+            if (idleSince) {
+                perf_add(PerfIdleNs, perf_now_ns() - idleSince);
+                idleSince = 0;
             }
-            pthread_mutex_lock(&wqMutex);
-            wqWorking -= 1;
+            idle = 0;
+            run_work(w);
+            continue;
+        }
+        if (!idleSince) {
+            idleSince = perf_now_ns();
+        }
+        if (++idle < 64) {
+            sched_yield();
+            continue;
+        }
+        //  Dekker style: we publish that we sleep, then look for work;
+        //  add_work publishes the work, then looks for sleepers.
+        pthread_mutex_lock(&wqMutex);
+        __atomic_add_fetch(&wqSleeping, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&wqPending, __ATOMIC_SEQ_CST) && __atomic_load_n(&wqRunning, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&wqCond, &wqMutex);
         }
+        __atomic_sub_fetch(&wqSleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&wqMutex);
+        idle = 0;
     }
-    wqComplete += 1;
-    pthread_cond_broadcast(&wqCond);
-    pthread_mutex_unlock(&wqMutex);
     return 0;
 }
 
@@ -57,12 +335,12 @@ bool start_work_queue(int nthreads) {
         return false;
     }
     wqThreads = new pthread_t[nthreads];
+    wqDeques = new WsDeque[nthreads];
     wqThreadCount = nthreads;
     wqRunning = true;
     wqWorking = 0;
-    wqComplete = 0;
     for (int i = 0; i != nthreads; ++i) {
-        if (pthread_create(&wqThreads[i], NULL, wq_worker, nullptr)) {
+        if (pthread_create(&wqThreads[i], NULL, wq_worker, (void *)(intptr_t)i)) {
             fprintf(stderr, "work queue create failed\n");
             exit(1);
         }
@@ -71,39 +349,69 @@ bool start_work_queue(int nthreads) {
 }
 
 bool add_work(Work *work) {
-    pthread_mutex_lock(&wqMutex);
-    wqWork.push_back(work);
-    pthread_cond_signal(&wqCond);
+    return add_work(work, work->priority());
+}
+
+bool add_work(Work *work, WorkPriority priority) {
+    work->priority_ = priority;
     if (verbose) {
         fprintf(stderr, "work added: %s\n", work->name());
     }
-    pthread_mutex_unlock(&wqMutex);
+    __atomic_add_fetch(&wqOutstanding, 1, __ATOMIC_SEQ_CST);
+    if (priority != WorkPriorityBulk) {
+        pthread_mutex_lock(&wqMutex);
+        if (priority == WorkPriorityInteractive) {
+            wqInteractive.push_back(work);
+        }
+        else {
+            wqPrefetch.push_back(work);
+        }
+        __atomic_add_fetch(&wqPriorityCount, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&wqMutex);
+    }
+    else if (wqSelf >= 0 && wqDeques) {
+        //  from inside a work item; keep it local, where it is cache hot
+        wqDeques[wqSelf].push(work);
+    }
+    else if (!inject_push(work)) {
+        pthread_mutex_lock(&wqMutex);
+        wqOverflow.push_back(work);
+        __atomic_add_fetch(&wqOverflowCount, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&wqMutex);
+    }
+    __atomic_add_fetch(&wqPending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wqSleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&wqMutex);
+        pthread_cond_signal(&wqCond);
+        pthread_mutex_unlock(&wqMutex);
+    }
     return true;
 }
 
 void wait_for_all_work_to_complete() {
     pthread_mutex_lock(&wqMutex);
-    while (wqWorking > 0 || !wqWork.empty()) {
-        pthread_cond_broadcast(&wqCond);
-        pthread_mutex_unlock(&wqMutex);
-        usleep(10000);
-        pthread_mutex_lock(&wqMutex);
+    while (__atomic_load_n(&wqOutstanding, __ATOMIC_SEQ_CST) > 0) {
+        pthread_cond_wait(&wqDoneCond, &wqMutex);
     }
     pthread_mutex_unlock(&wqMutex);
 }
 
 void stop_work_queue() {
-    wqRunning = false;
+    pthread_mutex_lock(&wqMutex);
+    __atomic_store_n(&wqRunning, false, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&wqCond);
+    pthread_mutex_unlock(&wqMutex);
     for (int i = 0; i != wqThreadCount; ++i) {
         void *j = nullptr;
-        pthread_cond_broadcast(&wqCond);
         pthread_join(wqThreads[i], &j);
     }
     delete[] wqThreads;
     wqThreads = nullptr;
+    delete[] wqDeques;
+    wqDeques = nullptr;
+    wqThreadCount = 0;
 }
 
 int get_num_working() {
-    return wqWorking;
+    return __atomic_load_n(&wqWorking, __ATOMIC_RELAXED);
 }
-
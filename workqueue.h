@@ -1,18 +1,72 @@
 #if !defined(workqueue_h)
 #define workqueue_h
 
+/*  Interactive work runs before anything else, newest first, so the latest
+ *  request wins. Prefetch runs next, oldest first. Bulk work (the default)
+ *  goes through the work-stealing deques.
+ */
+enum WorkPriority {
+    WorkPriorityInteractive = 0,
+    WorkPriorityPrefetch = 1,
+    WorkPriorityBulk = 2
+};
+
+/*  Shared by any number of Work items; once cancelled, queued items are
+ *  dropped (their cancelled() is called instead of work()), and running
+ *  items are expected to check is_cancelled() now and then and return.
+ */
+class CancelToken {
+    public:
+        CancelToken() : cancelled_(0), refs_(1) {}
+        void cancel() { __atomic_store_n(&cancelled_, 1, __ATOMIC_RELEASE); }
+        bool cancelled() const { return __atomic_load_n(&cancelled_, __ATOMIC_ACQUIRE) != 0; }
+        void ref() { __sync_fetch_and_add(&refs_, 1); }
+        void unref() {
+            if (__sync_sub_and_fetch(&refs_, 1) == 0) {
+                delete this;
+            }
+        }
+    private:
+        ~CancelToken() {}
+        int cancelled_;
+        int refs_;
+};
+
 class Work {
     public:
+        Work() : priority_(WorkPriorityBulk), token_(nullptr) {}
         virtual void work() = 0;
         virtual char const *name() = 0;
         virtual void complete() { delete this; }
         virtual void error() { delete this; }
+        //  called instead of work() when the token was cancelled first
+        virtual void cancelled() { delete this; }
+
+        WorkPriority priority() const { return priority_; }
+        void set_token(CancelToken *token) {
+            if (token) {
+                token->ref();
+            }
+            if (token_) {
+                token_->unref();
+            }
+            token_ = token;
+        }
+        CancelToken *token() const { return token_; }
+        bool is_cancelled() const { return token_ && token_->cancelled(); }
     protected:
-        virtual ~Work() {}
+        virtual ~Work() {
+            set_token(nullptr);
+        }
+    private:
+        friend bool add_work(Work *work, WorkPriority priority);
+        WorkPriority priority_;
+        CancelToken *token_;
 };
 
 bool start_work_queue(int nthreads);
 bool add_work(Work *work);
+bool add_work(Work *work, WorkPriority priority);
 int get_num_working();
 void wait_for_all_work_to_complete();
 void stop_work_queue();
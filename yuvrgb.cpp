@@ -0,0 +1,252 @@
+#include "stdafx.h"
+#include "yuvrgb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YUVRGB_X86 1
+#include <immintrin.h>
+#endif
+
+/*  All kernels do the same 16-bit fixed point math, so they agree to the
+ *  byte. Inputs are offset and scaled up by 32, multiplied by Q13
+ *  coefficients keeping the high half (pmulhw), which leaves results with
+ *  two fractional bits that are rounded off at the end.
+ *
+ *  Chroma is nearest-neighbor: each U/V sample covers a 2x2 block.
+ */
+
+struct YuvCoefficients {
+    int16_t y;
+    int16_t rv;
+    int16_t gu;
+    int16_t gv;
+    int16_t bu;
+};
+
+static YuvCoefficients const gCoefficients[2] = {
+    //  1.164 * (Y - 16); R += 1.596 V; G -= 0.392 U + 0.813 V; B += 2.017 U
+    { 9539, 13075, 3209, 6660, 16525 },
+    //  1.164 * (Y - 16); R += 1.793 V; G -= 0.213 U + 0.533 V; B += 2.112 U
+    { 9539, 14686, 1747, 4366, 17305 },
+};
+
+typedef int (*YuvRowFn)(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *rgb, int width, YuvCoefficients const &c);
+
+static inline int mulhi(int a, int b) {
+    return (a * b) >> 16;
+}
+
+static inline unsigned char clamp_rgb(int x) {
+    x >>= 2;
+    return x < 0 ? 0 : x > 255 ? 255 : (unsigned char)x;
+}
+
+static void row_scalar(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *rgb, int x, int width, YuvCoefficients const &c) {
+    for (; x < width; ++x) {
+        int yy = mulhi((y[x] - 16) << 5, c.y) + 2;
+        int uu = (u[x >> 1] - 128) << 5;
+        int vv = (v[x >> 1] - 128) << 5;
+        rgb[0] = clamp_rgb(yy + mulhi(vv, c.rv));
+        rgb[1] = clamp_rgb(yy - (mulhi(uu, c.gu) + mulhi(vv, c.gv)));
+        rgb[2] = clamp_rgb(yy + mulhi(uu, c.bu));
+        rgb += 3;
+    }
+}
+
+static int row_none(unsigned char const *, unsigned char const *, unsigned char const *,
+        unsigned char *, int, YuvCoefficients const &) {
+    return 0;
+}
+
+#if defined(YUVRGB_X86)
+
+//  Interleave 16 R, G and B bytes into 48 bytes of RGB.
+__attribute__((target("sse4.1")))
+static inline void store_rgb48(unsigned char *dst, __m128i r, __m128i g, __m128i b) {
+    __m128i o0 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+    __m128i o1 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+    __m128i o2 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+    _mm_storeu_si128((__m128i *)dst, o0);
+    _mm_storeu_si128((__m128i *)(dst + 16), o1);
+    _mm_storeu_si128((__m128i *)(dst + 32), o2);
+}
+
+__attribute__((target("sse4.1")))
+static int row_sse4(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *rgb, int width, YuvCoefficients const &c) {
+    __m128i const cy = _mm_set1_epi16(c.y);
+    __m128i const crv = _mm_set1_epi16(c.rv);
+    __m128i const cgu = _mm_set1_epi16(c.gu);
+    __m128i const cgv = _mm_set1_epi16(c.gv);
+    __m128i const cbu = _mm_set1_epi16(c.bu);
+    __m128i const k16 = _mm_set1_epi16(16);
+    __m128i const k128 = _mm_set1_epi16(128);
+    __m128i const k2 = _mm_set1_epi16(2);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i yy = _mm_loadu_si128((__m128i const *)(y + x));
+        __m128i ylo = _mm_cvtepu8_epi16(yy);
+        __m128i yhi = _mm_cvtepu8_epi16(_mm_srli_si128(yy, 8));
+        ylo = _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(ylo, k16), 5), cy), k2);
+        yhi = _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(yhi, k16), 5), cy), k2);
+        __m128i uu = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i const *)(u + (x >> 1))));
+        __m128i vv = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i const *)(v + (x >> 1))));
+        uu = _mm_slli_epi16(_mm_sub_epi16(uu, k128), 5);
+        vv = _mm_slli_epi16(_mm_sub_epi16(vv, k128), 5);
+        __m128i cr = _mm_mulhi_epi16(vv, crv);
+        __m128i cg = _mm_add_epi16(_mm_mulhi_epi16(uu, cgu), _mm_mulhi_epi16(vv, cgv));
+        __m128i cb = _mm_mulhi_epi16(uu, cbu);
+        __m128i r = _mm_packus_epi16(
+            _mm_srai_epi16(_mm_add_epi16(ylo, _mm_unpacklo_epi16(cr, cr)), 2),
+            _mm_srai_epi16(_mm_add_epi16(yhi, _mm_unpackhi_epi16(cr, cr)), 2));
+        __m128i g = _mm_packus_epi16(
+            _mm_srai_epi16(_mm_sub_epi16(ylo, _mm_unpacklo_epi16(cg, cg)), 2),
+            _mm_srai_epi16(_mm_sub_epi16(yhi, _mm_unpackhi_epi16(cg, cg)), 2));
+        __m128i b = _mm_packus_epi16(
+            _mm_srai_epi16(_mm_add_epi16(ylo, _mm_unpacklo_epi16(cb, cb)), 2),
+            _mm_srai_epi16(_mm_add_epi16(yhi, _mm_unpackhi_epi16(cb, cb)), 2));
+        store_rgb48(rgb + x * 3, r, g, b);
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static int row_avx2(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *rgb, int width, YuvCoefficients const &c) {
+    __m256i const cy = _mm256_set1_epi16(c.y);
+    __m256i const crv = _mm256_set1_epi16(c.rv);
+    __m256i const cgu = _mm256_set1_epi16(c.gu);
+    __m256i const cgv = _mm256_set1_epi16(c.gv);
+    __m256i const cbu = _mm256_set1_epi16(c.bu);
+    __m256i const k16 = _mm256_set1_epi16(16);
+    __m256i const k128 = _mm256_set1_epi16(128);
+    __m256i const k2 = _mm256_set1_epi16(2);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i yy = _mm256_loadu_si256((__m256i const *)(y + x));
+        __m256i ylo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(yy));
+        __m256i yhi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(yy, 1));
+        ylo = _mm256_add_epi16(_mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(ylo, k16), 5), cy), k2);
+        yhi = _mm256_add_epi16(_mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(yhi, k16), 5), cy), k2);
+        __m256i uu = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *)(u + (x >> 1))));
+        __m256i vv = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *)(v + (x >> 1))));
+        uu = _mm256_slli_epi16(_mm256_sub_epi16(uu, k128), 5);
+        vv = _mm256_slli_epi16(_mm256_sub_epi16(vv, k128), 5);
+        __m256i cr = _mm256_mulhi_epi16(vv, crv);
+        __m256i cg = _mm256_add_epi16(_mm256_mulhi_epi16(uu, cgu), _mm256_mulhi_epi16(vv, cgv));
+        __m256i cb = _mm256_mulhi_epi16(uu, cbu);
+        //  unpack works within 128-bit lanes; put the doubled samples back in order
+        __m256i lo = _mm256_unpacklo_epi16(cr, cr), hi = _mm256_unpackhi_epi16(cr, cr);
+        __m256i crlo = _mm256_permute2x128_si256(lo, hi, 0x20), crhi = _mm256_permute2x128_si256(lo, hi, 0x31);
+        lo = _mm256_unpacklo_epi16(cg, cg);
+        hi = _mm256_unpackhi_epi16(cg, cg);
+        __m256i cglo = _mm256_permute2x128_si256(lo, hi, 0x20), cghi = _mm256_permute2x128_si256(lo, hi, 0x31);
+        lo = _mm256_unpacklo_epi16(cb, cb);
+        hi = _mm256_unpackhi_epi16(cb, cb);
+        __m256i cblo = _mm256_permute2x128_si256(lo, hi, 0x20), cbhi = _mm256_permute2x128_si256(lo, hi, 0x31);
+        //  packus also works per lane; 0xD8 swaps the middle quadwords back
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+            _mm256_srai_epi16(_mm256_add_epi16(ylo, crlo), 2),
+            _mm256_srai_epi16(_mm256_add_epi16(yhi, crhi), 2)), 0xD8);
+        __m256i g = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+            _mm256_srai_epi16(_mm256_sub_epi16(ylo, cglo), 2),
+            _mm256_srai_epi16(_mm256_sub_epi16(yhi, cghi), 2)), 0xD8);
+        __m256i b = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+            _mm256_srai_epi16(_mm256_add_epi16(ylo, cblo), 2),
+            _mm256_srai_epi16(_mm256_add_epi16(yhi, cbhi), 2)), 0xD8);
+        store_rgb48(rgb + x * 3, _mm256_castsi256_si128(r), _mm256_castsi256_si128(g), _mm256_castsi256_si128(b));
+        store_rgb48(rgb + x * 3 + 48, _mm256_extracti128_si256(r, 1), _mm256_extracti128_si256(g, 1),
+                _mm256_extracti128_si256(b, 1));
+    }
+    return x;
+}
+
+#endif  //  YUVRGB_X86
+
+static bool kernel_supported(YuvRgbKernel k) {
+    switch (k) {
+        case YuvRgbKernelScalar:
+            return true;
+#if defined(YUVRGB_X86)
+        case YuvRgbKernelSSE4:
+            return __builtin_cpu_supports("sse4.1");
+        case YuvRgbKernelAVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+static YuvRgbKernel gKernel = YuvRgbKernelAuto;
+static YuvRowFn gRowFn = nullptr;
+
+bool set_yuv_rgb_kernel(YuvRgbKernel k) {
+    if (k == YuvRgbKernelAuto) {
+        k = kernel_supported(YuvRgbKernelAVX2) ? YuvRgbKernelAVX2 :
+            kernel_supported(YuvRgbKernelSSE4) ? YuvRgbKernelSSE4 : YuvRgbKernelScalar;
+    }
+    if (!kernel_supported(k)) {
+        return false;
+    }
+    switch (k) {
+#if defined(YUVRGB_X86)
+        case YuvRgbKernelSSE4:
+            gRowFn = row_sse4;
+            break;
+        case YuvRgbKernelAVX2:
+            gRowFn = row_avx2;
+            break;
+#endif
+        default:
+            gRowFn = row_none;
+            break;
+    }
+    gKernel = k;
+    return true;
+}
+
+YuvRgbKernel yuv_rgb_kernel() {
+    if (!gRowFn) {
+        set_yuv_rgb_kernel(YuvRgbKernelAuto);
+    }
+    return gKernel;
+}
+
+char const *yuv_rgb_kernel_name(YuvRgbKernel k) {
+    switch (k) {
+        case YuvRgbKernelScalar: return "scalar";
+        case YuvRgbKernelSSE4: return "sse4";
+        case YuvRgbKernelAVX2: return "avx2";
+        default: return "auto";
+    }
+}
+
+void yuv420_to_rgb(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        int width, int height, int ystride, int uvstride,
+        unsigned char *rgb, int rgbstride, YuvMatrix matrix) {
+    if (!gRowFn) {
+        set_yuv_rgb_kernel(YuvRgbKernelAuto);
+    }
+    YuvRowFn fn = gRowFn;
+    YuvCoefficients const &c = gCoefficients[matrix == YuvMatrixBT709 ? 1 : 0];
+    for (int r = 0; r != height; ++r) {
+        unsigned char const *yr = y + (size_t)ystride * r;
+        unsigned char const *ur = u + (size_t)uvstride * (r >> 1);
+        unsigned char const *vr = v + (size_t)uvstride * (r >> 1);
+        unsigned char *dr = rgb + (size_t)rgbstride * r;
+        //  the vector kernels stop at the last full block; finish the row here
+        int x = fn(yr, ur, vr, dr, width, c);
+        row_scalar(yr, ur, vr, dr + x * 3, x, width, c);
+    }
+}
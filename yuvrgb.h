@@ -0,0 +1,33 @@
+#if !defined(yuvrgb_h)
+#define yuvrgb_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*  Planar YUV 4:2:0 (video range) to interleaved 8-bit RGB. The scalar code
+ *  is the reference; the SSE4 and AVX2 kernels produce the same bytes, and
+ *  the fastest one the CPU supports is picked on first use.
+ */
+
+enum YuvMatrix {
+    YuvMatrixBT601 = 0,
+    YuvMatrixBT709 = 1
+};
+
+enum YuvRgbKernel {
+    YuvRgbKernelAuto = 0,
+    YuvRgbKernelScalar = 1,
+    YuvRgbKernelSSE4 = 2,
+    YuvRgbKernelAVX2 = 3
+};
+
+void yuv420_to_rgb(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        int width, int height, int ystride, int uvstride,
+        unsigned char *rgb, int rgbstride, YuvMatrix matrix);
+
+/* Force a kernel (for benchmarks); returns false if the CPU lacks it. */
+bool set_yuv_rgb_kernel(YuvRgbKernel k);
+YuvRgbKernel yuv_rgb_kernel();
+char const *yuv_rgb_kernel_name(YuvRgbKernel k);
+
+#endif  //  yuvrgb_h
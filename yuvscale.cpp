@@ -0,0 +1,335 @@
+#include "stdafx.h"
+#include "yuvscale.h"
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YUVSCALE_X86 1
+#include <immintrin.h>
+#endif
+
+/*  Each plane is scaled on its own. Box filtering rounds the block average
+ *  to nearest. Bilinear filtering samples at pixel centers with 7-bit
+ *  weights: a horizontal pass into 16-bit rows (at most 255 * 128), then a
+ *  vertical blend of two such rows in 32 bits, rounded off by 14 bits.
+ */
+
+typedef int (*BoxRowFn)(unsigned char const *const *rows, unsigned char *dst, int width);
+typedef int (*BlendRowFn)(int16_t const *h0, int16_t const *h1, int weight, unsigned char *dst, int width);
+
+static int box_none(unsigned char const *const *, unsigned char *, int) {
+    return 0;
+}
+
+static int blend_none(int16_t const *, int16_t const *, int, unsigned char *, int) {
+    return 0;
+}
+
+static void box_scalar(unsigned char const *const *rows, int fx, int fy,
+        unsigned char *dst, int x, int width) {
+    int n = fx * fy;
+    for (; x < width; ++x) {
+        int sum = 0;
+        for (int r = 0; r != fy; ++r) {
+            unsigned char const *s = rows[r] + x * fx;
+            for (int c = 0; c != fx; ++c) {
+                sum += s[c];
+            }
+        }
+        dst[x] = (unsigned char)((sum + n / 2) / n);
+    }
+}
+
+static void blend_scalar(int16_t const *h0, int16_t const *h1, int weight,
+        unsigned char *dst, int x, int width) {
+    for (; x < width; ++x) {
+        dst[x] = (unsigned char)((h0[x] * (128 - weight) + h1[x] * weight + 8192) >> 14);
+    }
+}
+
+#if defined(YUVSCALE_X86)
+
+__attribute__((target("sse4.1")))
+static int box2_sse4(unsigned char const *const *rows, unsigned char *dst, int width) {
+    __m128i const ones = _mm_set1_epi8(1);
+    __m128i const k2 = _mm_set1_epi16(2);
+    unsigned char const *r0 = rows[0];
+    unsigned char const *r1 = rows[1];
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i s0 = _mm_add_epi16(
+            _mm_maddubs_epi16(_mm_loadu_si128((__m128i const *)(r0 + 2 * x)), ones),
+            _mm_maddubs_epi16(_mm_loadu_si128((__m128i const *)(r1 + 2 * x)), ones));
+        __m128i s1 = _mm_add_epi16(
+            _mm_maddubs_epi16(_mm_loadu_si128((__m128i const *)(r0 + 2 * x + 16)), ones),
+            _mm_maddubs_epi16(_mm_loadu_si128((__m128i const *)(r1 + 2 * x + 16)), ones));
+        s0 = _mm_srli_epi16(_mm_add_epi16(s0, k2), 2);
+        s1 = _mm_srli_epi16(_mm_add_epi16(s1, k2), 2);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(s0, s1));
+    }
+    return x;
+}
+
+__attribute__((target("sse4.1")))
+static int box4_sse4(unsigned char const *const *rows, unsigned char *dst, int width) {
+    __m128i const ones = _mm_set1_epi8(1);
+    __m128i const k8 = _mm_set1_epi16(8);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        //  p[k] holds pair sums over all four rows for source bytes
+        //  16k to 16k+15; hadd then adds neighboring pairs into 4x4 blocks
+        __m128i p[4];
+        for (int k = 0; k != 4; ++k) {
+            p[k] = _mm_add_epi16(_mm_add_epi16(
+                _mm_maddubs_epi16(_mm_loadu_si128((__m128i const *)(rows[0] + 4 * x + 16 * k)), ones),
+                _mm_maddubs_epi16(_mm_loadu_si128((__m128i const *)(rows[1] + 4 * x + 16 * k)), ones)),
+                _mm_add_epi16(
+                _mm_maddubs_epi16(_mm_loadu_si128((__m128i const *)(rows[2] + 4 * x + 16 * k)), ones),
+                _mm_maddubs_epi16(_mm_loadu_si128((__m128i const *)(rows[3] + 4 * x + 16 * k)), ones)));
+        }
+        __m128i q0 = _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi16(p[0], p[1]), k8), 4);
+        __m128i q1 = _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi16(p[2], p[3]), k8), 4);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(q0, q1));
+    }
+    return x;
+}
+
+__attribute__((target("sse4.1")))
+static int blend_sse4(int16_t const *h0, int16_t const *h1, int weight, unsigned char *dst, int width) {
+    __m128i const w = _mm_set1_epi32(((uint32_t)weight << 16) | (uint32_t)(128 - weight));
+    __m128i const round = _mm_set1_epi32(8192);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i a = _mm_loadu_si128((__m128i const *)(h0 + x));
+        __m128i b = _mm_loadu_si128((__m128i const *)(h1 + x));
+        __m128i lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), w), round), 14);
+        __m128i hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), w), round), 14);
+        __m128i r = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(r, r));
+    }
+    return x;
+}
+
+#endif  //  YUVSCALE_X86
+
+static bool kernel_supported(YuvScaleKernel k) {
+    switch (k) {
+        case YuvScaleKernelScalar:
+            return true;
+#if defined(YUVSCALE_X86)
+        case YuvScaleKernelSSE4:
+            return __builtin_cpu_supports("sse4.1");
+#endif
+        default:
+            return false;
+    }
+}
+
+static YuvScaleKernel gKernel = YuvScaleKernelAuto;
+static BoxRowFn gBox2Fn = nullptr;
+static BoxRowFn gBox4Fn = nullptr;
+static BlendRowFn gBlendFn = nullptr;
+
+bool set_yuv_scale_kernel(YuvScaleKernel k) {
+    if (k == YuvScaleKernelAuto) {
+        k = kernel_supported(YuvScaleKernelSSE4) ? YuvScaleKernelSSE4 : YuvScaleKernelScalar;
+    }
+    if (!kernel_supported(k)) {
+        return false;
+    }
+    switch (k) {
+#if defined(YUVSCALE_X86)
+        case YuvScaleKernelSSE4:
+            gBox2Fn = box2_sse4;
+            gBox4Fn = box4_sse4;
+            gBlendFn = blend_sse4;
+            break;
+#endif
+        default:
+            gBox2Fn = box_none;
+            gBox4Fn = box_none;
+            gBlendFn = blend_none;
+            break;
+    }
+    gKernel = k;
+    return true;
+}
+
+YuvScaleKernel yuv_scale_kernel() {
+    if (!gBlendFn) {
+        set_yuv_scale_kernel(YuvScaleKernelAuto);
+    }
+    return gKernel;
+}
+
+char const *yuv_scale_kernel_name(YuvScaleKernel k) {
+    switch (k) {
+        case YuvScaleKernelScalar: return "scalar";
+        case YuvScaleKernelSSE4: return "sse4";
+        default: return "auto";
+    }
+}
+
+static void box_plane(unsigned char const *src, int stride, int fx, int fy,
+        unsigned char *dst, int dw, int dh) {
+    BoxRowFn fn = (fx == 2 && fy == 2) ? gBox2Fn : (fx == 4 && fy == 4) ? gBox4Fn : box_none;
+    unsigned char const *rows[64];
+    for (int r = 0; r != dh; ++r, dst += dw) {
+        for (int i = 0; i != fy; ++i) {
+            rows[i] = src + (size_t)stride * (r * fy + i);
+        }
+        int x = fn(rows, dst, dw);
+        box_scalar(rows, fx, fy, dst, x, dw);
+    }
+}
+
+//  Source position and 7-bit weight of each output sample, at pixel centers.
+static void bilinear_taps(int sn, int dn, std::vector<int> &index, std::vector<int> &weight) {
+    index.resize(dn);
+    weight.resize(dn);
+    for (int i = 0; i != dn; ++i) {
+        int64_t pos = ((int64_t)(2 * i + 1) * sn * 128) / (2 * dn) - 64;
+        if (pos < 0) {
+            pos = 0;
+        }
+        int ix = (int)(pos >> 7);
+        int w = (int)(pos & 127);
+        if (ix >= sn - 1) {
+            ix = sn - 1;
+            w = 0;
+        }
+        index[i] = ix;
+        weight[i] = w;
+    }
+}
+
+static void bilinear_plane(unsigned char const *src, int stride, int sw, int sh,
+        unsigned char *dst, int dw, int dh) {
+    std::vector<int> xi, xw, yi, yw;
+    bilinear_taps(sw, dw, xi, xw);
+    bilinear_taps(sh, dh, yi, yw);
+    //  two horizontally filtered rows, tagged with their source row
+    std::vector<int16_t> hrow[2];
+    int hsrc[2] = { -1, -1 };
+    hrow[0].resize(dw);
+    hrow[1].resize(dw);
+    BlendRowFn fn = gBlendFn;
+    for (int r = 0; r != dh; ++r, dst += dw) {
+        int want[2] = { yi[r], yi[r] + 1 < sh ? yi[r] + 1 : yi[r] };
+        for (int k = 0; k != 2; ++k) {
+            if (hsrc[k] == want[k]) {
+                continue;
+            }
+            if (k == 0 && hsrc[1] == want[0]) {
+                std::swap(hrow[0], hrow[1]);
+                std::swap(hsrc[0], hsrc[1]);
+                continue;
+            }
+            unsigned char const *s = src + (size_t)stride * want[k];
+            int16_t *h = &hrow[k][0];
+            for (int x = 0; x != dw; ++x) {
+                int i = xi[x];
+                int i1 = i + 1 < sw ? i + 1 : i;
+                h[x] = (int16_t)(s[i] * (128 - xw[x]) + s[i1] * xw[x]);
+            }
+            hsrc[k] = want[k];
+        }
+        int x = fn(&hrow[0][0], &hrow[1][0], yw[r], dst, dw);
+        blend_scalar(&hrow[0][0], &hrow[1][0], yw[r], dst, x, dw);
+    }
+}
+
+static void scale_plane(unsigned char const *src, int stride, int sw, int sh,
+        unsigned char *dst, int dw, int dh, CropFilter filter) {
+    if (sw == dw && sh == dh) {
+        for (int r = 0; r != dh; ++r) {
+            memcpy(dst + (size_t)dw * r, src + (size_t)stride * r, dw);
+        }
+    }
+    else if (filter == CropFilterBox && sw % dw == 0 && sh % dh == 0 && sh / dh <= 64) {
+        box_plane(src, stride, sw / dw, sh / dh, dst, dw, dh);
+    }
+    else {
+        bilinear_plane(src, stride, sw, sh, dst, dw, dh);
+    }
+}
+
+size_t yuv420_size(int width, int height) {
+    return (size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+}
+
+void crop_geometry(CropSpec const &spec, int width, int height, CropSpec &out) {
+    out = spec;
+    out.x = spec.x < 0 ? 0 : spec.x & ~1;
+    out.y = spec.y < 0 ? 0 : spec.y & ~1;
+    if (out.x > width - 2) {
+        out.x = 0;
+    }
+    if (out.y > height - 2) {
+        out.y = 0;
+    }
+    out.width = spec.width > 0 ? spec.width : width - out.x;
+    out.height = spec.height > 0 ? spec.height : height - out.y;
+    if (out.width > width - out.x) {
+        out.width = width - out.x;
+    }
+    if (out.height > height - out.y) {
+        out.height = height - out.y;
+    }
+    out.width = out.width < 2 ? 2 : out.width & ~1;
+    out.height = out.height < 2 ? 2 : out.height & ~1;
+    out.outWidth = spec.outWidth > 0 ? spec.outWidth : out.width;
+    out.outHeight = spec.outHeight > 0 ? spec.outHeight : out.height;
+}
+
+void yuv420_crop(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        int ystride, int uvstride, CropSpec const &spec, unsigned char *dst) {
+    if (!gBlendFn) {
+        set_yuv_scale_kernel(YuvScaleKernelAuto);
+    }
+    int cw = (spec.outWidth + 1) / 2;
+    int ch = (spec.outHeight + 1) / 2;
+    size_t coff = (size_t)uvstride * (spec.y / 2) + spec.x / 2;
+    scale_plane(y + (size_t)ystride * spec.y + spec.x, ystride, spec.width, spec.height,
+            dst, spec.outWidth, spec.outHeight, spec.filter);
+    dst += (size_t)spec.outWidth * spec.outHeight;
+    scale_plane(u + coff, uvstride, spec.width / 2, spec.height / 2, dst, cw, ch, spec.filter);
+    dst += (size_t)cw * ch;
+    scale_plane(v + coff, uvstride, spec.width / 2, spec.height / 2, dst, cw, ch, spec.filter);
+}
+
+static CropSpec gCropSpec = { 0, 0, 0, 0, 0, 0, CropFilterBox };
+
+void set_crop_spec(CropSpec const &spec) {
+    gCropSpec = spec;
+}
+
+CropSpec const &crop_spec() {
+    return gCropSpec;
+}
+
+bool parse_crop_spec(char const *str, CropSpec &spec) {
+    CropSpec s = { 0, 0, 0, 0, 0, 0, CropFilterBox };
+    char const *p = str;
+    if (sscanf(p, "%d,%d,%d,%d", &s.x, &s.y, &s.width, &s.height) != 4 ||
+            s.x < 0 || s.y < 0 || s.width < 0 || s.height < 0) {
+        return false;
+    }
+    while ((p = strchr(p, ':')) != nullptr) {
+        ++p;
+        if (!strncmp(p, "box", 3) && (p[3] == 0 || p[3] == ':')) {
+            s.filter = CropFilterBox;
+        }
+        else if (!strncmp(p, "bilinear", 8) && (p[8] == 0 || p[8] == ':')) {
+            s.filter = CropFilterBilinear;
+        }
+        else if (sscanf(p, "%dx%d", &s.outWidth, &s.outHeight) != 2 ||
+                s.outWidth < 1 || s.outHeight < 1) {
+            return false;
+        }
+    }
+    spec = s;
+    return true;
+}
@@ -0,0 +1,59 @@
+#if !defined(yuvscale_h)
+#define yuvscale_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*  Crop and resize planar YUV 4:2:0, reading straight from the decoder's
+ *  planes and writing packed Y, U, V at the output size. Box filtering
+ *  averages whole blocks and needs the crop to be an exact multiple of the
+ *  output; anything else is filtered bilinearly. 1x is a copy, and 2x and
+ *  4x box decimation have vector kernels. As with yuvrgb, the scalar code
+ *  is the reference and the vector kernels produce the same bytes.
+ */
+
+enum CropFilter {
+    CropFilterBox = 0,
+    CropFilterBilinear = 1
+};
+
+/* Offsets and sizes are in luma pixels. A crop size of 0 runs to the edge
+ * of the picture, and an output size of 0 is the (clamped) crop size. The
+ * crop origin and sizes are rounded down to even, so chroma lines up and
+ * the crop stays inside the picture; sizes are at least 2. */
+struct CropSpec {
+    int x;
+    int y;
+    int width;
+    int height;
+    int outWidth;
+    int outHeight;
+    CropFilter filter;
+};
+
+/* The crop that DecodedFrame::crop() uses; set it before decoding starts. */
+void set_crop_spec(CropSpec const &spec);
+CropSpec const &crop_spec();
+/* "x,y,w,h[:WxH][:box|bilinear]", e.g. "0,120,640,240:160x60" */
+bool parse_crop_spec(char const *str, CropSpec &spec);
+
+/* Resolve spec against a picture of width x height. */
+void crop_geometry(CropSpec const &spec, int width, int height, CropSpec &out);
+/* dst gets outWidth*outHeight luma bytes followed by two chroma planes of
+ * ((outWidth+1)/2)*((outHeight+1)/2); spec must come from crop_geometry(). */
+void yuv420_crop(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        int ystride, int uvstride, CropSpec const &spec, unsigned char *dst);
+size_t yuv420_size(int width, int height);
+
+enum YuvScaleKernel {
+    YuvScaleKernelAuto = 0,
+    YuvScaleKernelScalar = 1,
+    YuvScaleKernelSSE4 = 2
+};
+
+/* Force a kernel (for benchmarks); returns false if the CPU lacks it. */
+bool set_yuv_scale_kernel(YuvScaleKernel k);
+YuvScaleKernel yuv_scale_kernel();
+char const *yuv_scale_kernel_name(YuvScaleKernel k);
+
+#endif  //  yuvscale_h